@@ -13,6 +13,7 @@ LOCAL_C_INCLUDES := \
 LOCAL_SRC_FILES := \
 		leo-gps.c \
 		leo-gps-rpc.c \
+		leo-gps-filter.c \
 		time.cpp \
 
 include $(BUILD_SHARED_LIBRARY)
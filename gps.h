@@ -30,6 +30,12 @@ typedef int64_t GpsUtcTime;
 /** Maximum number of SVs for gps_sv_status_callback(). */
 #define GPS_MAX_SVS 32
 
+/** Maximum number of SVs for gps_ext_sv_status_callback(). */
+#define GPS_EXT_MAX_SVS 64
+
+/** Highest PRN that can be reported in a GpsExtSvStatus. */
+#define GPS_EXT_MAX_PRN 511
+
 /** Requested mode for GPS operation. */
 typedef uint16_t GpsPositionMode;
 // IMPORTANT: Note that the following values must match
@@ -70,6 +76,11 @@ typedef uint16_t GpsLocationFlags;
 #define GPS_LOCATION_HAS_BEARING    0x0008
 /** GpsLocation has valid accuracy. */
 #define GPS_LOCATION_HAS_ACCURACY   0x0010
+/** GpsLocation was dead-reckoned from the last fix, not measured.
+ *  HAL extension, unknown to GpsLocationProvider.java, which passes such
+ *  locations on to apps as if they were real. Only set when predictions
+ *  are turned on with GPS1_PREDICTION_RATE in gps.conf, off by default. */
+#define GPS_LOCATION_IS_PREDICTED   0x8000
 
 /** Flags used to specify which aiding data to delete
     when calling delete_aiding_data(). */
@@ -114,6 +125,11 @@ typedef uint16_t AGpsStatusValue;
  */
 #define GPS_XTRA_INTERFACE      "gps-xtra"
 
+/**
+ * Name for the GPS XTRA file interface.
+ */
+#define GPS_XTRA_FILE_INTERFACE      "gps-xtra-file"
+
 /**
  * Name for the GPS DEBUG interface.
  */
@@ -129,6 +145,11 @@ typedef uint16_t AGpsStatusValue;
  */
 #define GPS_PRIVACY_INTERFACE      "privacy"
 
+/**
+ * Name for the extended (multi-constellation) SV status interface.
+ */
+#define GPS_EXT_SV_INTERFACE      "gps-ext-sv"
+
 /** Represents a location. */
 typedef struct {
     /** Contains GpsLocationFlags bits. */
@@ -192,6 +213,51 @@ typedef struct {
         uint32_t    used_in_fix_mask;
 } GpsSvStatus;
 
+/** Satellite system of an SV. */
+typedef uint8_t GpsConstellation;
+#define GPS_CONSTELLATION_UNKNOWN   0
+#define GPS_CONSTELLATION_GPS       1
+#define GPS_CONSTELLATION_SBAS      2
+#define GPS_CONSTELLATION_GLONASS   3
+#define GPS_CONSTELLATION_QZSS      4
+#define GPS_CONSTELLATION_BEIDOU    5
+#define GPS_CONSTELLATION_GALILEO   6
+
+/** Represents SV information for any constellation. */
+typedef struct {
+    /** PRN of the SV, unique across constellations: GPS 1-32,
+     * SBAS 33-64 and 120-158, GLONASS 65-96, QZSS 193-200,
+     * BeiDou 201-263, Galileo 301-336. */
+    int              prn;
+    /** Signal to noise ratio. */
+    float            snr;
+    /** Elevation of SV in degrees. */
+    float            elevation;
+    /** Azimuth of SV in degrees. */
+    float            azimuth;
+    /** Satellite system of the SV. */
+    GpsConstellation constellation;
+} GpsExtSvInfo;
+
+/** Represents SV status for all constellations. */
+typedef struct {
+        /** Number of SVs currently visible. */
+        int          num_svs;
+
+        /** Contains an array of SV information. */
+        GpsExtSvInfo sv_list[GPS_EXT_MAX_SVS];
+
+        /**
+         * Represents a bit set, indexed by PRN - 1, of the SVs
+         * used for computing the most recent position fix.
+         */
+        uint32_t     used_in_fix_mask[(GPS_EXT_MAX_PRN + 31) / 32];
+} GpsExtSvStatus;
+
+/** Tests whether a PRN was used in the most recent fix. */
+#define GPS_EXT_SV_USED_IN_FIX(_status, _prn) \
+    (((_status)->used_in_fix_mask[((_prn) - 1) >> 5] >> (((_prn) - 1) & 31)) & 1)
+
 /** Callback with location information. */
 typedef void (* gps_location_callback)(GpsLocation* location);
 
@@ -279,6 +345,33 @@ typedef struct {
     int  (*inject_xtra_data)( char* data, int length );
 } GpsXtraInterface;
 
+/** Extended interface for injecting XTRA data straight from a file,
+ *  which is read one part at a time rather than whole. Requires the
+ *  XTRA interface to have been initialized. */
+typedef struct {
+    /** Injects the XTRA file at path into the GPS. */
+    int  (*inject_xtra_file)( const char* path );
+    /** Injects the XTRA file open on fd into the GPS. fd is not closed. */
+    int  (*inject_xtra_fd)( int fd );
+} GpsXtraFileInterface;
+
+/** Callback with extended SV status information. */
+typedef void (* gps_ext_sv_status_callback)(GpsExtSvStatus* sv_info);
+
+/** Callback structure for the extended SV status interface. */
+typedef struct {
+        gps_ext_sv_status_callback ext_sv_status_cb;
+} GpsExtSvCallbacks;
+
+/** Extended interface for multi-constellation SV status. */
+typedef struct {
+    /**
+     * Provides the callback used to report every visible SV, in
+     * addition to the GPS_MAX_SVS ones reported by sv_status_cb.
+     */
+    int  (*init)( GpsExtSvCallbacks* callbacks );
+} GpsExtSvInterface;
+
 /** Extended interface for DEBUG support. */
 typedef struct {
     /**
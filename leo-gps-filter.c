@@ -0,0 +1,301 @@
+/******************************************************************************
+ * Fix filter of GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * leo-gps-filter.c
+ *
+ * Copyright (C) 2009-2010 The XDAndroid Project
+ * Copyright (C) 2010      dan1j3l @ xda-developers
+ * Copyright (C) 2011      tytung  @ xda-developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <cutils/log.h>
+#include <gps.h>
+#include "leo-gps-geo.h"
+
+#define  LOG_TAG  "gps_leo_filter"
+
+#define  GPS_DEBUG  0
+
+#if GPS_DEBUG
+#  define  D(...)   LOGD(__VA_ARGS__)
+#else
+#  define  D(...)   ((void)0)
+#endif
+
+/* constant-velocity Kalman filter over the fixes handed to location_cb.
+ * positions are tracked in meters east/north/up of a reference point (the
+ * first fix after a reset), each axis as an independent { position,
+ * velocity } pair driven by white acceleration noise. with diagonal
+ * measurement noise the axes don't couple, so each update is a handful of
+ * scalar operations on 2x2 covariances and needs no allocation.
+ *
+ * a fix whose horizontal innovation is too unlikely for the current
+ * covariance is dropped as an outlier; after FILTER_MAX_REJECTS in a row
+ * the receiver is assumed to be right and the filter restarts from it.
+ *
+ * the filter is only touched by the thread delivering fixes; a reset from
+ * elsewhere is requested through reset_requested and done on the next fix.
+ */
+#define  FILTER_ACCEL_NOISE    1.0     // m/s^2, white acceleration
+#define  FILTER_SPEED_NOISE    0.5     // m/s, speed/bearing derived velocity
+#define  FILTER_DEFAULT_ACC    30.0    // m, fixes without an accuracy
+#define  FILTER_GATE           13.8    // chi-square, 2 dof, 99.9%
+#define  FILTER_MAX_REJECTS    3
+#define  FILTER_MAX_GAP_MS     10000
+#define  FILTER_MAX_RANGE      50000.0 // m from the reference point
+#define  FILTER_MAX_EXTRAP_MS  2000
+
+typedef struct {
+    double  x, v;                // position, velocity
+    double  pxx, pxv, pvv;       // covariance
+} FilterAxis;
+
+static struct {
+    int         valid;
+    double      lat0, lon0, cos_lat0;
+    int64_t     time_ms;         // of the state, in fix timestamps
+    FilterAxis  axis[3];         // east, north, up
+    int         has_alt;
+    int         rejects;
+    int         reset_requested;
+
+    uint32_t    updates;
+    uint32_t    outliers;
+    uint32_t    resets;
+    uint32_t    extrapolations;
+} filter;
+
+static void axis_init( FilterAxis*  a, double  x, double  var_x, double  v, double  var_v ) {
+    a->x   = x;
+    a->v   = v;
+    a->pxx = var_x;
+    a->pxv = 0;
+    a->pvv = var_v;
+}
+
+static void axis_predict( FilterAxis*  a, double  dt, double  q ) {
+    double  dt2 = dt * dt;
+
+    a->x   += a->v * dt;
+    a->pxx += dt * (2 * a->pxv + dt * a->pvv) + q * dt2 * dt2 / 4;
+    a->pxv += dt * a->pvv + q * dt2 * dt / 2;
+    a->pvv += q * dt2;
+}
+
+static void axis_update_x( FilterAxis*  a, double  z, double  r ) {
+    double  s  = a->pxx + r;
+    double  kx = a->pxx / s, kv = a->pxv / s;
+    double  y  = z - a->x;
+
+    a->x   += kx * y;
+    a->v   += kv * y;
+    a->pvv -= kv * a->pxv;
+    a->pxv -= kv * a->pxx;
+    a->pxx -= kx * a->pxx;
+}
+
+static void axis_update_v( FilterAxis*  a, double  z, double  r ) {
+    double  s  = a->pvv + r;
+    double  kx = a->pxv / s, kv = a->pvv / s;
+    double  y  = z - a->v;
+
+    a->x   += kx * y;
+    a->v   += kv * y;
+    a->pxx -= kx * a->pxv;
+    a->pxv -= kx * a->pvv;
+    a->pvv -= kv * a->pvv;
+}
+
+static void filter_to_enu( const GpsLocation*  fix, double*  e, double*  n ) {
+    *e = (fix->longitude - filter.lon0) * DEG2RAD * EARTH_RADIUS * filter.cos_lat0;
+    *n = (fix->latitude  - filter.lat0) * DEG2RAD * EARTH_RADIUS;
+}
+
+static void filter_reset( const GpsLocation*  fix, double  var ) {
+    double  ve = 0, vn = 0, var_v = 100.0;
+
+    filter.valid    = 1;
+    filter.lat0     = fix->latitude;
+    filter.lon0     = fix->longitude;
+    filter.cos_lat0 = cos(fix->latitude * DEG2RAD);
+    filter.time_ms  = fix->timestamp;
+    filter.has_alt  = (fix->flags & GPS_LOCATION_HAS_ALTITUDE) != 0;
+    filter.rejects  = 0;
+    filter.resets  += 1;
+
+    // a speed without a bearing says nothing about the direction
+    if ((fix->flags & GPS_LOCATION_HAS_SPEED) && (fix->flags & GPS_LOCATION_HAS_BEARING)) {
+        double  b = fix->bearing * DEG2RAD;
+        ve    = fix->speed * sin(b);
+        vn    = fix->speed * cos(b);
+        var_v = FILTER_SPEED_NOISE * FILTER_SPEED_NOISE;
+    }
+    axis_init( &filter.axis[0], 0, var, ve, var_v );
+    axis_init( &filter.axis[1], 0, var, vn, var_v );
+    axis_init( &filter.axis[2], filter.has_alt ? fix->altitude : 0, 4 * var, 0, 1.0 );
+}
+
+/* write a state, as of time_ms, back into fix */
+static void filter_output( GpsLocation*  fix, const FilterAxis*  axis, int64_t  time_ms ) {
+    const FilterAxis*  e = &axis[0];
+    const FilterAxis*  n = &axis[1];
+    double  speed = sqrt(e->v * e->v + n->v * n->v);
+
+    fix->latitude  = filter.lat0 + n->x / EARTH_RADIUS / DEG2RAD;
+    fix->longitude = filter.lon0 + e->x / (EARTH_RADIUS * filter.cos_lat0) / DEG2RAD;
+    fix->accuracy  = (float) sqrt(e->pxx + n->pxx);
+    fix->flags    |= GPS_LOCATION_HAS_ACCURACY;
+    fix->timestamp = time_ms;
+    if (filter.has_alt && (fix->flags & GPS_LOCATION_HAS_ALTITUDE))
+        fix->altitude = axis[2].x;
+    if (fix->flags & GPS_LOCATION_HAS_SPEED)
+        fix->speed = (float) speed;
+    // the bearing of a stationary receiver is noise, leave the reported one
+    if ((fix->flags & GPS_LOCATION_HAS_BEARING) && speed > FILTER_SPEED_NOISE) {
+        double  b = atan2(e->v, n->v) / DEG2RAD;
+        fix->bearing = (float) (b < 0 ? b + 360.0 : b);
+    }
+}
+
+static int64_t filter_now_ms( void ) {
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void gps_filter_reset() {
+    __atomic_store_n(&filter.reset_requested, 1, __ATOMIC_RELEASE);
+}
+
+/* filter fix in place. returns 0 if it is an outlier or a repeat of the
+ * last fix and must be dropped. with extrapolate, the result is predicted
+ * forward by how long the fix has been held since received_ms, on the
+ * CLOCK_MONOTONIC clock in ms: the fix's own timestamp is GPS time, which
+ * the system clock needn't agree with. the state stays at the fix's time.
+ */
+int gps_filter_update( GpsLocation*  fix, int64_t  received_ms, int  extrapolate ) {
+    double   acc, var, e, n, dt, se, sn, nis;
+    int      i;
+
+    if (__atomic_exchange_n(&filter.reset_requested, 0, __ATOMIC_ACQUIRE))
+        filter.valid = 0;
+
+    if (!(fix->flags & GPS_LOCATION_HAS_LAT_LONG))
+        return 1;
+
+    acc = (fix->flags & GPS_LOCATION_HAS_ACCURACY) && fix->accuracy > 0
+        ? fix->accuracy : FILTER_DEFAULT_ACC;
+    var = acc * acc / 2;   // accuracy is a horizontal radius, split over two axes
+
+    dt = (fix->timestamp - filter.time_ms) / 1000.0;
+    if (filter.valid && dt == 0) {
+        D("%s: repeated fix at %lld", __FUNCTION__, fix->timestamp);
+        return 0;
+    }
+    if (!filter.valid || dt < 0 || dt * 1000 > FILTER_MAX_GAP_MS) {
+        filter_reset( fix, var );
+        filter.updates += 1;
+        filter_output( fix, filter.axis, filter.time_ms );
+        return 1;
+    }
+
+    for (i = 0; i < 3; i++)
+        axis_predict( &filter.axis[i], dt, FILTER_ACCEL_NOISE * FILTER_ACCEL_NOISE );
+    filter.time_ms = fix->timestamp;
+
+    filter_to_enu( fix, &e, &n );
+    if (fabs(e) > FILTER_MAX_RANGE || fabs(n) > FILTER_MAX_RANGE) {
+        filter_reset( fix, var );
+        filter.updates += 1;
+        filter_output( fix, filter.axis, filter.time_ms );
+        return 1;
+    }
+
+    // normalized innovation squared of the horizontal position
+    se  = filter.axis[0].pxx + var;
+    sn  = filter.axis[1].pxx + var;
+    nis = (e - filter.axis[0].x) * (e - filter.axis[0].x) / se +
+          (n - filter.axis[1].x) * (n - filter.axis[1].x) / sn;
+    if (nis > FILTER_GATE) {
+        filter.outliers += 1;
+        if (++filter.rejects < FILTER_MAX_REJECTS) {
+            D("%s: outlier, nis=%.1f", __FUNCTION__, nis);
+            return 0;
+        }
+        D("%s: %d outliers in a row, restarting", __FUNCTION__, filter.rejects);
+        filter_reset( fix, var );
+        filter.updates += 1;
+        filter_output( fix, filter.axis, filter.time_ms );
+        return 1;
+    }
+    filter.rejects = 0;
+
+    axis_update_x( &filter.axis[0], e, var );
+    axis_update_x( &filter.axis[1], n, var );
+    if (fix->flags & GPS_LOCATION_HAS_ALTITUDE) {
+        if (!filter.has_alt) {
+            axis_init( &filter.axis[2], fix->altitude, 4 * var, 0, 1.0 );
+            filter.has_alt = 1;
+        } else {
+            axis_update_x( &filter.axis[2], fix->altitude, 4 * var );
+        }
+    }
+    if ((fix->flags & GPS_LOCATION_HAS_SPEED) && (fix->flags & GPS_LOCATION_HAS_BEARING)) {
+        double  b  = fix->bearing * DEG2RAD;
+        double  rv = FILTER_SPEED_NOISE * FILTER_SPEED_NOISE;
+        axis_update_v( &filter.axis[0], fix->speed * sin(b), rv );
+        axis_update_v( &filter.axis[1], fix->speed * cos(b), rv );
+    }
+    filter.updates += 1;
+
+    if (extrapolate) {
+        int64_t  ahead = filter_now_ms() - received_ms;
+
+        if (ahead > 0 && ahead <= FILTER_MAX_EXTRAP_MS) {
+            FilterAxis  axis[3];
+
+            // the next fix is filtered from its own time, not from now
+            memcpy( axis, filter.axis, sizeof(axis) );
+            for (i = 0; i < 3; i++)
+                axis_predict( &axis[i], ahead / 1000.0, FILTER_ACCEL_NOISE * FILTER_ACCEL_NOISE );
+            filter.extrapolations += 1;
+            filter_output( fix, axis, filter.time_ms + ahead );
+            return 1;
+        }
+    }
+
+    filter_output( fix, filter.axis, filter.time_ms );
+    return 1;
+}
+
+int gps_filter_get_internal_state( char*  buffer, int  size ) {
+    int  len;
+
+    if (size <= 0)
+        return 0;
+    len = snprintf(buffer, size, "filter: updates=%u outliers=%u resets=%u extrapolations=%u\n",
+                   filter.updates, filter.outliers, filter.resets, filter.extrapolations);
+    if (len < 0)
+        return 0;
+    return len < size ? len : size - 1;
+}
+
+// END OF FILE
@@ -0,0 +1,32 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * leo-gps-geo.h
+ *
+ * Constants for the flat-earth approximations used between nearby fixes,
+ * by the fix filter and the fix prediction.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#ifndef _LEO_GPS_GEO_H
+#define _LEO_GPS_GEO_H
+
+#include <math.h>
+
+#define  EARTH_RADIUS  6371000.0      // m, mean radius
+#define  DEG2RAD       (M_PI / 180.0)
+
+#endif /* _LEO_GPS_GEO_H */
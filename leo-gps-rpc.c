@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <librpc/rpc/rpc.h>
 #include <sys/select.h>
 #include <sys/types.h>
@@ -33,6 +34,10 @@
 #include <arpa/inet.h>
 #include <librpc/rpc/rpc_router_ioctl.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <cutils/log.h>
 #include <gps.h>
 
@@ -79,11 +84,6 @@ struct SVCXPRT {
     volatile int num_servers;
 };
 
-#define SEND_VAL(x) do { \
-    val=x;\
-    XDR_SEND_UINT32(clnt, &val);\
-} while(0);
-
 static uint32_t client_IDs[16];//highest known value is 0xb
 static uint32_t no_fix=1;
 #if ENABLE_NMEA
@@ -95,12 +95,17 @@ static struct CLIENT *_clnt;
 static struct timeval timeout;
 static SVCXPRT *_svc;
 
-static uint8_t CHECKED[4] = {0};
+static uint8_t CHECKED[10] = {0};
 static uint8_t XTRA_AUTO_DOWNLOAD_ENABLED = 0;
 static uint8_t XTRA_DOWNLOAD_INTERVAL = 24;  // hours
 static uint8_t CLEANUP_ENABLED = 1;
 static uint8_t SESSION_TIMEOUT = 2;  // seconds
 static uint8_t MEASUREMENT_PRECISION = 10;  // meters
+static uint8_t SV_SNR_TOLERANCE = 1;  // dB
+static uint8_t SV_ELEVATION_TOLERANCE = 1;  // degrees, also used for azimuth
+static uint8_t SINGLE_SHOT_ACCURACY = 50;  // meters
+static uint8_t KALMAN_FILTER = 0;  // 0 off, 1 filter, 2 filter and extrapolate
+static uint8_t PREDICTION_RATE = 0;  // Hz of GPS_LOCATION_IS_PREDICTED fixes, 0 off
 
 struct params {
     uint32_t *data;
@@ -138,11 +143,29 @@ struct xtra_auto_params {
     uint16_t interval;
 };
 
+/* arguments already in network byte order, sent as one block */
+struct wire_params {
+    const uint32_t *wire;
+    int length;
+};
+
+static bool_t xdr_wire_args(XDR *clnt, struct wire_params *par) {
+    return xdr_opaque(clnt, (caddr_t) par->wire, par->length * sizeof(uint32_t));
+}
+
 static bool_t xdr_args(XDR *clnt, struct params *par) {
-    int i;
-    uint32_t val=0;
-    for(i=0;par->length>i;++i)
-        SEND_VAL(par->data[i]);
+    uint32_t wire[32];
+    int i, n, done;
+
+    for (done = 0; done < par->length; done += n) {
+        n = par->length - done;
+        if (n > 32)
+            n = 32;
+        for (i = 0; i < n; ++i)
+            wire[i] = htonl(par->data[done + i]);
+        if (!xdr_opaque(clnt, (caddr_t) wire, n * sizeof(uint32_t)))
+            return 0;
+    }
     return 1;
 }
 
@@ -151,6 +174,14 @@ static bool_t xdr_result_int(XDR *clnt, uint32_t *result) {
     return 1;
 }
 
+/* xdr_bytes copies the part into the outgoing message: the router takes
+ * one contiguous message per write(), there is no iovec path to hand it
+ * the caller's buffer. xtra_data_ptr points into the caller's buffer, so
+ * data injected from memory is copied once, here; a file is read a part
+ * at a time into a block-sized buffer first, so its bytes are copied
+ * twice. tests/bench-xtra.c counts
+ * both.
+ */
 static bool_t xdr_xtra_data_args(XDR *xdrs, struct xtra_data_params *xtra_data) {
     //D("%s() is called: 0x%x, %d, %d, %d", __FUNCTION__, (int) xtra_data->xtra_data_ptr, xtra_data->part_len, xtra_data->part, xtra_data->total_parts);
 
@@ -241,8 +272,8 @@ static int pdsm_client_init(struct CLIENT *clnt, int client) {
     par.length=1;
     par.data[0]=client;
     if(clnt_call(clnt, 0x2, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_client_init(%x) failed\n", client);
-        exit(-1);
+        LOGE("pdsm_client_init(%x) failed", client);
+        return -1;
     }
     D("pdsm_client_init(%x)=%x\n", client, res);
     client_IDs[client]=res;
@@ -257,8 +288,8 @@ static int pdsm_client_release(struct CLIENT *clnt, int client) {
     par.length=1;
     par.data[0]=client_IDs[client];
     if(clnt_call(clnt, 0x3, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_client_release(%x) failed\n", client_IDs[client]);
-        exit(-1);
+        LOGE("pdsm_client_release(%x) failed", client_IDs[client]);
+        return -1;
     }
     D("pdsm_client_release(%x)=%x\n", client_IDs[client], res);
     client_IDs[client]=res;
@@ -275,8 +306,8 @@ int pdsm_atl_l2_proxy_reg(struct CLIENT *clnt, int val0, int val1, int val2) {
     par.data[1]=val1;
     par.data[2]=val2;
     if(clnt_call(clnt, 0x3, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_atl_l2_proxy_reg(%d, %d, %d) failed\n", par.data[0], par.data[1], par.data[2]);
-        exit(-1);
+        LOGE("pdsm_atl_l2_proxy_reg(%d, %d, %d) failed", par.data[0], par.data[1], par.data[2]);
+        return -1;
     }
     D("pdsm_atl_l2_proxy_reg(%d, %d, %d)=%d\n", par.data[0], par.data[1], par.data[2], res);
     return res;
@@ -291,8 +322,8 @@ int pdsm_atl_dns_proxy_reg(struct CLIENT *clnt, int val0, int val1) {
     par.data[0]=val0;
     par.data[1]=val1;
     if(clnt_call(clnt, 0x6, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_atl_dns_proxy_reg(%d, %d) failed\n", par.data[0], par.data[1]);
-        exit(-1);
+        LOGE("pdsm_atl_dns_proxy_reg(%d, %d) failed", par.data[0], par.data[1]);
+        return -1;
     }
     D("pdsm_atl_dns_proxy(%d, %d)=%d\n", par.data[0], par.data[1], res);
     return res;
@@ -311,8 +342,8 @@ int pdsm_client_pd_reg(struct CLIENT *clnt, int client, int val0, int val1, int
     par.data[4]=val3;
     par.data[5]=val4;
     if(clnt_call(clnt, 0x4, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_client_pd_reg(%x, %d, %d, %d, %x, %d) failed\n", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5]);
-        exit(-1);
+        LOGE("pdsm_client_pd_reg(%x, %d, %d, %d, %x, %d) failed", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5]);
+        return -1;
     }
     D("pdsm_client_pd_reg(%x, %d, %d, %d, %x, %d)=%d\n", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5], res);
     return res;
@@ -331,8 +362,8 @@ int pdsm_client_pa_reg(struct CLIENT *clnt, int client, int val0, int val1, int
     par.data[4]=val3;
     par.data[5]=val4;
     if(clnt_call(clnt, 0x5, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_client_pa_reg(%x, %d, %d, %d, %x, %d) failed\n", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5]);
-        exit(-1);
+        LOGE("pdsm_client_pa_reg(%x, %d, %d, %d, %x, %d) failed", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5]);
+        return -1;
     }
     D("pdsm_client_pa_reg(%x, %d, %d, %d, %x, %d)=%d\n", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5], res);
     return res;
@@ -351,8 +382,8 @@ int pdsm_client_lcs_reg(struct CLIENT *clnt, int client, int val0, int val1, int
     par.data[4]=val3;
     par.data[5]=val4;
     if(clnt_call(clnt, 0x6, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_client_lcs_reg(%x, %d, %d, %d, %x, %d) failed\n", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5]);
-        exit(-1);
+        LOGE("pdsm_client_lcs_reg(%x, %d, %d, %d, %x, %d) failed", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5]);
+        return -1;
     }
     D("pdsm_client_lcs_reg(%x, %d, %d, %d, %x, %d)=%d\n", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5], res);
     return res;
@@ -371,8 +402,8 @@ int pdsm_client_ext_status_reg(struct CLIENT *clnt, int client, int val0, int va
     par.data[4]=val3;
     par.data[5]=val4;
     if(clnt_call(clnt, 0x8, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_client_ext_status_reg(%x, %d, %d, %d, %d, %d) failed\n", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5]);
-        exit(-1);
+        LOGE("pdsm_client_ext_status_reg(%x, %d, %d, %d, %d, %d) failed", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5]);
+        return -1;
     }
     D("pdsm_client_ext_status_reg(%x, %d, %d, %d, %d, %d)=%d\n", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5], res);
     return res;
@@ -391,8 +422,8 @@ int pdsm_client_xtra_reg(struct CLIENT *clnt, int client, int val0, int val1, in
     par.data[4]=val3;
     par.data[5]=val4;
     if(clnt_call(clnt, 0x7, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_client_xtra_reg(%x, %d, %d, %d, %d, %d) failed\n", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5]);
-        exit(-1);
+        LOGE("pdsm_client_xtra_reg(%x, %d, %d, %d, %d, %d) failed", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5]);
+        return -1;
     }
     D("pdsm_client_xtra_reg(%x, %d, %d, %d, %d, %d)=%d\n", par.data[0], par.data[1], par.data[2], par.data[3], par.data[4], par.data[5], res);
     return res;
@@ -406,8 +437,8 @@ int pdsm_client_deact(struct CLIENT *clnt, int client) {
     par.length=1;
     par.data[0]=client_IDs[client];
     if(clnt_call(clnt, 0xA, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_client_deact(%x) failed\n", par.data[0]);
-        exit(-1);
+        LOGE("pdsm_client_deact(%x) failed", par.data[0]);
+        return -1;
     }
     D("pdsm_client_deact(%x)=%d\n", par.data[0], res);
     return res;
@@ -421,8 +452,8 @@ int pdsm_client_act(struct CLIENT *clnt, int client) {
     par.length=1;
     par.data[0]=client_IDs[client];
     if(clnt_call(clnt, 0x9, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_client_act(%x) failed\n", par.data[0]);
-        exit(-1);
+        LOGE("pdsm_client_act(%x) failed", par.data[0]);
+        return -1;
     }
     D("pdsm_client_act(%x)=%d\n", par.data[0], res);
     return res;
@@ -449,8 +480,9 @@ int pdsm_xtra_set_data(struct CLIENT *clnt, int val0, int client_ID, int val2, u
             (caddr_t) &res, timeout);
     //D("%s() is called: clnt_stat=%d", __FUNCTION__, cs);
     if (cs != RPC_SUCCESS){
+        // not fatal: the XTRA block size is negotiated by trying bigger parts first
         D("pdsm_xtra_set_data(%x, %x, %d, 0x%x, %d, %d, %d, %d) failed\n", val0, client_ID, val2, (int) xtra_data_ptr, part_len, part, total_parts, val3);
-        exit(-1);
+        return -1;
     }
     D("pdsm_xtra_set_data(%x, %x, %d, 0x%x, %d, %d, %d, %d)=%d\n", val0, client_ID, val2, (int) xtra_data_ptr, part_len, part, total_parts, val3, res);
     return res;
@@ -473,8 +505,8 @@ int pdsm_xtra_inject_time_info(struct CLIENT *clnt, int val0, int client_ID, int
             (caddr_t) &res, timeout);
     //D("%s() is called: clnt_stat=%d", __FUNCTION__, cs);
     if (cs != RPC_SUCCESS){
-        D("pdsm_xtra_inject_time_info(%x, %x, %d, %lld, %d) failed\n", val0, client_ID, val2, time_info_ptr->time_utc, time_info_ptr->uncertainty);
-        exit(-1);
+        LOGE("pdsm_xtra_inject_time_info(%x, %x, %d, %lld, %d) failed", val0, client_ID, val2, (long long) time_info_ptr->time_utc, time_info_ptr->uncertainty);
+        return -1;
     }
     D("pdsm_xtra_inject_time_info(%x, %x, %d, %lld, %d)=%d\n", val0, client_ID, val2, time_info_ptr->time_utc, time_info_ptr->uncertainty, res);
     return res;
@@ -497,8 +529,8 @@ int pdsm_xtra_query_data_validity(struct CLIENT *clnt, int val0, int client_ID,
             (caddr_t) &res, timeout);
     //D("%s() is called: clnt_stat=%d", __FUNCTION__, cs);
     if (cs != RPC_SUCCESS){
-        D("pdsm_xtra_query_data_validity(%x, %x, %d) failed\n", val0, client_ID, val2);
-        exit(-1);
+        LOGE("pdsm_xtra_query_data_validity(%x, %x, %d) failed", val0, client_ID, val2);
+        return -1;
     }
     D("pdsm_xtra_query_data_validity(%x, %x, %d)=%d\n", val0, client_ID, val2, res);
     return res;
@@ -522,8 +554,8 @@ int pdsm_xtra_set_auto_download_params(struct CLIENT *clnt, int val0, int client
             (caddr_t) &res, timeout);
     //D("%s() is called: clnt_stat=%d", __FUNCTION__, cs);
     if (cs != RPC_SUCCESS){
-        D("pdsm_xtra_set_auto_download_params(%x, %x, %d, %d, %d) failed\n", val0, client_ID, val2, boolean, interval);
-        exit(-1);
+        LOGE("pdsm_xtra_set_auto_download_params(%x, %x, %d, %d, %d) failed", val0, client_ID, val2, boolean, interval);
+        return -1;
     }
     D("pdsm_xtra_set_auto_download_params(%x, %x, %d, %d, %d)=%d\n", val0, client_ID, val2, boolean, interval, res);
     return res;
@@ -546,58 +578,63 @@ int pdsm_xtra_client_initiate_download_request(struct CLIENT *clnt, int val0, in
             (caddr_t) &res, timeout);
     //D("%s() is called: clnt_stat=%d", __FUNCTION__, cs);
     if (cs != RPC_SUCCESS){
-        D("pdsm_xtra_client_initiate_download_request(%x, %x, %d) failed\n", val0, client_ID, val2);
-        exit(-1);
+        LOGE("pdsm_xtra_client_initiate_download_request(%x, %x, %d) failed", val0, client_ID, val2);
+        return -1;
     }
     D("pdsm_xtra_client_initiate_download_request(%x, %x, %d)=%d\n", val0, client_ID, val2, res);
     return res;
 }
 
-int pdsm_get_position(struct CLIENT *clnt, int val0, int val1, int val2, int val3, int val4, int val5, int val6, int val7, int val8, int val9, int val10, int val11, int val12, int val13, int val14, int val15, int val16, int 
-val17, int val18, int val19, int val20, int val21, int val22, int val23, int val24, int val25, int val26, int val27, int val28) 
+/* get position (procedure 0xb) arguments for gps_get_position(), pre-encoded once;
+ * only the session timeout and the PD client id are patched per call.
+ */
+#define GET_POSITION_ARGS     29
+#define GET_POSITION_TIMEOUT  27
+#define GET_POSITION_CLIENT   28
+
+static const uint32_t get_position_args[GET_POSITION_ARGS] = {
+    0, 0,
+    1,
+    1, 1,
+    0x3B9AC9FF, 1,
+    0,
+    0, 0,
+    0, 0,
+    0,
+    0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0,
+    1, 50, 0 /* SESSION_TIMEOUT */,
+    0 /* client_IDs[2] */
+};
+static uint32_t get_position_wire[GET_POSITION_ARGS];
+
+static void pdsm_get_position_template_init() {
+    int i;
+    for (i = 0; i < GET_POSITION_ARGS; ++i)
+        get_position_wire[i] = htonl(get_position_args[i]);
+}
+
+/* may run on several RPC workers at once, so the template is patched on
+ * a copy */
+static int pdsm_get_position_template(struct CLIENT *clnt, uint32_t session_timeout, uint32_t client)
 {
-    struct params par;
+    struct wire_params par;
+    uint32_t wire[GET_POSITION_ARGS];
     uint32_t res;
-    uint32_t par_data[29];
-    par.data = par_data;
-    par.length=29;
-    par.data[0]=val0;
-    par.data[1]=val1;
-    par.data[2]=val2;
-    par.data[3]=val3;
-    par.data[4]=val4;
-    par.data[5]=val5;
-    par.data[6]=val6;
-    par.data[7]=val7;
-    par.data[8]=val8;
-    par.data[9]=val9;
-    par.data[10]=val10;
-    par.data[11]=val11;
-    par.data[12]=val12;
-    par.data[13]=val13;
-    par.data[14]=val14;
-    par.data[15]=val15;
-    par.data[16]=val16;
-    par.data[17]=val17;
-    par.data[18]=val18;
-    par.data[19]=val19;
-    par.data[20]=val20;
-    par.data[21]=val21;
-    par.data[22]=val22;
-    par.data[23]=val23;
-    par.data[24]=val24;
-    par.data[25]=val25;
-    par.data[26]=val26;
-    par.data[27]=val27;
-    par.data[28]=val28;
+
+    memcpy(wire, get_position_wire, sizeof(wire));
+    wire[GET_POSITION_TIMEOUT] = htonl(session_timeout);
+    wire[GET_POSITION_CLIENT] = htonl(client);
+    par.wire = wire;
+    par.length = GET_POSITION_ARGS;
     if(clnt_call(clnt, 0xb, 
-             (xdrproc_t)xdr_args, 
+             (xdrproc_t)xdr_wire_args, 
              (caddr_t)&par, 
              (xdrproc_t)xdr_result_int, 
              (caddr_t)&res, timeout)) 
     {
-        D("pdsm_client_get_position() failed\n");
-        exit(-1);
+        LOGE("pdsm_client_get_position() failed");
+        return -1;
     }
     D("pdsm_client_get_position()=%d\n", res);
     return res;
@@ -614,13 +651,178 @@ int pdsm_client_end_session(struct CLIENT *clnt, int val0, int val1, int val2, i
     par.data[2]=val2;
     par.data[3]=client_IDs[client];
     if(clnt_call(clnt, 0xc, xdr_args, &par, xdr_result_int, &res, timeout)) {
-        D("pdsm_client_end_session(%d, %d, %d, %x) failed\n", par.data[0], par.data[1], par.data[2], par.data[3]);
-        exit(-1);
+        LOGE("pdsm_client_end_session(%d, %d, %d, %x) failed", par.data[0], par.data[1], par.data[2], par.data[3]);
+        return -1;
     }
     D("pdsm_client_end_session(%d, %d, %d, %x)=%x\n", par.data[0], par.data[1], par.data[2], par.data[3], res);
     return 0;
 }
 
+/*****************************************************************/
+/*****                                                       *****/
+/*****       A S Y N C   R P C                               *****/
+/*****                                                       *****/
+/*****************************************************************/
+
+/* clnt_call() blocks until the reply arrives. jobs submitted here run in
+ * order on a worker thread with its own CLIENT, so that a thread which
+ * mustn't wait for a round-trip (gps_state_thread) can still issue
+ * requests, and wait for one later by its transaction id if it has to.
+ * a job is a function issuing one or more pdsm_* calls.
+ */
+#define RPC_MAX_JOBS      32
+
+typedef int (*rpc_job_fn)(struct CLIENT *clnt, void *arg);
+typedef void (*rpc_done_fn)(uint32_t xid, int result, void *cookie);
+
+typedef struct {
+    uint32_t xid;
+    rpc_job_fn fn;
+    void *arg;
+    rpc_done_fn done;
+    void *cookie;
+    int result;
+    int busy;
+} rpc_job;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    pthread_t thread;
+    struct CLIENT *client;
+    rpc_job jobs[RPC_MAX_JOBS];
+    uint32_t next_xid;  // xid of the next submitted job
+    uint32_t next_run;  // xid of the next job to run
+    int running;
+} rpc_async = {
+    .lock     = PTHREAD_MUTEX_INITIALIZER,
+    .queued   = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+};
+
+static void rpc_async_run(rpc_job *job, struct CLIENT *clnt) {
+    int result = job->fn(clnt, job->arg);
+    if (job->done)
+        job->done(job->xid, result, job->cookie);
+
+    pthread_mutex_lock(&rpc_async.lock);
+    job->result = result;
+    job->busy = 0;
+    pthread_cond_broadcast(&rpc_async.finished);
+    pthread_mutex_unlock(&rpc_async.lock);
+}
+
+/* runs the jobs in order; once stopped, it still runs the queued ones */
+static void *rpc_async_worker(void *arg) {
+    struct CLIENT *clnt = (struct CLIENT *) arg;
+
+    pthread_mutex_lock(&rpc_async.lock);
+    for (;;) {
+        while (rpc_async.running && rpc_async.next_run == rpc_async.next_xid)
+            pthread_cond_wait(&rpc_async.queued, &rpc_async.lock);
+        if (rpc_async.next_run == rpc_async.next_xid) {
+            // from now on, jobs run on the submitting thread
+            rpc_async.client = NULL;
+            break;
+        }
+
+        rpc_job *job = &rpc_async.jobs[rpc_async.next_run++ % RPC_MAX_JOBS];
+        pthread_mutex_unlock(&rpc_async.lock);
+        rpc_async_run(job, clnt);
+        pthread_mutex_lock(&rpc_async.lock);
+    }
+    pthread_mutex_unlock(&rpc_async.lock);
+    return NULL;
+}
+
+static int rpc_async_init() {
+    struct CLIENT *clnt;
+
+    if (rpc_async.running)
+        return 0;
+
+    clnt = clnt_create(NULL, 0x3000005B, 0x00010001, NULL);
+    if (!clnt) {
+        LOGE("%s(): could not create the RPC worker client", __FUNCTION__);
+        return -1;
+    }
+    rpc_async.running = 1;
+    if (pthread_create(&rpc_async.thread, NULL, rpc_async_worker, clnt)) {
+        LOGE("%s(): could not start the RPC worker", __FUNCTION__);
+        rpc_async.running = 0;
+        clnt_destroy(clnt);
+        return -1;
+    }
+    pthread_mutex_lock(&rpc_async.lock);
+    rpc_async.client = clnt;
+    pthread_mutex_unlock(&rpc_async.lock);
+    return 0;
+}
+
+/* waits for the queued jobs to run, then stops the worker */
+static void rpc_async_cleanup() {
+    struct CLIENT *clnt;
+
+    pthread_mutex_lock(&rpc_async.lock);
+    clnt = rpc_async.client;
+    rpc_async.running = 0;
+    pthread_cond_broadcast(&rpc_async.queued);
+    pthread_mutex_unlock(&rpc_async.lock);
+    if (!clnt)
+        return;
+
+    pthread_join(rpc_async.thread, NULL);
+    clnt_destroy(clnt);
+}
+
+/* queue a job and return its transaction id. 'done', if not NULL, is called
+ * from the worker once the job has run. blocks while RPC_MAX_JOBS jobs are
+ * pending. without the worker the job runs synchronously on _clnt.
+ */
+static uint32_t rpc_async_submit(rpc_job_fn fn, void *arg, rpc_done_fn done, void *cookie) {
+    uint32_t xid;
+    rpc_job *job;
+
+    pthread_mutex_lock(&rpc_async.lock);
+    while (rpc_async.jobs[rpc_async.next_xid % RPC_MAX_JOBS].busy)
+        pthread_cond_wait(&rpc_async.finished, &rpc_async.lock);
+
+    xid = rpc_async.next_xid++;
+    job = &rpc_async.jobs[xid % RPC_MAX_JOBS];
+    job->xid = xid;
+    job->fn = fn;
+    job->arg = arg;
+    job->done = done;
+    job->cookie = cookie;
+    job->busy = 1;
+
+    // a stopping worker still runs what is queued
+    if (rpc_async.client) {
+        pthread_cond_signal(&rpc_async.queued);
+        pthread_mutex_unlock(&rpc_async.lock);
+    } else {
+        rpc_async.next_run = rpc_async.next_xid;
+        pthread_mutex_unlock(&rpc_async.lock);
+        rpc_async_run(job, _clnt);
+    }
+    return xid;
+}
+
+/* wait for a submitted job and return its result */
+static int rpc_async_wait(uint32_t xid) {
+    rpc_job *job = &rpc_async.jobs[xid % RPC_MAX_JOBS];
+    int result = -1;
+
+    pthread_mutex_lock(&rpc_async.lock);
+    while (job->xid == xid && job->busy)
+        pthread_cond_wait(&rpc_async.finished, &rpc_async.lock);
+    if (job->xid == xid)
+        result = job->result;
+    pthread_mutex_unlock(&rpc_async.lock);
+    return result;
+}
+
 enum pdsm_pd_events {
     PDSM_PD_EVENT_POSITION = 0x1,
     PDSM_PD_EVENT_VELOCITY = 0x2,
@@ -637,13 +839,333 @@ enum pdsm_pd_events {
 };
 
 //From leo-gps.c
-extern void update_gps_location(GpsLocation *location);
+extern void update_gps_location(GpsLocation *location, int64_t received_ms);
 extern void update_gps_status(GpsStatusValue value);
 extern void update_gps_svstatus(GpsSvStatus *svstatus);
+extern void xtra_download_request();
+extern void pdsm_pd_callback();
+
+int gps_xtra_set_auto_params();
+
+/*****************************************************************/
+/*****                                                       *****/
+/*****       D E L I V E R Y   Q U E U E                     *****/
+/*****                                                       *****/
+/*****************************************************************/
+
+/* dispatch() runs on the svc thread and the modem waits for its ACK, so
+ * it only decodes; the framework callbacks are queued here and made from
+ * the delivery thread. the queue is a bounded lock-free ring: producers
+ * claim a slot by CAS on head and publish it through the slot sequence,
+ * the delivery thread consumes in order. when the ring is half full SV
+ * status is shed, a newer one will follow; anything else is only dropped
+ * when the ring is full. on cleanup, what was published is still
+ * delivered: the server is unregistered first, so nothing comes after.
+ */
+#define DELIVERY_SLOTS  16  // power of two
+
+enum delivery_type {
+    DELIVER_LOCATION,
+    DELIVER_SV_STATUS,
+    DELIVER_XTRA_REQUEST,
+    DELIVER_TYPES
+};
+
+typedef struct {
+    uint32_t seq;
+    int type;
+    int64_t received_ms;  // of a location, on CLOCK_MONOTONIC
+    union {
+        GpsLocation location;
+        GpsSvStatus sv_status;
+    } u;
+} delivery_slot;
+
+static struct {
+    delivery_slot slots[DELIVERY_SLOTS];
+    uint32_t head;
+    uint32_t tail;
+    sem_t ready;
+    pthread_t thread;
+    int running;
+
+    uint32_t delivered;
+    uint32_t dropped[DELIVER_TYPES];
+    uint32_t max_depth;
+    uint32_t acks;
+    uint64_t ack_us_total;
+    uint32_t ack_us_max;
+} delivery;
+
+static uint64_t rpc_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void delivery_run(delivery_slot *slot) {
+    switch (slot->type) {
+    case DELIVER_LOCATION:
+        update_gps_location(&slot->u.location, slot->received_ms);
+        break;
+    case DELIVER_SV_STATUS:
+        update_gps_svstatus(&slot->u.sv_status);
+        break;
+    case DELIVER_XTRA_REQUEST:
+        xtra_download_request();
+        break;
+    }
+}
+
+static void *delivery_thread(void *arg) {
+    D("%s() running", __FUNCTION__);
+    for (;;) {
+        delivery_slot *slot;
+        uint32_t tail;
+        int stopping;
+
+        while (sem_wait(&delivery.ready) < 0 && errno == EINTR)
+            ;
+        stopping = !__atomic_load_n(&delivery.running, __ATOMIC_ACQUIRE);
+
+        // slots are published out of order by concurrent producers, so
+        // deliver everything that is ready; a later post may find nothing
+        for (;;) {
+            tail = delivery.tail;
+            slot = &delivery.slots[tail & (DELIVERY_SLOTS - 1)];
+            if ((int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (tail + 1)) < 0)
+                break;
+            // delivered in place, the slot is handed back afterwards; tail
+            // moves first, so head - tail never exceeds DELIVERY_SLOTS
+            delivery_run(slot);
+            __atomic_store_n(&delivery.tail, tail + 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&slot->seq, tail + DELIVERY_SLOTS, __ATOMIC_RELEASE);
+            delivery.delivered++;
+        }
+        if (stopping)
+            break;
+    }
+    return NULL;
+}
+
+static int delivery_init() {
+    uint32_t i;
+
+    if (delivery.running)
+        return 0;
+    for (i = 0; i < DELIVERY_SLOTS; ++i)
+        delivery.slots[i].seq = i;
+    delivery.head = delivery.tail = 0;
+    sem_init(&delivery.ready, 0, 0);
+    __atomic_store_n(&delivery.running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&delivery.thread, NULL, delivery_thread, NULL)) {
+        LOGE("%s(): could not start the delivery thread", __FUNCTION__);
+        delivery.running = 0;
+        sem_destroy(&delivery.ready);
+        return -1;
+    }
+    return 0;
+}
+
+/* the producers must be gone: the delivery thread delivers what is left */
+static void delivery_cleanup() {
+    if (!delivery.running)
+        return;
+    __atomic_store_n(&delivery.running, 0, __ATOMIC_RELEASE);
+    sem_post(&delivery.ready);
+    pthread_join(delivery.thread, NULL);
+    sem_destroy(&delivery.ready);
+}
+
+/* max_depth is raised by every producer, so it is a CAS loop too */
+static void delivery_note_depth(uint32_t depth) {
+    uint32_t max = __atomic_load_n(&delivery.max_depth, __ATOMIC_RELAXED);
+
+    while (depth > max &&
+           !__atomic_compare_exchange_n(&delivery.max_depth, &max, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* claim a slot for an event of the given type, NULL if it is dropped */
+static delivery_slot *delivery_claim(int type) {
+    uint32_t pos = __atomic_load_n(&delivery.head, __ATOMIC_RELAXED);
+    uint32_t depth;
+
+    for (;;) {
+        delivery_slot *slot = &delivery.slots[pos & (DELIVERY_SLOTS - 1)];
+        int32_t dif = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+
+        depth = pos - __atomic_load_n(&delivery.tail, __ATOMIC_RELAXED);
+        if ((int32_t)depth < 0) {
+            // pos is stale: the ring was drained past it since it was read
+            pos = __atomic_load_n(&delivery.head, __ATOMIC_RELAXED);
+            continue;
+        }
+        delivery_note_depth(depth);
+        if (dif < 0 || (type == DELIVER_SV_STATUS && depth >= DELIVERY_SLOTS / 2)) {
+            __sync_fetch_and_add(&delivery.dropped[type], 1);
+            return NULL;
+        }
+        if (dif == 0 && __atomic_compare_exchange_n(&delivery.head, &pos, pos + 1, 0,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            slot->type = type;
+            return slot;
+        }
+        pos = __atomic_load_n(&delivery.head, __ATOMIC_RELAXED);
+    }
+}
+
+/* hand a filled slot, claimed at sequence seq, to the delivery thread */
+static void delivery_publish(delivery_slot *slot, uint32_t seq) {
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+    sem_post(&delivery.ready);
+}
+
+/* without the delivery thread, these call back directly */
+static void deliver_location(GpsLocation *location) {
+    int64_t received_ms = (int64_t)(rpc_now_us() / 1000);
+    delivery_slot *slot;
+
+    if (!__atomic_load_n(&delivery.running, __ATOMIC_ACQUIRE)) {
+        update_gps_location(location, received_ms);
+        return;
+    }
+    slot = delivery_claim(DELIVER_LOCATION);
+    if (slot) {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        slot->received_ms = received_ms;
+        slot->u.location = *location;
+        delivery_publish(slot, seq);
+    }
+}
+
+static void deliver_svstatus(GpsSvStatus *svstatus) {
+    delivery_slot *slot;
+
+    if (!__atomic_load_n(&delivery.running, __ATOMIC_ACQUIRE)) {
+        update_gps_svstatus(svstatus);
+        return;
+    }
+    slot = delivery_claim(DELIVER_SV_STATUS);
+    if (slot) {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        slot->u.sv_status = *svstatus;
+        delivery_publish(slot, seq);
+    }
+}
+
+static void deliver_xtra_request() {
+    delivery_slot *slot;
+
+    if (!__atomic_load_n(&delivery.running, __ATOMIC_ACQUIRE)) {
+        xtra_download_request();
+        return;
+    }
+    slot = delivery_claim(DELIVER_XTRA_REQUEST);
+    if (slot)
+        delivery_publish(slot, __atomic_load_n(&slot->seq, __ATOMIC_RELAXED));
+}
+
+/* layout of a PDSM PD event payload: the word each field is in, and the
+ * events that make it valid. a message must reach every field that its
+ * events use, fields of events it is too short for are dropped.
+ */
+enum pd_field {
+    PD_EVENT,
+    PD_TIMESTAMP,
+    PD_LAT_HI,
+    PD_LAT_LO,
+    PD_LON_HI,
+    PD_LON_LO,
+    PD_HEIGHT,
+    PD_SPEED,
+    PD_BEARING,
+    PD_HDOP,
+    PD_USED_IN_FIX,
+    PD_NUM_SVS,
+    PD_FIELDS
+};
+
+static const struct {
+    uint16_t word;
+    uint32_t events;
+} pd_layout[PD_FIELDS] = {
+    [PD_EVENT]       = {  2, 0 },
+    [PD_TIMESTAMP]   = {  8, PDSM_PD_EVENT_POSITION },
+    [PD_LAT_HI]      = { 60, PDSM_PD_EVENT_POSITION },
+    [PD_LAT_LO]      = { 61, PDSM_PD_EVENT_POSITION },
+    [PD_LON_HI]      = { 62, PDSM_PD_EVENT_POSITION },
+    [PD_LON_LO]      = { 63, PDSM_PD_EVENT_POSITION },
+    [PD_HEIGHT]      = { 64, PDSM_PD_EVENT_HEIGHT },
+    [PD_SPEED]       = { 66, PDSM_PD_EVENT_VELOCITY },
+    [PD_BEARING]     = { 67, PDSM_PD_EVENT_VELOCITY },
+    [PD_HDOP]        = { 75, PDSM_PD_EVENT_POSITION },
+    [PD_USED_IN_FIX] = { 77, PDSM_PD_EVENT_POSITION },
+    [PD_NUM_SVS]     = { 82, PDSM_PD_EVENT_POSITION },
+};
+
+// followed by num_svs { prn, elevation, azimuth*100+snr }
+#define PD_SV_LIST   83
+#define PD_SV_WORDS  3
+#define PD_MAX_WORDS (PD_SV_LIST + PD_SV_WORDS * GPS_MAX_SVS)
+
+// a call from the modem: the procedure is in word CALL_PROC, its
+// arguments start at word CALL_ARGS
+#define CALL_PROC    5
+#define CALL_ARGS    10
+
+// the ext SV payload: num_svs, then 12 word records from EXT_SV_LIST
+#define EXT_NUM_SVS  8
+#define EXT_SV_LIST  101
+#define EXT_SV_WORDS 12
 
-void dispatch_pdsm_pd(uint32_t *data) {
-    uint32_t event=ntohl(data[2]);
+static struct {
+    uint32_t pd_events;
+    uint32_t short_msgs;
+} dispatch_stats;
+
+/* byte-swap the part of the payload that the layout covers in one pass */
+static int pd_decode(const uint32_t *data, int words, uint32_t *pd) {
+    int i;
+
+    if (words > PD_MAX_WORDS)
+        words = PD_MAX_WORDS;
+    for (i = 0; i < words; ++i)
+        pd[i] = ntohl(data[i]);
+    return words;
+}
+
+/* the events whose fields all fit in words */
+static uint32_t pd_valid_events(uint32_t event, int words) {
+    int i;
+
+    for (i = 0; i < PD_FIELDS; ++i)
+        if ((pd_layout[i].events & event) && pd_layout[i].word >= words)
+            event &= ~pd_layout[i].events;
+    return event;
+}
+
+#define PD(f) (pd[pd_layout[f].word])
+
+void dispatch_pdsm_pd(uint32_t *data, int words) {
+    uint32_t pd[PD_MAX_WORDS];
+    uint32_t event, valid;
+
+    if (words <= pd_layout[PD_EVENT].word) {
+        dispatch_stats.short_msgs++;
+        return;
+    }
+    words = pd_decode(data, words, pd);
+    event = PD(PD_EVENT);
+    dispatch_stats.pd_events++;
     D("%s(): event=0x%x", __FUNCTION__, event);
+
+    valid = pd_valid_events(event, words);
+    if (valid != event) {
+        D("%s(): %d words, too short for events 0x%x", __FUNCTION__, words, event & ~valid);
+        dispatch_stats.short_msgs++;
+    }
+
     if(event&PDSM_PD_EVENT_BEGIN) {
         D("PDSM_PD_EVENT_BEGIN");
     }
@@ -655,35 +1177,41 @@ void dispatch_pdsm_pd(uint32_t *data) {
         no_fix = 1;
     }
     GpsLocation fix;
-    fix.flags = 0;
-    if(event&PDSM_PD_EVENT_POSITION) {
+    memset(&fix, 0, sizeof(fix));
+    if(valid&PDSM_PD_EVENT_POSITION) {
         D("PDSM_PD_EVENT_POSITION");
         if (use_nmea) return;
 
         GpsSvStatus ret;
         int i;
-        ret.num_svs=ntohl(data[82]) & 0x1F;
+        memset(&ret, 0, sizeof(ret));
+        ret.num_svs=PD(PD_NUM_SVS) & 0x1F;
+        if (PD_SV_LIST + PD_SV_WORDS * ret.num_svs > words) {
+            D("%s(): %d words, too short for %d SVs", __FUNCTION__, words, ret.num_svs);
+            dispatch_stats.short_msgs++;
+            ret.num_svs = (words - PD_SV_LIST) / PD_SV_WORDS;
+        }
 
 #if DUMP_DATA
-        //D("pd %3d: %08x ", 77, ntohl(data[77]));
-        for(i=60;i<83;++i) {
-            D("pd %3d: %08x ", i, ntohl(data[i]));
+        for(i=60;i<PD_SV_LIST;++i) {
+            D("pd %3d: %08x ", i, pd[i]);
         }
-        for(i=83;i<83+3*(ret.num_svs-1)+3;++i) {
-            D("pd %3d: %d ", i, ntohl(data[i]));
+        for(i=PD_SV_LIST;i<PD_SV_LIST+PD_SV_WORDS*ret.num_svs;++i) {
+            D("pd %3d: %d ", i, pd[i]);
         }
 #endif
 
         for(i=0;i<ret.num_svs;++i) {
-            ret.sv_list[i].prn=ntohl(data[83+3*i]);
-            ret.sv_list[i].elevation=ntohl(data[83+3*i+1]);
-            ret.sv_list[i].azimuth=(float)ntohl(data[83+3*i+2])/100.0f;
-            ret.sv_list[i].snr=ntohl(data[83+3*i+2])%100;
+            const uint32_t *sv = &pd[PD_SV_LIST + PD_SV_WORDS * i];
+            ret.sv_list[i].prn=sv[0];
+            ret.sv_list[i].elevation=sv[1];
+            ret.sv_list[i].azimuth=(float)sv[2]/100.0f;
+            ret.sv_list[i].snr=sv[2]%100;
         }
-        ret.used_in_fix_mask=ntohl(data[77]);
-        update_gps_svstatus(&ret);
+        ret.used_in_fix_mask=PD(PD_USED_IN_FIX);
+        deliver_svstatus(&ret);
 
-        fix.timestamp = ntohl(data[8]);
+        fix.timestamp = PD(PD_TIMESTAMP);
         if (!fix.timestamp) return;
 
         // convert gps time to epoch time ms
@@ -694,42 +1222,30 @@ void dispatch_pdsm_pd(uint32_t *data) {
         fix.flags |= GPS_LOCATION_HAS_LAT_LONG;
         no_fix = 0;
 
-        if (ntohl(data[75])) {
+        if (PD(PD_HDOP)) {
             fix.flags |= GPS_LOCATION_HAS_ACCURACY;
-            float hdop = (float)ntohl(data[75]) / 10.0f / 2.0f;
+            float hdop = (float)PD(PD_HDOP) / 10.0f / 2.0f;
             fix.accuracy = hdop * (float)MEASUREMENT_PRECISION;
         }
 
-        union {
-            struct {
-                uint32_t lowPart;
-                int32_t highPart;
-            };
-            int64_t int64Part;
-        } latitude, longitude;
-
-        latitude.lowPart = ntohl(data[61]);
-        latitude.highPart = ntohl(data[60]);
-        longitude.lowPart = ntohl(data[63]);
-        longitude.highPart = ntohl(data[62]);
-        fix.latitude = (double)latitude.int64Part / 1.0E8;
-        fix.longitude = (double)longitude.int64Part / 1.0E8;
-    }
-    if (event&PDSM_PD_EVENT_VELOCITY)
+        fix.latitude = (double)(int64_t)(((uint64_t)PD(PD_LAT_HI) << 32) | PD(PD_LAT_LO)) / 1.0E8;
+        fix.longitude = (double)(int64_t)(((uint64_t)PD(PD_LON_HI) << 32) | PD(PD_LON_LO)) / 1.0E8;
+    }
+    if (valid&PDSM_PD_EVENT_VELOCITY)
     {
         D("PDSM_PD_EVENT_VELOCITY");
         if (use_nmea) return;
         fix.flags |= GPS_LOCATION_HAS_SPEED|GPS_LOCATION_HAS_BEARING;
-        fix.speed = (float)ntohl(data[66]) / 10.0f / 3.6f; // convert kp/h to m/s
-        fix.bearing = (float)ntohl(data[67]) / 10.0f;
+        fix.speed = (float)PD(PD_SPEED) / 10.0f / 3.6f; // convert kp/h to m/s
+        fix.bearing = (float)PD(PD_BEARING) / 10.0f;
     }
-    if (event&PDSM_PD_EVENT_HEIGHT)
+    if (valid&PDSM_PD_EVENT_HEIGHT)
     {
         D("PDSM_PD_EVENT_HEIGHT");
         if (use_nmea) return;
         fix.flags |= GPS_LOCATION_HAS_ALTITUDE;
         fix.altitude = 0;
-        double altitude = (double)ntohl(data[64]);
+        double altitude = (double)PD(PD_HEIGHT);
         if (altitude / 10.0f < 1000000.0) // Check if height is not unreasonably high
             fix.altitude = altitude / 10.0f; // Apply height with a division of 10 to correct unit of meters
         else // If unreasonably high then it is a negative height
@@ -737,7 +1253,7 @@ void dispatch_pdsm_pd(uint32_t *data) {
     }
     if (fix.flags)
     {
-        update_gps_location(&fix);
+        deliver_location(&fix);
     }
     if(event&PDSM_PD_EVENT_END)
     {
@@ -750,7 +1266,7 @@ void dispatch_pdsm_pd(uint32_t *data) {
     }
 }
 
-void dispatch_pdsm_ext(uint32_t *data) {
+void dispatch_pdsm_ext(uint32_t *data, int words) {
     GpsSvStatus ret;
     int i;
 
@@ -758,70 +1274,99 @@ void dispatch_pdsm_ext(uint32_t *data) {
 
     no_fix++;
     if (no_fix < 2) return;
-    
-    ret.num_svs=ntohl(data[8]);
+
+    if (words <= EXT_NUM_SVS) {
+        dispatch_stats.short_msgs++;
+        return;
+    }
+    memset(&ret, 0, sizeof(ret));
+    ret.num_svs=(int32_t)ntohl(data[EXT_NUM_SVS]);
     D("%s() is called. num_svs=%d", __FUNCTION__, ret.num_svs);
+    if (ret.num_svs < 0)
+        ret.num_svs = 0;
+    if (ret.num_svs > GPS_MAX_SVS)
+        ret.num_svs = GPS_MAX_SVS;
+    if (ret.num_svs > 0 && EXT_SV_LIST + EXT_SV_WORDS * ret.num_svs > words) {
+        dispatch_stats.short_msgs++;
+        ret.num_svs = words > EXT_SV_LIST ? (words - EXT_SV_LIST) / EXT_SV_WORDS : 0;
+    }
 
 #if DUMP_DATA
     for(i=0;i<12;++i) {
         D("e %3d: %08x ", i, ntohl(data[i]));
     }
-    for(i=101;i<101+12*(ret.num_svs-1)+6;++i) {
+    for(i=EXT_SV_LIST;i<EXT_SV_LIST+EXT_SV_WORDS*ret.num_svs;++i) {
         D("e %3d: %d ", i, ntohl(data[i]));
     }
 #endif
 
     for(i=0;i<ret.num_svs;++i) {
-        ret.sv_list[i].prn=ntohl(data[101+12*i+1]);
-        ret.sv_list[i].elevation=ntohl(data[101+12*i+5]);
-        ret.sv_list[i].azimuth=ntohl(data[101+12*i+4]);
-        ret.sv_list[i].snr=(float)ntohl(data[101+12*i+2])/10.0f;
+        const uint32_t *sv = &data[EXT_SV_LIST + EXT_SV_WORDS * i];
+        ret.sv_list[i].prn=ntohl(sv[1]);
+        ret.sv_list[i].elevation=ntohl(sv[5]);
+        ret.sv_list[i].azimuth=ntohl(sv[4]);
+        ret.sv_list[i].snr=(float)ntohl(sv[2])/10.0f;
     }
     //ret.used_in_fix_mask=ntohl(data[9]);
     ret.used_in_fix_mask=0;
-    update_gps_svstatus(&ret);
+    deliver_svstatus(&ret);
 }
 
-void dispatch_pdsm_xtra_req(uint8_t *data) {
+void dispatch_pdsm_xtra_req(uint8_t *data, int words) {
     //Handles download requests from gps chip
     //Have to check if it is a download request because the same procid is multipurpose
     
     unsigned char url[9]; //Stores the filename for the xtra data
     unsigned int i = 0x50;
     
+    if (words * 4 < i + 8) {
+        dispatch_stats.short_msgs++;
+        return;
+    }
     memcpy(url, &(data[i]), 8); //Copies the filename from the rpc message
     url[8] = '\0'; //Adds the null terminate at the end of the filename to create a string
     
     // Performs comparison with expected string "xtra.bin"
-    if (strcmp(url, "xtra.bin") == 0) {
+    if (strcmp((char *) url, "xtra.bin") == 0) {
         D("Calling xtra_download_request()");
         //Calls the gps_xtra_download_request callback method
-        xtra_download_request();
+        deliver_xtra_request();
     }
 }
 
-void dispatch_pdsm(uint32_t *data) {
-    uint32_t procid=ntohl(data[5]);
+void dispatch_pdsm(uint32_t *data, int words) {
+    if (words <= CALL_ARGS) {
+        dispatch_stats.short_msgs++;
+        return;
+    }
+    uint32_t procid=ntohl(data[CALL_PROC]);
     D("%s() is called. data[5]=procid=%d", __FUNCTION__, procid);
     if(procid==1) 
-        dispatch_pdsm_pd(&(data[10]));
+        dispatch_pdsm_pd(&(data[CALL_ARGS]), words - CALL_ARGS);
     else if(procid==4) 
-        dispatch_pdsm_ext(&(data[10]));
+        dispatch_pdsm_ext(&(data[CALL_ARGS]), words - CALL_ARGS);
     else if(procid==5)
-        dispatch_pdsm_xtra_req(&(data[10]));
+        dispatch_pdsm_xtra_req((uint8_t *)&(data[CALL_ARGS]), words - CALL_ARGS);
 }
 
-void dispatch_atl(uint32_t *data) {
-    D("%s() is called", __FUNCTION__);
+void dispatch_atl(uint32_t *data, int words) {
+    if (words <= CALL_PROC) {
+        dispatch_stats.short_msgs++;
+        return;
+    }
+    D("%s() is called. data[5]=procid=%d, %d words", __FUNCTION__, ntohl(data[CALL_PROC]), words);
     // No clue what happens here.
 }
 
 void dispatch(struct svc_req* a, registered_server* svc) {
-    int i;
+    uint64_t start = rpc_now_us();
+    uint32_t ack_us;
     uint32_t *data=svc->xdr->in_msg;
+    int words=svc->xdr->in_len/4;
     uint32_t result=0;
-    uint32_t svid=ntohl(data[3]);
+    uint32_t svid=words > 3 ? ntohl(data[3]) : 0;
 /*
+    int i;
     D("received some kind of event\n");
     for(i=0;i< svc->xdr->in_len/4;++i) {
         D("%08x ", ntohl(data[i]));
@@ -833,14 +1378,20 @@ void dispatch(struct svc_req* a, registered_server* svc) {
     D("\n");
 */
     if(svid==0x3100005b) {
-        dispatch_pdsm(data);
+        dispatch_pdsm(data, words);
     } else if(svid==0x3100001d) {
-        dispatch_atl(data);
+        dispatch_atl(data, words);
     } else {
         //Got dispatch for unknown serv id!
     }
     //ACK
     svc_sendreply(svc, xdr_int, &result);
+
+    ack_us = rpc_now_us() - start;
+    delivery.acks++;
+    delivery.ack_us_total += ack_us;
+    if (ack_us > delivery.ack_us_max)
+        delivery.ack_us_max = ack_us;
 }
 
 uint8_t get_cleanup_value() {
@@ -853,6 +1404,30 @@ uint8_t get_precision_value() {
     return MEASUREMENT_PRECISION;
 }
 
+uint8_t get_sv_snr_tolerance() {
+    return SV_SNR_TOLERANCE;
+}
+
+uint8_t get_sv_elevation_tolerance() {
+    return SV_ELEVATION_TOLERANCE;
+}
+
+uint8_t get_session_timeout() {
+    return SESSION_TIMEOUT;
+}
+
+uint8_t get_kalman_filter_mode() {
+    return KALMAN_FILTER;
+}
+
+uint8_t get_single_shot_accuracy() {
+    return SINGLE_SHOT_ACCURACY;
+}
+
+uint8_t get_prediction_rate() {
+    return PREDICTION_RATE;
+}
+
 int parse_gps_conf() {
     FILE *file = fopen("/system/etc/gps.conf", "r");
     if (!file) { 
@@ -865,6 +1440,11 @@ int parse_gps_conf() {
     char *check_cleanup = "GPS1_CLEANUP_ENABLED";
     char *check_timeout = "GPS1_SESSION_TIMEOUT";
     char *check_precision = "GPS1_MEASUREMENT_PRECISION";
+    char *check_snr_tolerance = "GPS1_SV_SNR_TOLERANCE";
+    char *check_elevation_tolerance = "GPS1_SV_ELEVATION_TOLERANCE";
+    char *check_single_shot_accuracy = "GPS1_SINGLE_SHOT_ACCURACY";
+    char *check_kalman_filter = "GPS1_KALMAN_FILTER";
+    char *check_prediction_rate = "GPS1_PREDICTION_RATE";
     char *result;
     char str[256];
     int i = -1;
@@ -920,6 +1500,56 @@ int parse_gps_conf() {
                 CHECKED[4] = 1;
             }
         }
+        if (!CHECKED[5]) {
+            result = strstr(str, check_snr_tolerance);
+            if (result != NULL) {
+                result = result+strlen(check_snr_tolerance)+1;
+                i = atoi(result);
+                if (i>=0 && i<=10)
+                    SV_SNR_TOLERANCE = i;
+                CHECKED[5] = 1;
+            }
+        }
+        if (!CHECKED[6]) {
+            result = strstr(str, check_elevation_tolerance);
+            if (result != NULL) {
+                result = result+strlen(check_elevation_tolerance)+1;
+                i = atoi(result);
+                if (i>=0 && i<=10)
+                    SV_ELEVATION_TOLERANCE = i;
+                CHECKED[6] = 1;
+            }
+        }
+        if (!CHECKED[7]) {
+            result = strstr(str, check_single_shot_accuracy);
+            if (result != NULL) {
+                result = result+strlen(check_single_shot_accuracy)+1;
+                i = atoi(result);
+                if (i>0 && i<=255)
+                    SINGLE_SHOT_ACCURACY = i;
+                CHECKED[7] = 1;
+            }
+        }
+        if (!CHECKED[8]) {
+            result = strstr(str, check_kalman_filter);
+            if (result != NULL) {
+                result = result+strlen(check_kalman_filter)+1;
+                i = atoi(result);
+                if (i>=0 && i<=2)
+                    KALMAN_FILTER = i;
+                CHECKED[8] = 1;
+            }
+        }
+        if (!CHECKED[9]) {
+            result = strstr(str, check_prediction_rate);
+            if (result != NULL) {
+                result = result+strlen(check_prediction_rate)+1;
+                i = atoi(result);
+                if (i>=0 && i<=20)
+                    PREDICTION_RATE = i;
+                CHECKED[9] = 1;
+            }
+        }
     }
     fclose(file);
     LOGD("%s() is called: GPS1_XTRA_AUTO_DOWNLOAD_ENABLED = %d", __FUNCTION__, XTRA_AUTO_DOWNLOAD_ENABLED);
@@ -927,69 +1557,119 @@ int parse_gps_conf() {
     LOGD("%s() is called: GPS1_CLEANUP_ENABLED = %d", __FUNCTION__, CLEANUP_ENABLED);
     LOGD("%s() is called: GPS1_SESSION_TIMEOUT = %d", __FUNCTION__, SESSION_TIMEOUT);
     LOGD("%s() is called: GPS1_MEASUREMENT_PRECISION = %d", __FUNCTION__, MEASUREMENT_PRECISION);
+    LOGD("%s() is called: GPS1_SV_SNR_TOLERANCE = %d", __FUNCTION__, SV_SNR_TOLERANCE);
+    LOGD("%s() is called: GPS1_SV_ELEVATION_TOLERANCE = %d", __FUNCTION__, SV_ELEVATION_TOLERANCE);
+    LOGD("%s() is called: GPS1_SINGLE_SHOT_ACCURACY = %d", __FUNCTION__, SINGLE_SHOT_ACCURACY);
+    LOGD("%s() is called: GPS1_KALMAN_FILTER = %d", __FUNCTION__, KALMAN_FILTER);
+    LOGD("%s() is called: GPS1_PREDICTION_RATE = %d", __FUNCTION__, PREDICTION_RATE);
     return 0;
 }
 
+static struct CLIENT *_clnt_atl;
+
+/* undoes what init_leo() set up, in the reverse order */
+static void release_leo() {
+    if (_svc) {
+        svc_unregister(_svc, 0x3100005b, 0x00010001);
+        svc_unregister(_svc, 0x3100005b, 0);
+        svc_unregister(_svc, 0x3100001d, 0x00010001);
+        svc_unregister(_svc, 0x3100001d, 0);
+        xprt_unregister(_svc);
+        svc_destroy(_svc);
+        _svc = NULL;
+    }
+    delivery_cleanup();
+
+    rpc_async_cleanup();
+    if (_clnt_atl) {
+        clnt_destroy(_clnt_atl);
+        _clnt_atl = NULL;
+    }
+    if (_clnt) {
+        clnt_destroy(_clnt);
+        _clnt = NULL;
+    }
+}
+
 int init_leo() 
 {
-    struct CLIENT *clnt=clnt_create(NULL, 0x3000005B, 0x00010001, NULL);
-    struct CLIENT *clnt_atl=clnt_create(NULL, 0x3000001D, 0x00010001, NULL);
-    int i;
-    _clnt=clnt;
-    SVCXPRT *svc=svcrtr_create();
-    _svc=svc;
-    xprt_register(svc);
-    svc_register(svc, 0x3100005b, 0x00010001, (__dispatch_fn_t)dispatch, 0);
-    svc_register(svc, 0x3100005b, 0, (__dispatch_fn_t)dispatch, 0);
-    svc_register(svc, 0x3100001d, 0x00010001, (__dispatch_fn_t)dispatch, 0);
-    svc_register(svc, 0x3100001d, 0, (__dispatch_fn_t)dispatch, 0);
-    if(!clnt) {
-        D("Failed creating client\n");
-        return -1;
+    int ret;
+
+    if (!CHECKED[0]) {
+        if (use_nmea)
+            LOGD("%s() is called: %s version", __FUNCTION__, "NMEA");
+        else
+            LOGD("%s() is called: %s version", __FUNCTION__, "RPC");
+        parse_gps_conf();
+    }
+
+    _clnt=clnt_create(NULL, 0x3000005B, 0x00010001, NULL);
+    _clnt_atl=clnt_create(NULL, 0x3000001D, 0x00010001, NULL);
+    if(!_clnt || !_clnt_atl) {
+        LOGE("%s(): failed creating client", __FUNCTION__);
+        ret = -1;
+        goto Fail;
     }
-    if(!svc) {
-        D("Failed creating server\n");
-        return -2;
+    _svc=svcrtr_create();
+    if(!_svc) {
+        LOGE("%s(): failed creating server", __FUNCTION__);
+        ret = -2;
+        goto Fail;
     }
+    delivery_init();
+    xprt_register(_svc);
+    svc_register(_svc, 0x3100005b, 0x00010001, (__dispatch_fn_t)dispatch, 0);
+    svc_register(_svc, 0x3100005b, 0, (__dispatch_fn_t)dispatch, 0);
+    svc_register(_svc, 0x3100001d, 0x00010001, (__dispatch_fn_t)dispatch, 0);
+    svc_register(_svc, 0x3100001d, 0, (__dispatch_fn_t)dispatch, 0);
+
+    // without the worker, gps_get_position() blocks on the round-trip
+    rpc_async_init();
+
+    // the registrations of a client depend on its init, and the modem
+    // expects the clients in this order, so they stay on _clnt
+    ret = -3;
 
     // PDA
-    pdsm_client_init(clnt, 2);
-    pdsm_client_pd_reg(clnt, 2, 0, 0, 0, 0xF3F0FFFF, 0);
-    pdsm_client_pa_reg(clnt, 2, 0, 2, 0, 0x7FFEFE0, 0);
-    pdsm_client_ext_status_reg(clnt, 2, 0, 1, 0, 4, 0);
-    pdsm_client_act(clnt, 2);
+    if (pdsm_client_init(_clnt, 2) ||
+        pdsm_client_pd_reg(_clnt, 2, 0, 0, 0, 0xF3F0FFFF, 0) < 0 ||
+        pdsm_client_pa_reg(_clnt, 2, 0, 2, 0, 0x7FFEFE0, 0) < 0 ||
+        pdsm_client_ext_status_reg(_clnt, 2, 0, 1, 0, 4, 0) < 0 ||
+        pdsm_client_act(_clnt, 2) < 0)
+        goto Fail;
 
     // XTRA
-    pdsm_client_init(clnt, 0xb);
-    pdsm_client_xtra_reg(clnt, 0xb, 0, 3, 0, 7, 0);
-    pdsm_client_act(clnt, 0xb);
-    pdsm_atl_l2_proxy_reg(clnt_atl, 1,0,0);
-    pdsm_atl_dns_proxy_reg(clnt_atl, 1,0);
+    if (pdsm_client_init(_clnt, 0xb) ||
+        pdsm_client_xtra_reg(_clnt, 0xb, 0, 3, 0, 7, 0) < 0 ||
+        pdsm_client_act(_clnt, 0xb) < 0 ||
+        pdsm_atl_l2_proxy_reg(_clnt_atl, 1,0,0) < 0 ||
+        pdsm_atl_dns_proxy_reg(_clnt_atl, 1,0) < 0)
+        goto Fail;
 
     // NI
-    pdsm_client_init(clnt, 4);
-    pdsm_client_lcs_reg(clnt, 4, 0, 7, 0, 0x3F0, 0);
-    pdsm_client_act(clnt, 4);
+    if (pdsm_client_init(_clnt, 4) ||
+        pdsm_client_lcs_reg(_clnt, 4, 0, 7, 0, 0x3F0, 0) < 0 ||
+        pdsm_client_act(_clnt, 4) < 0)
+        goto Fail;
     
     if (!CHECKED[0]) {
-        if (use_nmea)
-            LOGD("%s() is called: %s version", __FUNCTION__, "NMEA");
-        else
-            LOGD("%s() is called: %s version", __FUNCTION__, "RPC");
-
-        parse_gps_conf();
         if (XTRA_AUTO_DOWNLOAD_ENABLED)
             gps_xtra_set_auto_params();
         CHECKED[0] = 1;
     }
 
     return 0;
+
+Fail:
+    LOGE("%s(): setting up the PDSM clients failed: %d", __FUNCTION__, ret);
+    release_leo();
+    return ret;
 }
 
 int init_gps_rpc() 
 {
-    init_leo();
-    return 0;
+    pdsm_get_position_template_init();
+    return init_leo();
 }
 
 int gps_xtra_set_data(unsigned char *xtra_data_ptr, uint32_t part_len, uint8_t part, uint8_t total_parts) 
@@ -999,6 +1679,121 @@ int gps_xtra_set_data(unsigned char *xtra_data_ptr, uint32_t part_len, uint8_t p
     return res;
 }
 
+/* XTRA injection. the data, from memory or read from a file a part at a
+ * time, is sent in numbered parts, in order, on _clnt. as before, a part
+ * that fails in transport (-1) fails the injection, and the framework
+ * gets what the modem answered to the last part. part numbers are u_char
+ * on the wire, so the block size grows for files that would need more
+ * than XTRA_MAX_PARTS parts. the largest block size the modem takes is
+ * found on part 1: while it fails in transport, it is sent again with the
+ * next smaller candidate. the block size found is kept until the HAL is
+ * unloaded.
+ */
+#define XTRA_BLOCK_SIZE  400
+#define XTRA_MAX_PARTS   255
+
+typedef const unsigned char *(*xtra_part_fn)(void *ctx, uint32_t offset, uint32_t len);
+
+static const uint32_t xtra_block_sizes[] = { 2048, 1024, XTRA_BLOCK_SIZE };
+static int xtra_block_index = 0;
+static int xtra_block_known = 0;
+
+static struct {
+    uint32_t bytes;
+    uint32_t parts;
+    uint32_t block_size;
+    uint32_t ms;
+    int result;
+} xtra_stats;
+
+static uint32_t xtra_block_size(uint32_t length) {
+    uint32_t block = xtra_block_sizes[xtra_block_index];
+
+    if (block < (length + XTRA_MAX_PARTS - 1) / XTRA_MAX_PARTS)
+        block = (length + XTRA_MAX_PARTS - 1) / XTRA_MAX_PARTS;
+    return block;
+}
+
+static const unsigned char *xtra_memory_part(void *ctx, uint32_t offset, uint32_t len) {
+    return (const unsigned char *) ctx + offset;
+}
+
+/* injects length bytes, taking each part from source, which returns the
+ * len bytes at offset or NULL; what it returns must stay valid until the
+ * next call. a part that can't be had fails the injection as a part that
+ * failed in transport does.
+ */
+int gps_xtra_inject_parts(xtra_part_fn source, void *ctx, uint32_t length)
+{
+    const unsigned char *data;
+    uint32_t block, total_parts, part, offset, part_len;
+    int res = -1, progress = 0;
+    struct timeval start, end;
+
+    if (!source || !length)
+        return EINVAL;
+
+    gettimeofday(&start, NULL);
+
+    for (;;) {
+        block = xtra_block_size(length);
+        total_parts = (length + block - 1) / block;
+        part_len = length < block ? length : block;
+        data = source(ctx, 0, part_len);
+        if (!data) {
+            LOGE("%s(): part 1/%d of %d bytes could not be read", __FUNCTION__, total_parts, part_len);
+            res = -1;
+            break;
+        }
+        res = pdsm_xtra_set_data(_clnt, 0, client_IDs[0xb], 0, (unsigned char *) data, part_len, 1, total_parts, 1);
+        if (res != -1 || xtra_block_known ||
+            xtra_block_index + 1 == (int)(sizeof(xtra_block_sizes)/sizeof(xtra_block_sizes[0])))
+            break;
+        xtra_block_index += 1;
+        if (xtra_block_size(length) == block)
+            break;
+        LOGI("%s(): part 1 of %d bytes failed, trying %d byte parts", __FUNCTION__, part_len, xtra_block_size(length));
+    }
+    LOGD("%s(): %d bytes in %d parts of %d bytes", __FUNCTION__, length, total_parts, block);
+    if (res != -1)
+        xtra_block_known = 1;
+
+    for (part = 2, offset = block; res != -1 && part <= total_parts; ++part, offset += block) {
+        part_len = length - offset < block ? length - offset : block;
+        data = source(ctx, offset, part_len);
+        if (!data) {
+            LOGE("%s(): part %d/%d of %d bytes could not be read", __FUNCTION__, part, total_parts, part_len);
+            res = -1;
+            break;
+        }
+        res = pdsm_xtra_set_data(_clnt, 0, client_IDs[0xb], 0, (unsigned char *) data, part_len, part, total_parts, 1);
+        if (res == -1)
+            LOGE("%s(): part %d/%d of %d bytes failed", __FUNCTION__, part, total_parts, part_len);
+        if (part * 10 / total_parts != progress) {
+            progress = part * 10 / total_parts;
+            LOGD("%s(): %d%% injected", __FUNCTION__, progress * 10);
+        }
+    }
+
+    gettimeofday(&end, NULL);
+    xtra_stats.bytes = length;
+    xtra_stats.parts = total_parts;
+    xtra_stats.block_size = block;
+    xtra_stats.ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+    xtra_stats.result = res;
+    LOGI("%s(): %d bytes in %d parts of %d bytes, %d ms, result %d", __FUNCTION__,
+            length, total_parts, block, xtra_stats.ms, res);
+
+    return res == -1 ? EINVAL : res;
+}
+
+int gps_xtra_inject(unsigned char *data, uint32_t length)
+{
+    if (!data)
+        return EINVAL;
+    return gps_xtra_inject_parts(xtra_memory_part, data, length);
+}
+
 int gps_xtra_init_down_req() 
 {
     //Tell gpsOne to request xtra data
@@ -1032,6 +1827,36 @@ int gps_xtra_inject_time_info(GpsUtcTime time, int64_t timeReference, int uncert
     return res;
 }
 
+/* appends the RPC side state for the debug interface */
+int gps_rpc_get_internal_state(char *buffer, int size)
+{
+    int len;
+
+    if (size <= 0)
+        return 0;
+    len = snprintf(buffer, size,
+            "rpc: pd_events=%u short_msgs=%u\n"
+            "rpc: acks=%u ack_us_avg=%u ack_us_max=%u\n"
+            "delivery: depth=%u max_depth=%u delivered=%u dropped_location=%u dropped_sv_status=%u dropped_xtra=%u\n"
+            "xtra: bytes=%u parts=%u block_size=%u ms=%u result=%d\n",
+            dispatch_stats.pd_events, dispatch_stats.short_msgs,
+            delivery.acks, delivery.acks ? (uint32_t)(delivery.ack_us_total / delivery.acks) : 0, delivery.ack_us_max,
+            delivery.head - delivery.tail, delivery.max_depth, delivery.delivered,
+            delivery.dropped[DELIVER_LOCATION], delivery.dropped[DELIVER_SV_STATUS], delivery.dropped[DELIVER_XTRA_REQUEST],
+            xtra_stats.bytes, xtra_stats.parts, xtra_stats.block_size, xtra_stats.ms, xtra_stats.result);
+    if (len < 0)
+        return 0;
+    return len < size ? len : size - 1;
+}
+
+static int get_position_job(struct CLIENT *clnt, void *arg) {
+    return pdsm_get_position_template(clnt, SESSION_TIMEOUT, client_IDs[2]);
+}
+
+static uint32_t get_position_xid;
+
+/* called on gps_state_thread, which mustn't block on the round-trip: the
+ * request goes to an RPC worker, PD_DONE reports the end of the session */
 void gps_get_position() 
 {
 #if GPS_DEBUG
@@ -1041,28 +1866,34 @@ void gps_get_position()
     long time = mktime(&tm);
     D("%s() is called: %ld", __FUNCTION__, time);
 #endif
-    pdsm_get_position(_clnt, 
-            0, 0,           
-            1,              
-            1, 1,           
-            0x3B9AC9FF, 1,  
-        0,                  
-        0, 0,               
-        0, 0,               
-        0,                  
-       0, 0, 0, 0, 0, 0, 0, 
-       0, 0, 0, 0, 0,       
-       1, 50, SESSION_TIMEOUT,
-       client_IDs[2]);
+    get_position_xid = rpc_async_submit(get_position_job, NULL, NULL, NULL);
+}
+
+static int end_session_job(struct CLIENT *clnt, void *arg) {
+    return pdsm_client_end_session(clnt, 0, 0, 0, 2);
 }
 
+static uint32_t end_session_xid;
+
+/* called on gps_state_thread too. the worker runs its jobs in order, so
+ * the end_session follows the get position request that started the
+ * session, without the thread waiting for either */
 void exit_gps_rpc() 
 {
-    pdsm_client_end_session(_clnt, 0, 0, 0, 2);
+    __atomic_store_n(&end_session_xid, rpc_async_submit(end_session_job, NULL, NULL, NULL), __ATOMIC_RELEASE);
+}
+
+/* waits for the end_session of the last exit_gps_rpc() to be answered */
+void wait_gps_rpc_exit() 
+{
+    rpc_async_wait(__atomic_load_n(&end_session_xid, __ATOMIC_ACQUIRE));
 }
 
 void cleanup_gps_rpc_clients() 
 {
+    // an end_session may still be queued
+    rpc_async_cleanup();
+
     pdsm_client_deact(_clnt, 2);
     pdsm_client_deact(_clnt, 0xb);
     pdsm_client_deact(_clnt, 4);
@@ -1070,15 +1901,8 @@ void cleanup_gps_rpc_clients()
     pdsm_client_release(_clnt, 2);
     pdsm_client_release(_clnt, 0xb);
     pdsm_client_release(_clnt, 4);
-    
-    svc_unregister(_svc, 0x3100005b, 0x00010001);
-    svc_unregister(_svc, 0x3100005b, 0);
-    svc_unregister(_svc, 0x3100001d, 0x00010001);
-    svc_unregister(_svc, 0x3100001d, 0);
-    xprt_unregister(_svc);
-    svc_destroy(_svc);
-    
-    clnt_destroy(_clnt);
+
+    release_leo();
 }
 
 // END OF FILE
@@ -24,21 +24,34 @@
  ******************************************************************************/
 
 #include <errno.h>
-#include <semaphore.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
 #include <math.h>
 #include <time.h>
 #include <sys/time.h>
 #include <cutils/log.h>
 #include <cutils/sockets.h>
 #include <gps.h>
+#include "leo-gps-geo.h"
 
 #define  LOG_TAG  "gps_leo"
 
-#define  XTRA_BLOCK_SIZE  400
+/* NMEA source. can be pointed at a FIFO or pty carrying recorded NMEA,
+ * either at build time or with the LEO_GPS_NMEA_DEVICE environment
+ * variable, to run the parser off-device.
+ */
+#ifndef  NMEA_DEVICE
+#define  NMEA_DEVICE  "/dev/smd27"
+#endif
 #define  ENABLE_NMEA 1
+#define  NMEA_VERIFY_CHECKSUM 1
 
 #define  DUMP_DATA  0
 #define  GPS_DEBUG  1
@@ -49,40 +62,134 @@
 #  define  D(...)   ((void)0)
 #endif
 
-#if ENABLE_NMEA
-/* Since NMEA parser requires lcoks */
-#define GPS_STATE_LOCK_FIX(_s)           \
-{                                        \
-    int ret;                             \
-    do {                                 \
-        ret = sem_wait(&(_s)->fix_sem);  \
-    } while (ret < 0 && errno == EINTR); \
+static int64_t now_ns( void ) {
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t now_us( void ) {
+    return now_ns() / 1000;
+}
+
+static int64_t now_ms( void ) {
+    return now_us() / 1000;
 }
 
-#define GPS_STATE_UNLOCK_FIX(_s)         \
-    sem_post(&(_s)->fix_sem)
+/* one-shot timerfd expiry in delay_ms; it_value 0 would disarm it */
+static void timerfd_arm( int  fd, int64_t  delay_ms ) {
+    struct itimerspec  its;
 
-static void *gps_timer_thread( void*  arg );
-#endif
+    if (fd < 0)
+        return;
+    memset( &its, 0, sizeof(its) );
+    if (delay_ms <= 0) {
+        its.it_value.tv_nsec = 1;
+    } else {
+        its.it_value.tv_sec  = delay_ms / 1000;
+        its.it_value.tv_nsec = (delay_ms % 1000) * 1000000;
+    }
+    timerfd_settime( fd, 0, &its, NULL );
+}
+
+/* periodic timerfd expiry every period_ms, starting one period from now */
+static void timerfd_arm_periodic( int  fd, int64_t  period_ms ) {
+    struct itimerspec  its;
+
+    if (fd < 0 || period_ms <= 0)
+        return;
+    its.it_interval.tv_sec  = period_ms / 1000;
+    its.it_interval.tv_nsec = (period_ms % 1000) * 1000000;
+    its.it_value            = its.it_interval;
+    timerfd_settime( fd, 0, &its, NULL );
+}
 
-static void *gps_get_position_thread( void*  arg );
+static void timerfd_disarm( int  fd ) {
+    struct itimerspec  its;
 
-static pthread_mutex_t get_position_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t get_position_cond = PTHREAD_COND_INITIALIZER;
+    if (fd < 0)
+        return;
+    memset( &its, 0, sizeof(its) );
+    timerfd_settime( fd, 0, &its, NULL );
+}
+
+/* latency of each stage of the fix path, from the NMEA bytes being read to
+ * location_cb returning, kept in log2 histograms: bucket n counts samples
+ * under 2^n us, the last one everything slower. a clock read costs about
+ * as much as parsing a short sentence, so only one read() in LATENCY_SAMPLE
+ * is followed through framing, parsing and publishing, with one clock read
+ * per sentence, and one location_cb in LATENCY_SAMPLE is timed. counters
+ * are bumped with atomic adds, as the RPC delivery thread records callbacks
+ * too, and read without locking; they are 32 bits wide, so that ARMv7 adds
+ * and reads them whole, which makes the total in us rather than ns.
+ */
+enum {
+    LATENCY_READ = 0,   // read() of the NMEA device
+    LATENCY_FRAME,      // read() returned, until the sentence is framed
+    LATENCY_PARSE,      // sentence framed, until it is checked and parsed
+    LATENCY_PUBLISH,    // epoch complete, until published (fix_freq holds it)
+    LATENCY_CALLBACK,   // location_cb, until it returns
+    LATENCY_TOTAL,      // read() of the epoch's last sentence, until location_cb returns
+    LATENCY_STAGES
+};
+
+#define  LATENCY_SAMPLE   64  // power of two
+#define  LATENCY_BUCKETS  16
+
+static const char* const  latency_names[LATENCY_STAGES] = {
+    "read", "frame", "parse", "publish", "callback", "total"
+};
+
+typedef struct {
+    uint32_t  samples;
+    uint32_t  total_us;
+    uint32_t  buckets[ LATENCY_BUCKETS ];
+} LatencyHistogram;
+
+static LatencyHistogram  latency[ LATENCY_STAGES ];
 
-static pthread_mutex_t get_pos_ready_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t get_pos_ready_cond = PTHREAD_COND_INITIALIZER;
+static void latency_record( int  stage, int64_t  ns ) {
+    LatencyHistogram*  h = &latency[stage];
+    int64_t            us = ns / 1000;
+    int                n  = 0;
 
-static int started = 0;
-static int active = 0;
+    if (ns < 0)
+        return;
+    if (us > 0)
+        n = us >= (1 << (LATENCY_BUCKETS - 2)) ? LATENCY_BUCKETS - 1
+                                               : 32 - __builtin_clz((uint32_t)us);
+    __sync_fetch_and_add(&h->buckets[n], 1);
+    __sync_fetch_and_add(&h->total_us, (uint32_t)((ns + 500) / 1000));
+    __sync_fetch_and_add(&h->samples, 1);
+}
 
-void update_gps_location(GpsLocation *location);
+void update_gps_location(GpsLocation *location, int64_t received_ms);
 void update_gps_status(GpsStatusValue value);
 void update_gps_svstatus(GpsSvStatus *svstatus);
+void update_gps_ext_svstatus(GpsExtSvStatus *svstatus);
 void update_gps_nmea(GpsUtcTime timestamp, const char* nmea, int length);
 
 extern uint8_t get_cleanup_value();
 extern uint8_t get_precision_value();
+extern uint8_t get_sv_snr_tolerance();
+extern uint8_t get_sv_elevation_tolerance();
+extern uint8_t get_single_shot_accuracy();
+extern uint8_t get_session_timeout();
+extern uint8_t get_kalman_filter_mode();
+extern uint8_t get_prediction_rate();
+extern void gps_filter_reset();
+extern int gps_filter_update(GpsLocation *fix, int64_t received_ms, int extrapolate);
+extern int gps_filter_get_internal_state(char *buffer, int size);
+extern int gps_xtra_inject(unsigned char *data, uint32_t length);
+extern int gps_xtra_inject_parts(const unsigned char *(*source)(void *ctx, uint32_t offset, uint32_t len),
+                                 void *ctx, uint32_t length);
+extern int gps_rpc_get_internal_state(char *buffer, int size);
+extern int gps_xtra_inject_time_info(GpsUtcTime time, int64_t timeReference, int uncertainty);
+extern int init_gps_rpc();
+extern void exit_gps_rpc();
+extern void wait_gps_rpc_exit();
+extern void cleanup_gps_rpc_clients();
+extern void gps_get_position();
 
 /*****************************************************************/
 /*****************************************************************/
@@ -101,17 +208,21 @@ typedef struct {
 
 #define  MAX_NMEA_TOKENS  32
 
+/* tokens are materialized lazily: nmea_tokenizer_init() only trims the
+ * sentence, and nmea_tokenizer_get() scans forward up to the requested
+ * field. sentences that are discarded, or whose trailing fields are never
+ * read, are never split completely.
+ */
 typedef struct {
-    int     count;
-    Token   tokens[ MAX_NMEA_TOKENS ];
+    int          count;
+    const char*  p;
+    const char*  end;
+    Token        tokens[ MAX_NMEA_TOKENS ];
 } NmeaTokenizer;
 
-static int
+static void
 nmea_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end )
 {
-    int    count = 0;
-    char*  q;
-
     // the initial '$' is optional
     if (p < end && p[0] == '$')
         p += 1;
@@ -128,26 +239,9 @@ nmea_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end )
         end -= 3;
     }
 
-    while (p < end) {
-        const char*  q = p;
-
-        q = memchr(p, ',', end-p);
-        if (q == NULL)
-            q = end;
-
-         if (count < MAX_NMEA_TOKENS) {
-             t->tokens[count].p   = p;
-             t->tokens[count].end = q;
-             count += 1;
-         }
-        if (q < end)
-            q += 1;
-
-        p = q;
-    }
-
-    t->count = count;
-    return count;
+    t->count = 0;
+    t->p     = p;
+    t->end   = end;
 }
 
 static Token
@@ -156,6 +250,33 @@ nmea_tokenizer_get( NmeaTokenizer*  t, int  index )
     Token  tok;
     static const char*  dummy = "";
 
+    if (index >= MAX_NMEA_TOKENS)
+        index = -1;
+
+    if (t->count <= index) {
+        // scan with locals: stores to tokens[] could alias t->p and t->end
+        const char*  p     = t->p;
+        const char*  end   = t->end;
+        int          count = t->count;
+
+        while (count <= index && p < end) {
+            const char*  q = memchr(p, ',', end - p);
+
+            if (q == NULL)
+                q = end;
+
+            t->tokens[count].p   = p;
+            t->tokens[count].end = q;
+            count += 1;
+
+            if (q < end)
+                q += 1;
+            p = q;
+        }
+        t->p     = p;
+        t->count = count;
+    }
+
     if (index < 0 || index >= t->count) {
         tok.p = tok.end = dummy;
     } else
@@ -193,12 +314,31 @@ Fail:
     return -1;
 }
 
+/* exact powers of ten, all representable in a double */
+static const double  pow10_table[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* parse a NMEA decimal field ([-+]ddd[.ddd]) in place, without copying it
+ * and without going through the locale-aware strtod(). the digits are
+ * accumulated into an integer mantissa which is then divided by an exact
+ * power of ten, so the result is correctly rounded, i.e. identical to what
+ * strtod() returns, as long as the mantissa stays below 2^53. longer or
+ * unusual fields fall back to strtod().
+ */
 static double
 str2float( const char*  p, const char*  end )
 {
-    int   result = 0;
-    int   len    = end - p;
-    char  temp[16];
+    const char*  q = p;
+    uint64_t     mant = 0;
+    int          digits = 0;
+    int          frac = -1;
+    int          neg  = 0;
+    int          len  = end - p;
+    char         temp[16];
+    double       result;
 
     if (len == 0) {
         return -1.0;
@@ -207,6 +347,36 @@ str2float( const char*  p, const char*  end )
     if (len >= (int)sizeof(temp))
         return 0.;
 
+    if (*q == '-' || *q == '+') {
+        neg = (*q == '-');
+        q  += 1;
+    }
+
+    for ( ; q < end; q++ ) {
+        unsigned  c = (unsigned)(*q - '0');
+
+        if (c < 10) {
+            mant    = mant*10 + c;
+            digits += 1;
+            if (frac >= 0)
+                frac += 1;
+        } else if (*q == '.' && frac < 0) {
+            frac = 0;
+        } else
+            break;
+    }
+
+    if (digits == 0 || mant >= (1ull << 53) ||
+        (q < end && (*q == 'e' || *q == 'E' || *q == 'x' || *q == 'X')))
+        goto Slow;
+
+    result = (double)mant;
+    if (frac > 0)
+        result /= pow10_table[frac];
+
+    return neg ? -result : result;
+
+Slow:
     memcpy( temp, p, len );
     temp[len] = 0;
     return strtod( temp, NULL );
@@ -222,64 +392,137 @@ str2float( const char*  p, const char*  end )
 
 #define  NMEA_MAX_SIZE  255
 
+/* enough for every entry of nmea_sentences[] */
+#define  MAX_NMEA_SENTENCES  16
+
+typedef struct {
+    uint32_t  sentences;
+    uint32_t  bad_checksum;
+    uint32_t  no_checksum;
+    uint32_t  overflows;
+    uint32_t  unknown;
+    uint32_t  reads;
+    uint32_t  parsed[ MAX_NMEA_SENTENCES ];
+    uint32_t  parse_samples[ MAX_NMEA_SENTENCES ];
+    uint32_t  parse_ns[ MAX_NMEA_SENTENCES ];    // halved with its samples before it wraps
+} NmeaStats;
+
+/* SVs of the last GSV cycle of one talker. a talker that stops sending
+ * GSV has its table dropped after NMEA_SV_TABLE_EPOCHS epochs.
+ */
+#define  NMEA_SV_TABLES       4
+#define  NMEA_MAX_TABLE_SVS   36
+#define  NMEA_SV_TABLE_EPOCHS 10
+
+typedef struct {
+    int           num_svs;
+    uint32_t      epoch;        // NmeaReader.epochs when the cycle ended
+    GpsExtSvInfo  sv_list[ NMEA_MAX_TABLE_SVS ];
+} NmeaSvTable;
+
+#define  NMEA_PRN_WORDS  ((GPS_EXT_MAX_PRN + 31) / 32)
+
 typedef struct {
     int      pos;
     int      overflow;
     int      utc_year;
     int      utc_mon;
     int      utc_day;
-    int      utc_diff;
+    int      utc_tod;
+    GpsUtcTime utc_midnight;
     GpsLocation fix;
     GpsSvStatus sv_status;
+    GpsExtSvStatus ext_sv_status;
+    NmeaSvTable sv_tables[ NMEA_SV_TABLES ];
+    uint32_t used_in_fix[ NMEA_PRN_WORDS ];
+    int      gsa_seen;
     int      sv_status_changed;
     uint16_t fix_flags_cached;
+    int      epoch_tod;
+    int      epoch_mask;
+    int      epoch_need;
+    uint32_t epochs;
+    int      fix_ready;
+    int      notify;
+    int64_t  read_ns;      // of the buffer being framed, 0 unless sampled
+    int64_t  stamp_ns;     // last clock read of a sampled buffer
+    NmeaStats stats;
     char     in[ NMEA_MAX_SIZE+1 ];
 } NmeaReader;
 
+/* the last finished epoch, held until it may be published: at once, or
+ * when publish_timer expires if fix_freq asks for a slower rate than the
+ * receiver's. only gps_state_thread touches it.
+ */
+typedef struct {
+    int                fix_pending;
+    int                sv_pending;
+    int64_t            read_ns;    // latency sample, 0 if none
+    int64_t            ready_ns;
+    int64_t            received_ms; // now_ms() when the fix was finished
+    GpsLocation        fix;
+    GpsSvStatus        sv_status;
+    GpsExtSvStatus     ext_sv_status;
+} GpsFixSlot;
+
 enum {
     STATE_QUIT  = 0,
-    STATE_INIT  = 1,
-    STATE_START = 2
+    STATE_INIT  = 1
 };
 
+#define  GPS_CMD_QUEUE  16  // power of two
+
+typedef struct {
+    int      cmd;
+    int64_t  queued_us;
+} GpsCommand;
+
 typedef struct {
     int                     init;
+    int                     started;    // only gps_state_thread touches it
     int                     fd;
     GpsCallbacks            callbacks;
     GpsXtraCallbacks        xtra_callbacks;
     AGpsCallbacks           agps_callbacks;
-    GpsStatus               status;
+    GpsExtSvCallbacks       ext_sv_callbacks;
     pthread_t               thread;
-    pthread_t               pos_thread;
+    int                     session_timer;
+    int                     rpc_event;
+    int                     predict_timer;
 #if ENABLE_NMEA
-    pthread_t               tmr_thread;
-    sem_t                   fix_sem;
+    GpsFixSlot              fix_slot;
+    int                     publish_timer;
+    int                     publish_armed;
+    int64_t                 last_publish;
 #endif
     int                     fix_freq;
-    int                     control[2];
+    // set by the framework, read where fixes are delivered: __atomic
+    int                     single_shot;
+    int                     single_shot_done;
+    uint32_t                single_shot_start_ms;
+    int                     cmd_event;
+    pthread_mutex_t         cmd_lock;
+    pthread_cond_t          cmd_done;
+    GpsCommand              cmds[ GPS_CMD_QUEUE ];
+    int                     cmd_closed;     // no commands after CMD_QUIT
+    uint32_t                cmd_head;
+    uint32_t                cmd_tail;
+    uint32_t                cmd_handled;
+    uint32_t                cmd_wakeups;
+    uint32_t                cmd_dropped;
+    int64_t                 cmd_latency_us_total;
+    int64_t                 cmd_latency_us_max;
     NmeaReader              reader;
+    uint32_t                location_cbs;
+    uint32_t                sv_status_cbs;
+    uint32_t                sv_status_coalesced;
+    uint32_t                nmea_cbs;
+    GpsSvStatus             sv_status_sent;
+    int64_t                 sv_status_sent_ms;
 } GpsState;
 
 static GpsState  _gps_state[1];
 
-static void
-nmea_reader_update_utc_diff( NmeaReader*  r )
-{
-    time_t         now = time(NULL);
-    struct tm      tm_local;
-    struct tm      tm_utc;
-    long           time_local, time_utc;
-
-    gmtime_r( &now, &tm_utc );
-    localtime_r( &now, &tm_local );
-
-    time_local = mktime(&tm_local);
-    time_utc = mktime(&tm_utc);
-
-    r->utc_diff = time_local - time_utc;
-    D("%s() is called. utc_diff = %d", __FUNCTION__, r->utc_diff);
-}
-
 static void
 nmea_reader_init( NmeaReader*  r )
 {
@@ -292,49 +535,72 @@ nmea_reader_init( NmeaReader*  r )
     r->utc_year = -1;
     r->utc_mon  = -1;
     r->utc_day  = -1;
+    r->utc_tod  = -1;
+}
+
+/* days since 1970-01-01 of a proleptic Gregorian date */
+static int
+days_from_civil( int  year, int  mon, int  day )
+{
+    int       era;
+    unsigned  yoe, doy, doe;
+
+    year -= (mon <= 2);
+    era   = (year >= 0 ? year : year - 399) / 400;
+    yoe   = (unsigned)(year - era * 400);
+    doy   = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+    doe   = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int)doe - 719468;
+}
+
+static void
+nmea_reader_set_date( NmeaReader*  r, int  year, int  mon, int  day )
+{
+    if (year == r->utc_year && mon == r->utc_mon && day == r->utc_day)
+        return;
 
-    nmea_reader_update_utc_diff( r );
+    r->utc_year     = year;
+    r->utc_mon      = mon;
+    r->utc_day      = day;
+    r->utc_midnight = (GpsUtcTime)days_from_civil(year, mon, day) * 86400000LL;
 }
 
 static int
 nmea_reader_update_time( NmeaReader*  r, Token  tok )
 {
-    int        hour, minute;
+    int        hour, minute, tod;
     double     seconds;
-    struct tm  tm;
-    time_t     fix_time;
 
     if (tok.p + 6 > tok.end)
         return -1;
 
     if (r->utc_year < 0) {
         // no date yet, get current one
-        time_t  now = time(NULL);
+        struct tm  tm;
+        time_t     now = time(NULL);
         gmtime_r( &now, &tm );
-        r->utc_year = tm.tm_year + 1900;
-        r->utc_mon  = tm.tm_mon + 1;
-        r->utc_day  = tm.tm_mday;
+        nmea_reader_set_date( r, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday );
     }
 
     hour    = str2int(tok.p,   tok.p+2);
     minute  = str2int(tok.p+2, tok.p+4);
     seconds = str2float(tok.p+4, tok.end);
 
-    tm.tm_hour  = hour;
-    tm.tm_min   = minute;
-    tm.tm_sec   = (int) seconds;
-    tm.tm_year  = r->utc_year - 1900;
-    tm.tm_mon   = r->utc_mon - 1;
-    tm.tm_mday  = r->utc_day;
-    tm.tm_isdst = 0;
+    if (hour < 0 || minute < 0 || seconds < 0)
+        return -1;
+
+    tod = (hour*3600 + minute*60) * 1000 + (int)(seconds*1000 + 0.5);
 
-    fix_time = mktime( &tm ) + r->utc_diff;
+    // the time of day wrapped around before a RMC told us the new date
+    if (r->utc_tod >= 0 && tod + 43200000 < r->utc_tod)
+        r->utc_midnight += 86400000LL;
+    r->utc_tod = tod;
 
 #if DUMP_DATA
-    D("fix_time=%d", fix_time); // UTC time + utc_diff
+    D("fix_time=%lld", r->utc_midnight + tod);
 #endif
 
-    r->fix.timestamp = (long long)fix_time * 1000 + (int)(seconds*1000)%1000;;
+    r->fix.timestamp = r->utc_midnight + tod;
     return 0;
 }
 
@@ -357,9 +623,8 @@ nmea_reader_update_date( NmeaReader*  r, Token  date, Token  time )
         return -1;
     }
 
-    r->utc_year  = year;
-    r->utc_mon   = mon;
-    r->utc_day   = day;
+    nmea_reader_set_date( r, year, mon, day );
+    r->utc_tod = -1;
 
     return nmea_reader_update_time( r, time );
 }
@@ -464,6 +729,44 @@ nmea_reader_update_bearing( NmeaReader*  r,
     return 0;
 }
 
+/* sentences of a fix epoch. the epoch is complete, and the fix can be
+ * published, once every sentence in epoch_need has been received with the
+ * same UTC time. that is NMEA_EPOCH_COMPLETE for a receiver sending both
+ * GGA and RMC. epoch_need starts out with whichever of them comes first,
+ * and only grows by those actually seen, so a receiver that never sends
+ * RMC (or GGA) still gets its fixes published. an epoch that ends without
+ * one of them, e.g. because its RMC was lost, drops it from epoch_need
+ * until it shows up again, rather than holding back every later fix.
+ */
+#define  NMEA_EPOCH_GGA       0x01
+#define  NMEA_EPOCH_RMC       0x02
+#define  NMEA_EPOCH_GSA       0x04
+#define  NMEA_EPOCH_DONE      0x80
+#define  NMEA_EPOCH_COMPLETE  (NMEA_EPOCH_GGA | NMEA_EPOCH_RMC)
+
+static void
+nmea_reader_update_epoch( NmeaReader*  r, int  sentence )
+{
+    if (sentence != NMEA_EPOCH_GSA && r->utc_tod != r->epoch_tod) {
+        if ((r->epoch_mask & NMEA_EPOCH_COMPLETE) && !(r->epoch_mask & NMEA_EPOCH_DONE)) {
+            D("epoch %d missed 0x%x", r->epoch_tod, r->epoch_need & ~r->epoch_mask);
+            r->epoch_need = r->epoch_mask & NMEA_EPOCH_COMPLETE;
+        }
+        r->epoch_tod  = r->utc_tod;
+        r->epoch_mask = 0;
+        r->epochs    += 1;
+    }
+    r->epoch_need |= sentence & NMEA_EPOCH_COMPLETE;
+    r->epoch_mask |= sentence;
+
+    if (r->epoch_need &&
+        (r->epoch_mask & (r->epoch_need | NMEA_EPOCH_DONE)) == r->epoch_need) {
+        r->epoch_mask |= NMEA_EPOCH_DONE;
+        r->fix_ready   = 1;
+        r->notify      = 1;
+    }
+}
+
 static int
 nmea_reader_update_speed( NmeaReader*  r,
                           Token        speed )
@@ -481,27 +784,382 @@ nmea_reader_update_speed( NmeaReader*  r,
     return 0;
 }
 
+/* sentence handlers. 'talker' is the packed two character talker id
+ * (GP, GL, GN, BD, ...) of the sentence. a handler returns non-zero when
+ * the sentence must be reported through the nmea callback.
+ */
+typedef int (*NmeaHandler)( NmeaReader*  r, NmeaTokenizer*  tzer, int  talker );
+
+#define  NMEA_TALKER(a,b)   (((a) << 8) | (b))
+#define  NMEA_ID(a,b,c)     (((uint32_t)(a) << 16) | ((uint32_t)(b) << 8) | (uint32_t)(c))
+
+/* map a NMEA PRN to the PRN ranges of GpsExtSvInfo. returns the
+ * constellation, or GPS_CONSTELLATION_UNKNOWN if the PRN can't be mapped.
+ */
+static int
+nmea_sv_constellation( int  talker, int  *prn )
+{
+    int  n = *prn;
+
+    if (n <= 0)
+        return GPS_CONSTELLATION_UNKNOWN;
+
+    switch (talker) {
+    case NMEA_TALKER('G','L'):
+        if (n <= 32)
+            *prn = n += 64;
+        break;
+    case NMEA_TALKER('B','D'):
+    case NMEA_TALKER('G','B'):
+        if (n <= 63)
+            *prn = n += 200;
+        break;
+    case NMEA_TALKER('G','A'):
+        if (n <= 36)
+            *prn = n += 300;
+        break;
+    }
+
+    if (n <= 32)                return GPS_CONSTELLATION_GPS;
+    if (n <= 64)                return GPS_CONSTELLATION_SBAS;
+    if (n <= 96)                return GPS_CONSTELLATION_GLONASS;
+    if (n >= 120 && n <= 158)   return GPS_CONSTELLATION_SBAS;
+    if (n >= 193 && n <= 200)   return GPS_CONSTELLATION_QZSS;
+    if (n >= 201 && n <= 263)   return GPS_CONSTELLATION_BEIDOU;
+    if (n >= 301 && n <= 336)   return GPS_CONSTELLATION_GALILEO;
+    return GPS_CONSTELLATION_UNKNOWN;
+}
+
+static int
+nmea_sv_table( int  talker )
+{
+    switch (talker) {
+    case NMEA_TALKER('G','L'):  return 1;
+    case NMEA_TALKER('B','D'):
+    case NMEA_TALKER('G','B'):  return 2;
+    case NMEA_TALKER('G','A'):  return 3;
+    default:                    return 0;
+    }
+}
+
+/* rebuild the extended SV status from the per-talker tables and the
+ * used-in-fix bit set, and down-convert it for the legacy GpsSvStatus:
+ * the first GPS_MAX_SVS GPS and SBAS SVs, and masks of GPS PRNs only.
+ * legacy clients take every PRN for a GPS one, so the SVs of the other
+ * constellations are left out.
+ * NMEA doesn't tell what the receiver has ephemeris or almanac for: an
+ * SV used in the fix has ephemeris, and one reported with a position in
+ * the sky at least has almanac.
+ */
+static void
+nmea_reader_update_sv_status( NmeaReader*  r )
+{
+    GpsExtSvStatus*  ext = &r->ext_sv_status;
+    GpsSvStatus*     sv  = &r->sv_status;
+    int              t, i;
+
+    ext->num_svs = 0;
+    for (t = 0; t < NMEA_SV_TABLES; t++) {
+        NmeaSvTable*  table = &r->sv_tables[t];
+        int           count;
+
+        if (table->num_svs > 0 && r->epochs - table->epoch > NMEA_SV_TABLE_EPOCHS) {
+            D("SV table %d not refreshed for %u epochs", t, r->epochs - table->epoch);
+            table->num_svs = 0;
+        }
+        count = table->num_svs;
+        if (count > GPS_EXT_MAX_SVS - ext->num_svs)
+            count = GPS_EXT_MAX_SVS - ext->num_svs;
+        memcpy( &ext->sv_list[ext->num_svs], table->sv_list, count * sizeof(GpsExtSvInfo) );
+        ext->num_svs += count;
+    }
+    memcpy( ext->used_in_fix_mask, r->used_in_fix, sizeof(ext->used_in_fix_mask) );
+
+    sv->num_svs      = 0;
+    sv->almanac_mask = 0;
+    for (i = 0; i < ext->num_svs && sv->num_svs < GPS_MAX_SVS; i++) {
+        const GpsExtSvInfo*  info = &ext->sv_list[i];
+        GpsSvInfo*           out;
+
+        if (info->constellation != GPS_CONSTELLATION_GPS &&
+            info->constellation != GPS_CONSTELLATION_SBAS)
+            continue;
+        out = &sv->sv_list[sv->num_svs++];
+        out->prn       = info->prn;
+        out->snr       = info->snr;
+        out->elevation = info->elevation;
+        out->azimuth   = info->azimuth;
+        if (info->prn <= 32 && info->elevation >= 0 && info->azimuth >= 0)
+            sv->almanac_mask |= 1u << (info->prn - 1);
+    }
+    sv->used_in_fix_mask = r->used_in_fix[0];
+    sv->ephemeris_mask   = r->used_in_fix[0];
+    sv->almanac_mask    |= r->used_in_fix[0];
+
+    r->sv_status_changed = 1;
+    r->notify = 1;
+}
+
+static int
+nmea_reader_parse_gsv( NmeaReader*  r, NmeaTokenizer*  tzer, int  talker )
+{
+    // Satellites in View
+    Token  tok_num_svs           = nmea_tokenizer_get(tzer, 3);
+    int    num_svs = str2int(tok_num_svs.p, tok_num_svs.end);
+
+    if (num_svs == 0) {
+        // the talker lost all its SVs
+        NmeaSvTable*  table = &r->sv_tables[ nmea_sv_table(talker) ];
+
+        if (table->num_svs > 0) {
+            table->num_svs = 0;
+            nmea_reader_update_sv_status( r );
+        }
+    } else if (num_svs > 0) {
+        Token tok_total_sentences= nmea_tokenizer_get(tzer, 1);
+        Token tok_sentence_no    = nmea_tokenizer_get(tzer, 2);
+
+        int sentence_no = str2int(tok_sentence_no.p, tok_sentence_no.end);
+        int total_sentences = str2int(tok_total_sentences.p, tok_total_sentences.end);
+        NmeaSvTable*  table = &r->sv_tables[ nmea_sv_table(talker) ];
+        int i;
+
+        if (sentence_no == 1)
+            table->num_svs = 0;
+
+        for (i = 0; i < 4 && table->num_svs < NMEA_MAX_TABLE_SVS; i++) {
+            Token  tok_prn       = nmea_tokenizer_get(tzer, i*4 + 4);
+            Token  tok_elevation = nmea_tokenizer_get(tzer, i*4 + 5);
+            Token  tok_azimuth   = nmea_tokenizer_get(tzer, i*4 + 6);
+            Token  tok_snr       = nmea_tokenizer_get(tzer, i*4 + 7);
+            int    prn;
+            int    constellation;
+
+            float snr = str2float(tok_snr.p, tok_snr.end);
+            if (snr <= 0)
+                continue;
+
+            prn = str2int(tok_prn.p, tok_prn.end);
+            constellation = nmea_sv_constellation(talker, &prn);
+            if (constellation == GPS_CONSTELLATION_UNKNOWN)
+                continue;
+
+            GpsExtSvInfo*  info = &table->sv_list[table->num_svs++];
+            info->prn           = prn;
+            info->elevation     = str2float(tok_elevation.p, tok_elevation.end);
+            info->azimuth       = str2float(tok_azimuth.p, tok_azimuth.end);
+            info->snr           = snr;
+            info->constellation = constellation;
+#if DUMP_DATA
+            D("GSV sentence %d of %d: prn=%2d", sentence_no, total_sentences, prn);
+#endif
+        }
+
+        if (sentence_no == total_sentences) {
+            table->epoch = r->epochs;
+            nmea_reader_update_sv_status( r );
+        }
+    }
+    return 0;
+}
+
+static int
+nmea_reader_parse_gga( NmeaReader*  r, NmeaTokenizer*  tzer, int  talker )
+{
+    // GPS fix
+    Token  tok_fix_status        = nmea_tokenizer_get(tzer,6);
+
+    // Fix quality: {0 = invalid}, {1 = GPS fix}, ...
+    if (tok_fix_status.p[0] > '0') {
+        Token  tok_time          = nmea_tokenizer_get(tzer,1);
+        Token  tok_latitude      = nmea_tokenizer_get(tzer,2);
+        Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,3);
+        Token  tok_longitude     = nmea_tokenizer_get(tzer,4);
+        Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,5);
+        Token  tok_accuracy      = nmea_tokenizer_get(tzer,8);
+        Token  tok_altitude      = nmea_tokenizer_get(tzer,9);
+        Token  tok_altitudeUnits = nmea_tokenizer_get(tzer,10);
+        Token  tok_geoidHeight   = nmea_tokenizer_get(tzer,11);
+
+        nmea_reader_update_time(r, tok_time);
+        nmea_reader_update_latlong(r, tok_latitude,
+                                      tok_latitudeHemi.p[0],
+                                      tok_longitude,
+                                      tok_longitudeHemi.p[0]);
+        nmea_reader_update_accuracy(r, tok_accuracy);
+        nmea_reader_update_altitude(r, tok_altitude, tok_altitudeUnits, tok_geoidHeight);
+        nmea_reader_update_epoch(r, NMEA_EPOCH_GGA);
+    }
+    return 1;
+}
+
+static int
+nmea_reader_parse_rmc( NmeaReader*  r, NmeaTokenizer*  tzer, int  talker )
+{
+    // Recommended minimum specific GPS/Transit data
+    Token  tok_fix_status        = nmea_tokenizer_get(tzer, 2);
+
+    // Status: {A = active} or {V = void}
+    if (tok_fix_status.p[0] == 'A') {
+        Token  tok_time          = nmea_tokenizer_get(tzer,1);
+        Token  tok_latitude      = nmea_tokenizer_get(tzer,3);
+        Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,4);
+        Token  tok_longitude     = nmea_tokenizer_get(tzer,5);
+        Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,6);
+        Token  tok_speed         = nmea_tokenizer_get(tzer,7);
+        Token  tok_bearing       = nmea_tokenizer_get(tzer,8);
+        Token  tok_date          = nmea_tokenizer_get(tzer,9);
+
+        nmea_reader_update_date( r, tok_date, tok_time );
+        nmea_reader_update_latlong( r, tok_latitude,
+                                       tok_latitudeHemi.p[0],
+                                       tok_longitude,
+                                       tok_longitudeHemi.p[0] );
+        nmea_reader_update_bearing( r, tok_bearing );
+        nmea_reader_update_speed  ( r, tok_speed );
+        nmea_reader_update_epoch  ( r, NMEA_EPOCH_RMC );
+    }
+    return 1;
+}
+
+static int
+nmea_reader_parse_gsa( NmeaReader*  r, NmeaTokenizer*  tzer, int  talker )
+{
+    // GPS DOP and active satellites.
+    Token  tok_fix_status        = nmea_tokenizer_get(tzer, 2);
+    int    system                = GPS_CONSTELLATION_UNKNOWN;
+    int    prn, i;
+
+    // the constellation of the first PRN given; a GSA without any has none
+    for (i = 3; i <= 14 && system == GPS_CONSTELLATION_UNKNOWN; ++i) {
+        Token  tok_prn = nmea_tokenizer_get(tzer, i);
+        prn    = str2int(tok_prn.p, tok_prn.end);
+        system = nmea_sv_constellation(talker, &prn);
+    }
+
+    /* a multi-constellation receiver sends one GSA per constellation,
+     * possibly all with the GN talker. a new set of GSAs starts when a
+     * constellation shows up a second time.
+     */
+    if (system != GPS_CONSTELLATION_UNKNOWN) {
+        if (r->gsa_seen & (1 << system)) {
+            memset( r->used_in_fix, 0, sizeof(r->used_in_fix) );
+            r->gsa_seen = 0;
+        }
+        r->gsa_seen |= 1 << system;
+    } else if (tok_fix_status.p[0] != '3' && tok_fix_status.p[0] != '2') {
+        // no fix at all, nothing is used in one
+        memset( r->used_in_fix, 0, sizeof(r->used_in_fix) );
+        r->gsa_seen = 0;
+    }
+
+    // {3 = 3D fix}, {2 = 2D fix}, {1 = no fix}
+    if (tok_fix_status.p[0] == '3' || tok_fix_status.p[0] == '2') {
+        // We have accuracy in GGA
+        //Token  tok_accuracy      = nmea_tokenizer_get(tzer, 16);
+        //nmea_reader_update_accuracy(r, tok_accuracy);
+
+        for (i = 3; i <= 14; ++i) {
+            Token  tok_prn       = nmea_tokenizer_get(tzer, i);
+            prn = str2int(tok_prn.p, tok_prn.end);
+            if (nmea_sv_constellation(talker, &prn) != GPS_CONSTELLATION_UNKNOWN)
+                r->used_in_fix[(prn-1) >> 5] |= 1u << ((prn-1) & 31);
+        }
+    }
+#if DUMP_DATA
+    D("%s: used_in_fix_mask is 0x%x", __FUNCTION__, r->used_in_fix[0]);
+#endif
+    nmea_reader_update_epoch(r, NMEA_EPOCH_GSA);
+    nmea_reader_update_sv_status( r );
+    return 1;
+}
+
+/* the sentences we understand, regardless of the talker */
+static const struct {
+    uint32_t     id;
+    NmeaHandler  handler;
+} nmea_sentences[] = {
+    { NMEA_ID('G','S','V'), nmea_reader_parse_gsv },
+    { NMEA_ID('G','G','A'), nmea_reader_parse_gga },
+    { NMEA_ID('R','M','C'), nmea_reader_parse_rmc },
+    { NMEA_ID('G','S','A'), nmea_reader_parse_gsa },
+};
+
+/* open-addressed lookup table built from nmea_sentences[]. an unknown
+ * sentence id almost always lands on an empty slot and is rejected with
+ * a single compare.
+ */
+#define  NMEA_DISPATCH_BITS  5
+#define  NMEA_DISPATCH_SIZE  (1 << NMEA_DISPATCH_BITS)
+
+typedef struct {
+    uint32_t     id;
+    NmeaHandler  handler;
+    int          index;
+} NmeaDispatch;
+
+static NmeaDispatch  nmea_dispatch[ NMEA_DISPATCH_SIZE ];
+
+static unsigned
+nmea_dispatch_hash( uint32_t  id )
+{
+    return (id * 2654435761u) >> (32 - NMEA_DISPATCH_BITS);
+}
+
+static void
+nmea_dispatch_init( void )
+{
+    unsigned  n;
+
+    memset( nmea_dispatch, 0, sizeof(nmea_dispatch) );
+    for (n = 0; n < sizeof(nmea_sentences)/sizeof(nmea_sentences[0]); n++) {
+        unsigned  slot = nmea_dispatch_hash(nmea_sentences[n].id);
+
+        while (nmea_dispatch[slot].id != 0)
+            slot = (slot + 1) & (NMEA_DISPATCH_SIZE - 1);
+
+        nmea_dispatch[slot].id      = nmea_sentences[n].id;
+        nmea_dispatch[slot].handler = nmea_sentences[n].handler;
+        nmea_dispatch[slot].index   = n;
+    }
+}
+
+static const NmeaDispatch*
+nmea_dispatch_find( uint32_t  id )
+{
+    unsigned  slot = nmea_dispatch_hash(id);
+
+    while (nmea_dispatch[slot].id != id) {
+        if (nmea_dispatch[slot].id == 0)
+            return NULL;
+        slot = (slot + 1) & (NMEA_DISPATCH_SIZE - 1);
+    }
+    return &nmea_dispatch[slot];
+}
+
 static void
-nmea_reader_parse( NmeaReader*  r )
+nmea_reader_parse( NmeaReader*  r, const char*  sentence, int  len )
 {
    /* we received a complete sentence, now parse it to generate
     * a new GPS fix...
     */
     NmeaTokenizer  tzer[1];
     Token          tok;
+    const NmeaDispatch*  entry;
+    int            talker;
     int            report_nmea = 0;
 
 #if DUMP_DATA
-    D("Received: %.*s", r->pos, r->in);
+    D("Received: %.*s", len, sentence);
 #endif
-    if (r->pos < 9) {
+    if (len < 9) {
 #if DUMP_DATA
         D("Too short. discarded.");
 #endif
         return;
     }
 
-    nmea_tokenizer_init(tzer, r->in, r->in + r->pos);
+    nmea_tokenizer_init(tzer, sentence, sentence + len);
 /*
 #if GPS_DEBUG
     {
@@ -521,138 +1179,29 @@ nmea_reader_parse( NmeaReader*  r )
         return;
     }
 
-    // ignore first two characters.
-    tok.p += 2;
-    if ( !memcmp(tok.p, "GSV", 3) ) {
-        // Satellites in View
-        Token  tok_num_svs           = nmea_tokenizer_get(tzer, 3);
-        int    num_svs = str2int(tok_num_svs.p, tok_num_svs.end);
-        //report_nmea = 1;
-
-        if (num_svs > 0) {
-            Token tok_total_sentences= nmea_tokenizer_get(tzer, 1);
-            Token tok_sentence_no    = nmea_tokenizer_get(tzer, 2);
-
-            int sentence_no = str2int(tok_sentence_no.p, tok_sentence_no.end);
-            int total_sentences = str2int(tok_total_sentences.p, tok_total_sentences.end);
-            int curr;
-            int i;
-
-            if (sentence_no == 1) {
-                r->sv_status_changed = 0;
-                r->sv_status.num_svs = 0;
-                memset( r->sv_status.sv_list, 0, sizeof(r->sv_status.sv_list) );
-            }
-
-            curr = (sentence_no - 1) * 4;
-            i = 0;
-            while (i < 4 && r->sv_status.num_svs < num_svs) {
-                Token  tok_prn       = nmea_tokenizer_get(tzer, i*4 + 4);
-                Token  tok_elevation = nmea_tokenizer_get(tzer, i*4 + 5);
-                Token  tok_azimuth   = nmea_tokenizer_get(tzer, i*4 + 6);
-                Token  tok_snr       = nmea_tokenizer_get(tzer, i*4 + 7);
-
-                float snr = str2float(tok_snr.p, tok_snr.end);
-                if (snr > 0) {
-                    r->sv_status.sv_list[curr].prn       = str2int(tok_prn.p, tok_prn.end);
-                    r->sv_status.sv_list[curr].elevation = str2float(tok_elevation.p, tok_elevation.end);
-                    r->sv_status.sv_list[curr].azimuth   = str2float(tok_azimuth.p, tok_azimuth.end);
-                    r->sv_status.sv_list[curr].snr       = snr;
-                    r->sv_status.num_svs += 1;
-                }
+    // the address is a two character talker followed by the sentence id
+    talker  = NMEA_TALKER(tok.p[0], tok.p[1]);
+    entry   = nmea_dispatch_find( NMEA_ID(tok.p[2], tok.p[3], tok.p[4]) );
+    if (entry == NULL) {
+        r->stats.unknown += 1;
 #if DUMP_DATA
-                D("GSV sentence %2d of %d: prn=%2d", curr+1, num_svs, r->sv_status.sv_list[curr].prn);
+        D("unknown sentence '%.*s", tok.end-tok.p, tok.p);
 #endif
-                curr += 1;
-                i += 1;
-            }
-
-            if (sentence_no == total_sentences) {
-                r->sv_status_changed = 1;
-            }
-        }
-
-    } else if ( !memcmp(tok.p, "GGA", 3) ) {
-        // GPS fix
-        Token  tok_fix_status        = nmea_tokenizer_get(tzer,6);
-        report_nmea = 1;
-
-        // Fix quality: {0 = invalid}, {1 = GPS fix}, ...
-        if (tok_fix_status.p[0] > '0') {
-            Token  tok_time          = nmea_tokenizer_get(tzer,1);
-            Token  tok_latitude      = nmea_tokenizer_get(tzer,2);
-            Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,3);
-            Token  tok_longitude     = nmea_tokenizer_get(tzer,4);
-            Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,5);
-            Token  tok_accuracy      = nmea_tokenizer_get(tzer,8);
-            Token  tok_altitude      = nmea_tokenizer_get(tzer,9);
-            Token  tok_altitudeUnits = nmea_tokenizer_get(tzer,10);
-            Token  tok_geoidHeight   = nmea_tokenizer_get(tzer,11);
-
-            nmea_reader_update_time(r, tok_time);
-            nmea_reader_update_latlong(r, tok_latitude,
-                                          tok_latitudeHemi.p[0],
-                                          tok_longitude,
-                                          tok_longitudeHemi.p[0]);
-            nmea_reader_update_accuracy(r, tok_accuracy);
-            nmea_reader_update_altitude(r, tok_altitude, tok_altitudeUnits, tok_geoidHeight);
-        }
-
-    } else if ( !memcmp(tok.p, "RMC", 3) ) {
-        // Recommended minimum specific GPS/Transit data
-        Token  tok_fix_status        = nmea_tokenizer_get(tzer, 2);
-        report_nmea = 1;
-
-        // Status: {A = active} or {V = void}
-        if (tok_fix_status.p[0] == 'A') {
-            Token  tok_time          = nmea_tokenizer_get(tzer,1);
-            Token  tok_latitude      = nmea_tokenizer_get(tzer,3);
-            Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,4);
-            Token  tok_longitude     = nmea_tokenizer_get(tzer,5);
-            Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,6);
-            Token  tok_speed         = nmea_tokenizer_get(tzer,7);
-            Token  tok_bearing       = nmea_tokenizer_get(tzer,8);
-            Token  tok_date          = nmea_tokenizer_get(tzer,9);
-
-            nmea_reader_update_date( r, tok_date, tok_time );
-            nmea_reader_update_latlong( r, tok_latitude,
-                                           tok_latitudeHemi.p[0],
-                                           tok_longitude,
-                                           tok_longitudeHemi.p[0] );
-            nmea_reader_update_bearing( r, tok_bearing );
-            nmea_reader_update_speed  ( r, tok_speed );
-        }
+        return;
+    }
 
-    } else if ( !memcmp(tok.p, "GSA", 3) ) {
-        // GPS DOP and active satellites.
-        Token  tok_fix_status        = nmea_tokenizer_get(tzer, 2);
-        report_nmea = 1;
-        r->sv_status.used_in_fix_mask = 0ul;
-
-        // {3 = 3D fix}, {2 = 2D fix}, {1 = no fix}
-        if (tok_fix_status.p[0] == '3' || tok_fix_status.p[0] == '2') {
-            // We have accuracy in GGA
-            //Token  tok_accuracy      = nmea_tokenizer_get(tzer, 16);
-            //nmea_reader_update_accuracy(r, tok_accuracy);
-
-            int i;
-            for (i = 3; i <= 14; ++i) {
-                Token  tok_prn       = nmea_tokenizer_get(tzer, i);
-                int prn = str2int(tok_prn.p, tok_prn.end);
-                if (prn > 0)
-                    r->sv_status.used_in_fix_mask |= (1ul << (prn-1));
-            }
+    r->stats.parsed[entry->index] += 1;
+    report_nmea = entry->handler( r, tzer, talker );
+    if (r->read_ns) {
+        int64_t  frame_ns = r->stamp_ns;
+        r->stamp_ns = now_ns();
+        latency_record( LATENCY_PARSE, r->stamp_ns - frame_ns );
+        if (r->stats.parse_ns[entry->index] >= UINT32_MAX / 2) {
+            r->stats.parse_ns[entry->index]      /= 2;
+            r->stats.parse_samples[entry->index] /= 2;
         }
-#if DUMP_DATA
-        D("%s: used_in_fix_mask is 0x%x", __FUNCTION__, r->sv_status.used_in_fix_mask);
-#endif
-        r->sv_status_changed = 1;
-
-    } else {
-        tok.p -= 2;
-#if DUMP_DATA
-        D("unknown sentence '%.*s", tok.end-tok.p, tok.p);
-#endif
+        r->stats.parse_samples[entry->index] += 1;
+        r->stats.parse_ns[entry->index]      += (uint32_t)(r->stamp_ns - frame_ns);
     }
 #if DUMP_DATA
     if (r->fix.flags) {
@@ -687,109 +1236,356 @@ nmea_reader_parse( NmeaReader*  r )
     if (report_nmea) {
         struct timeval tv;
         gettimeofday(&tv, NULL);
-        update_gps_nmea(tv.tv_sec*1000+tv.tv_usec/1000, r->in, r->pos);
+        update_gps_nmea(tv.tv_sec*1000+tv.tv_usec/1000, sentence, len);
         report_nmea = 0;
     }
 }
 
-static void
-nmea_reader_addc( NmeaReader*  r, int  c )
+static int
+hex2int( int  c )
 {
-    if (r->overflow) {
-        r->overflow = (c != '\n');
-        return;
-    }
+    if ((unsigned)(c - '0') < 10)
+        return c - '0';
+    c |= 0x20;
+    if ((unsigned)(c - 'a') < 6)
+        return c - 'a' + 10;
+    return -1;
+}
 
-    if (r->pos >= (int) sizeof(r->in)-1 ) {
-        r->overflow = 1;
-        r->pos      = 0;
-        return;
+/* XOR of all the characters in [p, end), folded a word at a time. the
+ * byte order of the words does not matter since every byte ends up being
+ * XORed into the low eight bits.
+ */
+static int
+nmea_checksum( const char*  p, const char*  end )
+{
+    uint32_t  sum = 0;
+
+    while (end - p >= 4) {
+        uint32_t  w;
+        memcpy( &w, p, sizeof(w) );
+        sum ^= w;
+        p   += 4;
     }
+    sum ^= sum >> 16;
+    sum ^= sum >> 8;
 
-    r->in[r->pos] = (char)c;
-    r->pos       += 1;
+    while (p < end)
+        sum ^= (unsigned char) *p++;
 
-    if (c == '\n') {
-#if ENABLE_NMEA
-        GPS_STATE_LOCK_FIX(_gps_state);
-        nmea_reader_parse( r );
-        GPS_STATE_UNLOCK_FIX(_gps_state);
-#endif
-        r->pos = 0;
-    }
+    return sum & 0xff;
 }
 
-/*****************************************************************/
-/*****************************************************************/
-/*****                                                       *****/
-/*****       C O N N E C T I O N   S T A T E                 *****/
-/*****                                                       *****/
-/*****************************************************************/
-/*****************************************************************/
+/* returns 0 if the sentence must be dropped because its "*hh" checksum
+ * does not match. sentences without a checksum are accepted and counted.
+ */
+static int
+nmea_reader_check( NmeaReader*  r, const char*  sentence, int  len )
+{
+    const char*  p   = sentence;
+    const char*  end = sentence + len;
+    int          hi, lo;
 
-/* commands sent to the gps thread */
-enum {
-    CMD_QUIT  = 0,
-    CMD_START = 1,
-    CMD_STOP  = 2
-};
+    if (p < end && p[0] == '$')
+        p += 1;
 
-static void gps_state_done( GpsState*  s ) {
+    if (end > p && end[-1] == '\n') {
+        end -= 1;
+        if (end > p && end[-1] == '\r')
+            end -= 1;
+    }
 
-    update_gps_status(GPS_STATUS_ENGINE_OFF);
+    if (end < p+3 || end[-3] != '*') {
+        r->stats.no_checksum += 1;
+        return 1;
+    }
 
-    // tell the thread to quit, and wait for it
-    char   cmd = CMD_QUIT;
-    int    ret;
-    void*  dummy;
+    hi = hex2int(end[-2]);
+    lo = hex2int(end[-1]);
+    if (hi < 0 || lo < 0 || nmea_checksum(p, end-3) != ((hi << 4) | lo)) {
+        r->stats.bad_checksum += 1;
+#if DUMP_DATA
+        D("bad checksum, discarded: %.*s", len, sentence);
+#endif
+        return 0;
+    }
+    return 1;
+}
+
+#if ENABLE_NMEA
+/* keep the finished epoch for gps_state_publish() */
+static void
+nmea_reader_publish( NmeaReader*  r, GpsFixSlot*  slot )
+{
+    int  fix = r->fix_ready && (r->fix.flags & GPS_LOCATION_HAS_LAT_LONG);
+
+    slot->read_ns  = r->read_ns;
+    slot->ready_ns = r->stamp_ns;
+    if (fix) {
+        if (r->fix_flags_cached > 0)
+            r->fix.flags |= r->fix_flags_cached;
+        r->fix_flags_cached = r->fix.flags;
+        slot->fix         = r->fix;
+        slot->fix_pending = 1;
+        slot->received_ms = now_ms();
+        r->fix.flags      = 0;
+    }
+    if (r->sv_status_changed) {
+        slot->sv_status     = r->sv_status;
+        slot->ext_sv_status = r->ext_sv_status;
+        slot->sv_pending    = 1;
+        r->sv_status_changed = 0;
+    }
+    r->fix_ready = 0;
+}
+
+static void
+gps_state_publish( GpsState*  s )
+{
+    GpsFixSlot*  slot = &s->fix_slot;
+
+    if (slot->read_ns)
+        latency_record( LATENCY_PUBLISH, now_ns() - slot->ready_ns );
+    if (slot->fix_pending) {
+#if DUMP_DATA
+        D("fix.flags = 0x%x", slot->fix.flags);
+#endif
+        s->last_publish   = now_ms();
+        slot->fix_pending = 0;
+        update_gps_location( &slot->fix, slot->received_ms );
+        if (slot->read_ns)
+            latency_record( LATENCY_TOTAL, now_ns() - slot->read_ns );
+    }
+    slot->read_ns = 0;
+    if (slot->sv_pending) {
+        slot->sv_pending = 0;
+        update_gps_svstatus( &slot->sv_status );
+        update_gps_ext_svstatus( &slot->ext_sv_status );
+    }
+}
+
+/* publish a finished epoch right away, unless fix_freq asks for a slower
+ * rate: then the latest one is held back until publish_timer expires.
+ * only fixes are rate limited, a SV status on its own goes out at once.
+ */
+static void
+gps_state_fix_ready( GpsState*  s )
+{
+    GpsFixSlot*  slot = &s->fix_slot;
+    int64_t      period, now;
+
+    // don't report what was parsed while we're stopped
+    if (!s->started) {
+        slot->fix_pending = slot->sv_pending = 0;
+        return;
+    }
+    // the first fix after the delay will be sent by the timer
+    if (s->publish_armed)
+        return;
 
-    do { ret=write( s->control[0], &cmd, 1 ); }
+    // don't hold 1 Hz fixes back because of sentence jitter
+    period = (int64_t)s->fix_freq * 1000 - 500;
+    now    = now_ms();
+    if (!slot->fix_pending || s->publish_timer < 0 || now - s->last_publish >= period) {
+        gps_state_publish( s );
+    } else {
+        timerfd_arm( s->publish_timer, s->last_publish + period - now );
+        s->publish_armed = 1;
+    }
+}
+#endif
+
+static void
+nmea_reader_dispatch( NmeaReader*  r, const char*  sentence, int  len )
+{
+    r->stats.sentences += 1;
+    // framing is a memchr(), this sentence was framed when the last one was done
+    if (r->read_ns)
+        latency_record( LATENCY_FRAME, r->stamp_ns - r->read_ns );
+#if NMEA_VERIFY_CHECKSUM
+    if (!nmea_reader_check( r, sentence, len ))
+        return;
+#endif
+#if ENABLE_NMEA
+    nmea_reader_parse( r, sentence, len );
+
+    if (r->notify) {
+        r->notify = 0;
+        nmea_reader_publish( r, &_gps_state->fix_slot );
+        gps_state_fix_ready( _gps_state );
+    }
+#endif
+}
+
+/* frame a whole read() buffer at once. complete sentences are located with
+ * memchr() (which bionic/glibc implement with word-at-a-time or NEON/SSE2
+ * scanning) and handed to the parser in place; only the sentence that
+ * straddles two reads is staged into r->in.
+ */
+static void
+nmea_reader_addbuf( NmeaReader*  r, const char*  buf, int  len )
+{
+    const char*  p   = buf;
+    const char*  end = buf + len;
+
+    while (p < end) {
+        const char*  eol = memchr(p, '\n', end - p);
+        int          n;
+
+        if (eol == NULL) {
+            // incomplete sentence, keep it for the next read
+            n = end - p;
+            if (!r->overflow) {
+                if (r->pos + n > NMEA_MAX_SIZE) {
+                    r->overflow = 1;
+                    r->pos      = 0;
+                    r->stats.overflows += 1;
+                } else {
+                    memcpy( r->in + r->pos, p, n );
+                    r->pos += n;
+                }
+            }
+            break;
+        }
+
+        eol += 1;
+        n    = eol - p;
+
+        if (r->overflow) {
+            // tail of an oversized sentence, drop it
+            r->overflow = 0;
+        } else if (r->pos > 0) {
+            // complete the sentence started by the previous read
+            if (r->pos + n > NMEA_MAX_SIZE) {
+                r->pos = 0;
+                r->stats.overflows += 1;
+            } else {
+                memcpy( r->in + r->pos, p, n );
+                nmea_reader_dispatch( r, r->in, r->pos + n );
+                r->pos = 0;
+            }
+        } else if (n <= NMEA_MAX_SIZE) {
+            nmea_reader_dispatch( r, p, n );
+        } else {
+            r->stats.overflows += 1;
+        }
+        p = eol;
+    }
+}
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       C O N N E C T I O N   S T A T E                 *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* commands sent to the gps thread. they are queued in s->cmds, in order,
+ * and cmd_event is signalled; the thread handles everything queued in one
+ * wakeup. cmd_tail counts handled commands, so a caller can wait for its
+ * own to be done, e.g. for the session to have actually ended.
+ */
+enum {
+    CMD_QUIT  = 0,
+    CMD_START = 1,
+    CMD_STOP  = 2
+};
+
+static int gps_state_command( GpsState*  s, int  cmd, int  wait ) {
+    uint64_t  one = 1;
+    uint32_t  seq;
+    int       ret;
+
+    if (s->cmd_event < 0)
+        return -1;
+
+    pthread_mutex_lock(&s->cmd_lock);
+    if (s->cmd_closed) {
+        pthread_mutex_unlock(&s->cmd_lock);
+        D("%s: gps thread quitting, command %d dropped", __FUNCTION__, cmd);
+        return -1;
+    }
+    while (s->cmd_head - s->cmd_tail >= GPS_CMD_QUEUE) {
+        // the gps thread can't wait for itself
+        if (pthread_equal(pthread_self(), s->thread)) {
+            s->cmd_dropped += 1;
+            pthread_mutex_unlock(&s->cmd_lock);
+            LOGE("%s: command queue full, command %d dropped", __FUNCTION__, cmd);
+            return -1;
+        }
+        pthread_cond_wait(&s->cmd_done, &s->cmd_lock);
+        if (s->cmd_closed) {
+            pthread_mutex_unlock(&s->cmd_lock);
+            return -1;
+        }
+    }
+    if (cmd == CMD_QUIT)
+        s->cmd_closed = 1;
+    seq = s->cmd_head++;
+    s->cmds[seq & (GPS_CMD_QUEUE - 1)].cmd       = cmd;
+    s->cmds[seq & (GPS_CMD_QUEUE - 1)].queued_us = now_us();
+    pthread_mutex_unlock(&s->cmd_lock);
+
+    do { ret=write( s->cmd_event, &one, sizeof(one) ); }
     while (ret < 0 && errno == EINTR);
+    if (ret != sizeof(one))
+        D("%s: could not signal command %d: ret=%d: %s",
+        __FUNCTION__, cmd, ret, strerror(errno));
+
+    if (wait && !pthread_equal(pthread_self(), s->thread)) {
+        pthread_mutex_lock(&s->cmd_lock);
+        while ((int32_t)(s->cmd_tail - seq) <= 0)
+            pthread_cond_wait(&s->cmd_done, &s->cmd_lock);
+        pthread_mutex_unlock(&s->cmd_lock);
+    }
+    return 0;
+}
 
-    pthread_join(s->thread, &dummy);
-    pthread_join(s->pos_thread, &dummy);
+static void gps_state_done( GpsState*  s ) {
+
+    update_gps_status(GPS_STATUS_ENGINE_OFF);
+
+    // tell the thread to quit, and wait for it
+    void*  dummy;
 
-    // close the control socket pair
-    close( s->control[0] ); s->control[0] = -1;
-    close( s->control[1] ); s->control[1] = -1;
+    if (gps_state_command(s, CMD_QUIT, 0) == 0)
+        pthread_join(s->thread, &dummy);
+
+    close( s->cmd_event ); s->cmd_event = -1;
+    pthread_cond_destroy(&s->cmd_done);
+    pthread_mutex_destroy(&s->cmd_lock);
 
     // close connection to the GPS daemon
     close( s->fd ); s->fd = -1;
 
     s->init = STATE_QUIT;
+    close( s->session_timer ); s->session_timer = -1;
+    close( s->rpc_event ); s->rpc_event = -1;
+    close( s->predict_timer ); s->predict_timer = -1;
 #if ENABLE_NMEA
-    sem_destroy(&s->fix_sem);
+    close( s->publish_timer ); s->publish_timer = -1;
 #endif
 }
 
 static void gps_state_start( GpsState*  s ) {
     // Navigation started.
     update_gps_status(GPS_STATUS_SESSION_BEGIN);
+    __atomic_store_n(&s->single_shot_start_ms, (uint32_t)now_ms(), __ATOMIC_RELAXED);
+    __atomic_store_n(&s->single_shot_done, 0, __ATOMIC_RELEASE);
 
-    char  cmd = CMD_START;
-    int   ret;
-
-    do { ret=write( s->control[0], &cmd, 1 ); }
-    while (ret < 0 && errno == EINTR);
-
-    if (ret != 1)
-        D("%s: could not send CMD_START command: ret=%d: %s",
-        __FUNCTION__, ret, strerror(errno));
+    gps_state_command(s, CMD_START, 0);
 }
 
-static void gps_state_stop( GpsState*  s ) {
+/* with wait, returns once the PD session has been ended */
+static void gps_state_stop( GpsState*  s, int  wait ) {
     // Navigation ended.
     update_gps_status(GPS_STATUS_SESSION_END);
 
-    char  cmd = CMD_STOP;
-    int   ret;
-
-    do { ret=write( s->control[0], &cmd, 1 ); }
-    while (ret < 0 && errno == EINTR);
-
-    if (ret != 1)
-        D("%s: could not send CMD_STOP command: ret=%d: %s",
-        __FUNCTION__, ret, strerror(errno));
+    gps_state_command(s, CMD_STOP, wait);
+    // the state thread only queued the end_session
+    if (wait)
+        wait_gps_rpc_exit();
 }
 
 static int epoll_register( int  epoll_fd, int  fd ) {
@@ -816,23 +1612,267 @@ static int epoll_deregister( int  epoll_fd, int  fd ) {
     return ret;
 }
 
-void update_gps_location(GpsLocation *location) {
+/* in single-shot mode, fixes are held back until one is accurate enough;
+ * that one is delivered and the session stopped. fixes without an
+ * accuracy estimate can't be judged, they are only taken once the
+ * session has run for GPS1_SESSION_TIMEOUT without a better one.
+ */
+static int single_shot_accepts( GpsState*  s, const GpsLocation*  location ) {
+    uint32_t  start = __atomic_load_n(&s->single_shot_start_ms, __ATOMIC_RELAXED);
+
+    if (!(location->flags & GPS_LOCATION_HAS_LAT_LONG))
+        return 0;
+    if (!(location->flags & GPS_LOCATION_HAS_ACCURACY))
+        return (uint32_t)now_ms() - start >= (uint32_t)get_session_timeout() * 1000;
+    return location->accuracy <= get_single_shot_accuracy();
+}
+
+/* between real fixes, predicted ones are delivered GPS1_PREDICTION_RATE
+ * times a second, dead-reckoned from the last fix's speed and bearing and
+ * flagged GPS_LOCATION_IS_PREDICTED. that is only while the app asks for a
+ * fix every second: one asking for fewer gets no more locations than it
+ * asked for. predict_timer is re-armed on every real fix, so predictions
+ * keep their phase to it, and disarms itself once the last fix is
+ * PREDICT_MAX_AGE_MS old. each real fix is also compared with what would
+ * have been predicted for its time, and the error kept in a histogram.
+ *
+ * real fixes may come from the RPC delivery thread, so the last one is
+ * kept under predict.lock, which the framework is never called with.
+ * every real fix and reset bumps predict.generation. location_cb, for
+ * real fixes and predictions alike, is called with predict.deliver held,
+ * and a prediction is only delivered if the generation it was made from
+ * is still current under it: it can't overtake the real fix after it.
+ */
+#define  PREDICT_MAX_RATE     20
+#define  PREDICT_MAX_AGE_MS   2000
+#define  PREDICT_MIN_SPEED    0.5      // m/s, slower than that the bearing is noise
+#define  PREDICT_ACCEL        1.0      // m/s^2, unknown acceleration for the accuracy
+#define  PREDICT_BUCKETS      6
+
+static const int  predict_bucket_m[PREDICT_BUCKETS - 1] = {
+    1, 2, 5, 10, 20
+};
+
+static struct {
+    pthread_mutex_t  lock;
+    pthread_mutex_t  deliver;      // held across location_cb, taken before lock
+    int              valid;
+    uint32_t         generation;   // bumped under lock, read without it
+    GpsLocation      last;
+    int64_t          last_ms;      // now_ms() when last was delivered
+    uint32_t         predicted;
+    uint32_t         checked;
+    double           error_m_total;
+    double           error_m_max;
+    uint32_t         error[PREDICT_BUCKETS];
+} predict = { .lock = PTHREAD_MUTEX_INITIALIZER, .deliver = PTHREAD_MUTEX_INITIALIZER };
+
+static int predict_usable( const GpsLocation*  fix ) {
+    const GpsLocationFlags  need = GPS_LOCATION_HAS_LAT_LONG |
+                                   GPS_LOCATION_HAS_SPEED    |
+                                   GPS_LOCATION_HAS_BEARING;
+
+    return (fix->flags & need) == need && fix->speed >= PREDICT_MIN_SPEED;
+}
+
+static void predict_location( const GpsLocation*  from, int64_t  dt_ms, GpsLocation*  to ) {
+    double  t = dt_ms / 1000.0;
+    double  d = from->speed * t;
+    double  b = from->bearing * DEG2RAD;
+
+    *to = *from;
+    to->latitude  += d * cos(b) / EARTH_RADIUS / DEG2RAD;
+    to->longitude += d * sin(b) / (EARTH_RADIUS * cos(from->latitude * DEG2RAD)) / DEG2RAD;
+    to->timestamp += dt_ms;
+    if (to->flags & GPS_LOCATION_HAS_ACCURACY)
+        to->accuracy += (float) (PREDICT_ACCEL * t * t / 2);
+    to->flags |= GPS_LOCATION_IS_PREDICTED;
+}
+
+/* meters between two nearby fixes */
+static double predict_distance( const GpsLocation*  a, const GpsLocation*  b ) {
+    double  n = (b->latitude - a->latitude) * DEG2RAD * EARTH_RADIUS;
+    double  e = (b->longitude - a->longitude) * DEG2RAD * EARTH_RADIUS *
+                cos(a->latitude * DEG2RAD);
+
+    return sqrt(n * n + e * e);
+}
+
+/* ms between predictions, 0 if there are to be none */
+static int predict_period_ms( GpsState*  s, int  rate ) {
+    if (rate <= 0 || __atomic_load_n(&s->fix_freq, __ATOMIC_RELAXED) > 1)
+        return 0;
+    return 1000 / (rate < PREDICT_MAX_RATE ? rate : PREDICT_MAX_RATE);
+}
+
+/* called with predict.lock held, for every real fix about to be delivered */
+static void predict_record_fix( GpsState*  s, const GpsLocation*  fix, int  period ) {
+    int64_t  dt;
+    int      n;
+
+    if (!(fix->flags & GPS_LOCATION_HAS_LAT_LONG))
+        return;
+
+    dt = fix->timestamp - predict.last.timestamp;
+    if (predict.valid && predict_usable(&predict.last) &&
+        dt > 0 && dt <= PREDICT_MAX_AGE_MS) {
+        GpsLocation  p;
+        double       err;
+
+        predict_location( &predict.last, dt, &p );
+        err = predict_distance( &p, fix );
+        predict.checked       += 1;
+        predict.error_m_total += err;
+        if (err > predict.error_m_max)
+            predict.error_m_max = err;
+        for (n = 0; n < PREDICT_BUCKETS - 1; n++)
+            if (err < predict_bucket_m[n])
+                break;
+        predict.error[n]++;
+    }
+
+    predict.valid   = 1;
+    predict.last    = *fix;
+    predict.last_ms = now_ms();
+    __atomic_add_fetch(&predict.generation, 1, __ATOMIC_RELEASE);
+    if (predict_usable(fix))
+        timerfd_arm_periodic( s->predict_timer, period );
+}
+
+/* predict_timer expired, on gps_state_thread */
+static void predict_tick( GpsState*  s ) {
+    GpsLocation  last, p;
+    uint32_t     generation;
+    int64_t      age;
+
+    pthread_mutex_lock(&predict.lock);
+    age = now_ms() - predict.last_ms;
+    if (!predict.valid || !predict_usable(&predict.last) || age > PREDICT_MAX_AGE_MS) {
+        timerfd_disarm( s->predict_timer );
+        pthread_mutex_unlock(&predict.lock);
+        return;
+    }
+    last       = predict.last;
+    generation = predict.generation;
+    pthread_mutex_unlock(&predict.lock);
+
+    predict_location( &last, age, &p );
+    pthread_mutex_lock(&predict.deliver);
+    // superseded by a real fix, or reset, in the meantime
+    if (__atomic_load_n(&predict.generation, __ATOMIC_ACQUIRE) == generation) {
+        __atomic_add_fetch(&predict.predicted, 1, __ATOMIC_RELAXED);
+        if (s->callbacks.location_cb)
+            s->callbacks.location_cb(&p);
+    }
+    pthread_mutex_unlock(&predict.deliver);
+}
+
+/* called with predict.lock held */
+static void predict_drop( GpsState*  s ) {
+    predict.valid = 0;
+    __atomic_add_fetch(&predict.generation, 1, __ATOMIC_RELEASE);
+    timerfd_disarm( s->predict_timer );
+}
+
+static void predict_reset( GpsState*  s ) {
+    pthread_mutex_lock(&predict.lock);
+    predict_drop( s );
+    pthread_mutex_unlock(&predict.lock);
+}
+
+/* received_ms is now_ms() when the fix came in, which it may have waited
+ * since for fix_freq or the RPC delivery queue */
+void update_gps_location(GpsLocation *location, int64_t received_ms) {
 #if DUMP_DATA
     D("%s(): GpsLocation=%f, %f", __FUNCTION__, location->latitude, location->longitude);
 #endif
     GpsState*  state = _gps_state;
-    //Should be made thread safe...
-    if(state->callbacks.location_cb)
-        state->callbacks.location_cb(location);
+    int        filter_mode = get_kalman_filter_mode();
+    int        single_shot = __atomic_load_n(&state->single_shot, __ATOMIC_RELAXED);
+    int        period = single_shot ? 0 : predict_period_ms(state, get_prediction_rate());
+
+    // 1: smooth and drop outliers, 2: also extrapolate to the callback
+    if (filter_mode && !gps_filter_update(location, received_ms, filter_mode > 1))
+        return;
+
+    if (single_shot) {
+        if (__atomic_load_n(&state->single_shot_done, __ATOMIC_ACQUIRE) ||
+            !single_shot_accepts(state, location) ||
+            __atomic_exchange_n(&state->single_shot_done, 1, __ATOMIC_ACQ_REL))
+            return;
+    }
+
+    pthread_mutex_lock(&predict.deliver);
+    pthread_mutex_lock(&predict.lock);
+    if (period > 0)
+        predict_record_fix( state, location, period );
+    else if (predict.valid)
+        predict_drop( state );  // turned off since: nothing older may follow
+    pthread_mutex_unlock(&predict.lock);
+    state->location_cbs += 1;
+    if(state->callbacks.location_cb) {
+        if ((state->location_cbs & (LATENCY_SAMPLE - 1)) == 0) {
+            int64_t  t0 = now_ns();
+            state->callbacks.location_cb(location);
+            latency_record( LATENCY_CALLBACK, now_ns() - t0 );
+        } else {
+            state->callbacks.location_cb(location);
+        }
+    }
+    pthread_mutex_unlock(&predict.deliver);
+
+    if (single_shot) {
+        // ends the PD session and idles the threads, without waiting for it
+        D("single-shot fix delivered, stopping");
+        gps_state_stop(state, 0);
+    }
 }
 
 void update_gps_status(GpsStatusValue value) {
     D("%s(): GpsStatusValue=%d", __FUNCTION__, value);
     GpsState*  state = _gps_state;
-    //Should be made thread safe...
-    state->status.status=value;
+    GpsStatus  status;
+
+    // called from the framework's threads and the RPC side
+    status.status = value;
     if(state->callbacks.status_cb)
-        state->callbacks.status_cb(&state->status);
+        state->callbacks.status_cb(&status);
+}
+
+/* an SV status is only worth a callback when a satellite came or went, the
+ * masks changed, or a signal moved by more than the gps.conf tolerances;
+ * otherwise it is repeated every SV_STATUS_HEARTBEAT_MS at most.
+ */
+#define  SV_STATUS_HEARTBEAT_MS  5000
+
+static int sv_angle_moved( float  a, float  b, float  tolerance ) {
+    float  d = fabsf(a - b);
+    if (d > 180.0f)
+        d = 360.0f - d;
+    return d > tolerance;
+}
+
+static int sv_status_changed( const GpsSvStatus*  a, const GpsSvStatus*  b ) {
+    float  snr_tolerance  = get_sv_snr_tolerance();
+    float  elev_tolerance = get_sv_elevation_tolerance();
+    int    n;
+
+    if (a->num_svs != b->num_svs ||
+        a->used_in_fix_mask != b->used_in_fix_mask ||
+        a->ephemeris_mask != b->ephemeris_mask ||
+        a->almanac_mask != b->almanac_mask)
+        return 1;
+
+    for (n = 0; n < a->num_svs && n < GPS_MAX_SVS; n++) {
+        const GpsSvInfo*  x = &a->sv_list[n];
+        const GpsSvInfo*  y = &b->sv_list[n];
+        if (x->prn != y->prn ||
+            fabsf(x->snr - y->snr) > snr_tolerance ||
+            sv_angle_moved(x->elevation, y->elevation, elev_tolerance) ||
+            sv_angle_moved(x->azimuth, y->azimuth, elev_tolerance))
+            return 1;
+    }
+    return 0;
 }
 
 void update_gps_svstatus(GpsSvStatus *svstatus) {
@@ -840,37 +1880,238 @@ void update_gps_svstatus(GpsSvStatus *svstatus) {
     D("%s(): GpsSvStatus.num_svs=%d", __FUNCTION__, svstatus->num_svs);
 #endif
     GpsState*  state = _gps_state;
+    int64_t    now   = now_ms();
+
+    // only ever called from one thread: gps_state_thread in NMEA mode,
+    // the RPC delivery thread otherwise
+    if (now - state->sv_status_sent_ms < SV_STATUS_HEARTBEAT_MS &&
+        !sv_status_changed(svstatus, &state->sv_status_sent)) {
+        state->sv_status_coalesced += 1;
+        return;
+    }
+    state->sv_status_sent    = *svstatus;
+    state->sv_status_sent_ms = now;
+    state->sv_status_cbs += 1;
     //Should be made thread safe...
     if(state->callbacks.sv_status_cb)
         state->callbacks.sv_status_cb(svstatus);
 }
 
+void update_gps_ext_svstatus(GpsExtSvStatus *svstatus) {
+    GpsState*  state = _gps_state;
+    //Should be made thread safe...
+    if(state->ext_sv_callbacks.ext_sv_status_cb)
+        state->ext_sv_callbacks.ext_sv_status_cb(svstatus);
+}
+
 void update_gps_nmea(GpsUtcTime timestamp, const char* nmea, int length) {
 #if DUMP_DATA
     D("%s(): length=%d, NMEA=%.*s", __FUNCTION__, length, length, nmea);
 #endif
     GpsState*  state = _gps_state;
+    state->nmea_cbs += 1;
     //Should be made thread safe...
     if(state->callbacks.nmea_cb)
         state->callbacks.nmea_cb(timestamp, nmea, length);
 }
 
-/* this is the main thread, it waits for commands from gps_state_start/stop and,
- * when started, messages from the NMEA SMD. these are simple NMEA sentences
- * that must be parsed to be converted into GPS fixes sent to the framework
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       S E S S I O N   S C H E D U L E R               *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* a PD session is started just early enough to finish by the time the
+ * next fix is due, one fix_freq after the last one was planned. the lead
+ * time is the expected time to fix, a running mean plus twice the mean
+ * deviation of past sessions (as for TCP's RTO), capped by SESSION_TIMEOUT.
+ * how far finished sessions land from their planned time is kept in a
+ * histogram for tuning. everything here runs on gps_state_thread: the
+ * session timerfd starts sessions and times them out, rpc_event reports
+ * PD_DONE from the RPC side.
+ */
+#define  SCHED_DONE_SLACK_MS  1000
+#define  SCHED_BUCKETS        8
+
+static const int  sched_bucket_ms[SCHED_BUCKETS - 1] = {
+    -1000, -500, -100, 100, 500, 1000, 2000
+};
+
+static struct {
+    int       running;
+    int64_t   next_fix;
+    int64_t   session_start;
+    int64_t   ttf_mean_ms;
+    int64_t   ttf_dev_ms;
+    uint32_t  sessions;
+    uint32_t  timeouts;
+    uint32_t  lateness[SCHED_BUCKETS];
+} sched;
+
+/* called from the RPC side on PDSM_PD_EVENT_DONE */
+void pdsm_pd_callback() {
+    GpsState*  s   = _gps_state;
+    uint64_t   one = 1;
+    int        ret;
+
+    if (s->rpc_event < 0)
+        return;
+    do { ret=write( s->rpc_event, &one, sizeof(one) ); }
+    while (ret < 0 && errno == EINTR);
+}
+
+static int64_t sched_lead_ms( int64_t  timeout_ms ) {
+    int64_t  lead = sched.ttf_mean_ms + 2 * sched.ttf_dev_ms;
+    return lead < timeout_ms ? lead : timeout_ms;
+}
+
+static void sched_update( int64_t  ttf_ms ) {
+    int64_t  err = ttf_ms - sched.ttf_mean_ms;
+
+    if (sched.sessions++ == 0) {
+        sched.ttf_mean_ms = ttf_ms;
+        sched.ttf_dev_ms  = ttf_ms / 2;
+        return;
+    }
+    sched.ttf_mean_ms += err / 8;
+    sched.ttf_dev_ms  += ((err < 0 ? -err : err) - sched.ttf_dev_ms) / 4;
+}
+
+static void sched_record_lateness( int64_t  late_ms ) {
+    int  n;
+    for (n = 0; n < SCHED_BUCKETS - 1; n++)
+        if (late_ms < sched_bucket_ms[n])
+            break;
+    sched.lateness[n]++;
+}
+
+/* arm the session timer for the start of the next session */
+static void sched_plan( GpsState*  s ) {
+    int64_t  lead = sched_lead_ms( (int64_t)get_session_timeout() * 1000 );
+    int64_t  now  = now_ms();
+
+    // first session, or behind schedule: start right away
+    if (sched.next_fix < now + lead)
+        sched.next_fix = now + lead;
+    timerfd_arm( s->session_timer, sched.next_fix - lead - now );
+}
+
+static void sched_start_session( GpsState*  s ) {
+    sched.running       = 1;
+    sched.session_start = now_ms();
+    gps_get_position();
+    timerfd_arm( s->session_timer,
+                 (int64_t)get_session_timeout() * 1000 + SCHED_DONE_SLACK_MS );
+}
+
+static void sched_end_session( GpsState*  s, int  done ) {
+    int64_t  now = now_ms();
+
+    if (!sched.running)
+        return;
+    sched.running = 0;
+    if (done) {
+        sched_update( now - sched.session_start );
+        sched_record_lateness( now - sched.next_fix );
+    } else {
+        D("%s: no PD_DONE after %lld ms", __FUNCTION__, now - sched.session_start);
+        sched.timeouts++;
+    }
+    sched.next_fix += (s->fix_freq > 0 ? s->fix_freq : 1) * 1000;
+    sched_plan( s );
+}
+
+/* returns 0 when the thread should quit */
+static int gps_state_handle_command( GpsState*  state, int  cmd ) {
+    if (cmd == CMD_QUIT) {
+        D("gps thread quitting on demand");
+        return 0;
+    } else if (cmd == CMD_START) {
+        if (!state->started) {
+            D("gps thread starting  location_cb=%p", state->callbacks.location_cb);
+            state->started = 1;
+            gps_filter_reset();
+            predict_reset( state );
+            sched.next_fix = 0;
+            sched_plan( state );
+#if ENABLE_NMEA
+            state->fix_slot.fix_pending = 0;
+            state->fix_slot.sv_pending  = 0;
+            state->last_publish = 0;
+#endif
+        }
+    } else if (cmd == CMD_STOP) {
+        if (state->started) {
+            D("gps thread stopping");
+            state->started = 0;
+            sched.running = 0;
+            timerfd_disarm( state->session_timer );
+            predict_reset( state );
+#if ENABLE_NMEA
+            timerfd_disarm( state->publish_timer );
+            state->publish_armed = 0;
+#endif
+            exit_gps_rpc();
+        }
+    }
+    return 1;
+}
+
+/* handle everything queued, acknowledging each command as it's done */
+static int gps_state_run_commands( GpsState*  state ) {
+    int  more = 1;
+
+    pthread_mutex_lock(&state->cmd_lock);
+    state->cmd_wakeups += 1;
+    while (more && state->cmd_tail != state->cmd_head) {
+        GpsCommand  c = state->cmds[state->cmd_tail & (GPS_CMD_QUEUE - 1)];
+        int64_t     latency;
+
+        pthread_mutex_unlock(&state->cmd_lock);
+        more = gps_state_handle_command( state, c.cmd );
+        latency = now_us() - c.queued_us;
+        pthread_mutex_lock(&state->cmd_lock);
+
+        state->cmd_tail += 1;
+        state->cmd_handled += 1;
+        state->cmd_latency_us_total += latency;
+        if (latency > state->cmd_latency_us_max)
+            state->cmd_latency_us_max = latency;
+        pthread_cond_broadcast(&state->cmd_done);
+    }
+    pthread_mutex_unlock(&state->cmd_lock);
+    return more;
+}
+
+/* this is the main thread, a single epoll loop owning everything on the
+ * fix path: commands from gps_state_start/stop, the NMEA SMD (simple NMEA
+ * sentences parsed into fixes and published from here), the timerfds that
+ * rate-limit publishing and schedule PD sessions, and the eventfd that
+ * the RPC side signals PD_DONE on.
  */
 static void* gps_state_thread( void*  arg ) {
     GpsState*   state = (GpsState*) arg;
     NmeaReader  *reader;
-    int         epoll_fd   = epoll_create(2);
+    int         epoll_fd   = epoll_create(5);
     int         gps_fd     = state->fd;
-    int         control_fd = state->control[1];
+    int         cmd_fd     = state->cmd_event;
 
     reader = &state->reader;
+    nmea_dispatch_init();
     nmea_reader_init( reader );
 
     // register control file descriptors for polling
-    epoll_register( epoll_fd, control_fd );
+    epoll_register( epoll_fd, cmd_fd );
+    epoll_register( epoll_fd, state->session_timer );
+    epoll_register( epoll_fd, state->rpc_event );
+    if (state->predict_timer > -1)
+        epoll_register( epoll_fd, state->predict_timer );
+#if ENABLE_NMEA
+    if (state->publish_timer > -1)
+        epoll_register( epoll_fd, state->publish_timer );
+#endif
     if (gps_fd > -1) {
         epoll_register( epoll_fd, gps_fd );
     }
@@ -879,10 +2120,10 @@ static void* gps_state_thread( void*  arg ) {
 
     // now loop
     for (;;) {
-        struct epoll_event   events[2];
+        struct epoll_event   events[5];
         int                  ne, nevents;
 
-        nevents = epoll_wait( epoll_fd, events, gps_fd>-1 ? 2 : 1, -1 );
+        nevents = epoll_wait( epoll_fd, events, 5, -1 );
         if (nevents < 0) {
             if (errno != EINTR)
                 LOGE("epoll_wait() unexpected error: %s", strerror(errno));
@@ -891,74 +2132,96 @@ static void* gps_state_thread( void*  arg ) {
         //D("gps thread received %d events", nevents);
         for (ne = 0; ne < nevents; ne++) {
             if ((events[ne].events & (EPOLLERR|EPOLLHUP)) != 0) {
-                LOGE("EPOLLERR or EPOLLHUP after epoll_wait() !?");
-                goto Exit;
+                if (events[ne].data.fd == gps_fd && !(events[ne].events & EPOLLIN)) {
+                    // the writer of a replay FIFO/pty went away
+                    D("NMEA source closed");
+                    epoll_deregister( epoll_fd, gps_fd );
+                    gps_fd = -1;
+                    continue;
+                }
+                if (events[ne].data.fd != gps_fd) {
+                    LOGE("EPOLLERR or EPOLLHUP after epoll_wait() !?");
+                    goto Exit;
+                }
             }
             if ((events[ne].events & EPOLLIN) != 0) {
                 int  fd = events[ne].data.fd;
 
-                if (fd == control_fd) {
-                    char  cmd = 255;
-                    int   ret;
-                    //D("gps control fd event");
+                if (fd == cmd_fd) {
+                    uint64_t  count;
+                    int       ret;
+
                     do {
-                        ret = read( fd, &cmd, 1 );
+                        ret = read( fd, &count, sizeof(count) );
                     } while (ret < 0 && errno == EINTR);
-    
-                    if (cmd == CMD_QUIT) {
-                        D("gps thread quitting on demand");
-                        active = 0;
-                        pthread_cond_signal(&get_pos_ready_cond);
-                        pthread_cond_signal(&get_position_cond);
+
+                    if (!gps_state_run_commands( state ))
                         goto Exit;
-                    } else if (cmd == CMD_START) {
-                        if (!started) {
-                            D("gps thread starting  location_cb=%p", state->callbacks.location_cb);
-                            started = 1;
-                            pthread_cond_signal(&get_position_cond);
-#if ENABLE_NMEA
-                            state->init = STATE_START;
-                            if ( pthread_create( &state->tmr_thread, NULL, gps_timer_thread, state ) != 0 ) {
-                                LOGE("could not create gps_timer_thread: %s", strerror(errno));
-                                started = 0;
-                                state->init = STATE_INIT;
-                                goto Exit;
-                            }
-#endif
-                       }
-                    } else if (cmd == CMD_STOP) {
-                        if (started) {
-                            D("gps thread stopping");
-                            started = 0;
-                            pthread_cond_signal(&get_pos_ready_cond);
-#if ENABLE_NMEA
-                            void*  dummy;
-                            state->init = STATE_INIT;
-                            pthread_join(state->tmr_thread, &dummy);
-#endif
-                            exit_gps_rpc();
-                        }
-                    }
                 } else if (fd == gps_fd) {
-                    char  buf[512];
-                    int   nn, ret;
+                    char     buf[512];
+                    int      ret;
+                    int64_t  t0 = 0;
 #if DUMP_DATA
                     D("gps fd event");
 #endif
+                    if ((++reader->stats.reads & (LATENCY_SAMPLE - 1)) == 0)
+                        t0 = now_ns();
                     do {
                         ret = read( fd, buf, sizeof(buf) );
                     } while (ret < 0 && errno == EINTR);
+                    reader->read_ns = 0;
+                    if (t0) {
+                        reader->read_ns  = now_ns();
+                        reader->stamp_ns = reader->read_ns;
+                        latency_record( LATENCY_READ, reader->read_ns - t0 );
+                    }
 
-                    if (ret > 0) {
-                        for (nn = 0; nn < ret; nn++) {
-                            nmea_reader_addc( reader, buf[nn] );
-#if DUMP_DATA & 0
-                            D("%2d, nmea_reader_addc() is called", nn+1);
-#endif
-                        }
+                    if (ret > 0)
+                        nmea_reader_addbuf( reader, buf, ret );
+                    else if (ret == 0) {
+                        D("NMEA source closed");
+                        epoll_deregister( epoll_fd, gps_fd );
+                        gps_fd = -1;
                     }
 #if DUMP_DATA
                     D("gps fd event end");
+#endif
+                } else if (fd == state->session_timer || fd == state->rpc_event) {
+                    uint64_t  count;
+                    int       ret;
+
+                    do {
+                        ret = read( fd, &count, sizeof(count) );
+                    } while (ret < 0 && errno == EINTR);
+                    if (ret != sizeof(count) || !state->started)
+                        continue;
+
+                    if (fd == state->rpc_event)
+                        sched_end_session( state, 1 );
+                    else if (sched.running)
+                        sched_end_session( state, 0 );
+                    else
+                        sched_start_session( state );
+                } else if (fd == state->predict_timer) {
+                    uint64_t  count;
+                    int       ret;
+
+                    do {
+                        ret = read( fd, &count, sizeof(count) );
+                    } while (ret < 0 && errno == EINTR);
+                    if (ret == sizeof(count) && state->started)
+                        predict_tick( state );
+#if ENABLE_NMEA
+                } else if (fd == state->publish_timer) {
+                    uint64_t  count;
+                    int       ret;
+
+                    do {
+                        ret = read( fd, &count, sizeof(count) );
+                    } while (ret < 0 && errno == EINTR);
+                    state->publish_armed = 0;
+                    if (ret == sizeof(count) && state->started)
+                        gps_state_publish( state );
 #endif
                 } else {
                     LOGE("epoll_wait() returned unkown fd %d ?", fd);
@@ -967,76 +2230,14 @@ static void* gps_state_thread( void*  arg ) {
         }
     }
 Exit:
-    return NULL;
-}
-
-#if ENABLE_NMEA
-static void* gps_timer_thread( void*  arg ) {
-    D("%s() running", __FUNCTION__);
-    GpsState   *state = (GpsState*) arg;
-    NmeaReader *r = &(state->reader);
-    r->fix.flags = 0;
-    r->fix_flags_cached = 0;
-    r->sv_status_changed = 0;
-    r->sv_status.num_svs = 0;
-    memset( r->sv_status.sv_list, 0, sizeof(r->sv_status.sv_list) );
-
-    do {
-        GPS_STATE_LOCK_FIX(state);
-
-#if DUMP_DATA
-        D("r->fix.flags = 0x%x", r->fix.flags);
-#endif
-        if (r->fix.flags & GPS_LOCATION_HAS_LAT_LONG) {
-            if (r->fix_flags_cached > 0)
-                r->fix.flags |= r->fix_flags_cached;
-            r->fix_flags_cached = r->fix.flags;
-            update_gps_location( &r->fix );
-#if DUMP_DATA
-            D("r->fix.flags = 0x%x", r->fix.flags);
-#endif
-            r->fix.flags = 0;
-        }
-
-        if (r->sv_status_changed) {
-            update_gps_svstatus( &r->sv_status );
-            r->sv_status_changed = 0;
-        }
-
-        GPS_STATE_UNLOCK_FIX(state);
-
-        uint64_t microseconds = (state->fix_freq * 1000000) - 500000;
-        usleep(microseconds);
-        //D("%s() usleep(%ld)", __FUNCTION__, microseconds);
-
-    } while(state->init == STATE_START);
-
-    D("%s() destroyed", __FUNCTION__);
-    return NULL;
-}
-#endif
-
-void pdsm_pd_callback() {
-    pthread_cond_signal(&get_pos_ready_cond);
-}
-
-static void* gps_get_position_thread( void*  arg ) {
-    D("%s() running", __FUNCTION__);
-    GpsState*  s = _gps_state;
-    while(active)
-    {
-        while(started)
-        {
-            gps_get_position();
-            pthread_mutex_lock(&get_pos_ready_mutex);
-            pthread_cond_wait(&get_pos_ready_cond, &get_pos_ready_mutex);
-            pthread_mutex_unlock(&get_pos_ready_mutex);
-        }
-        pthread_mutex_lock(&get_position_mutex);
-        pthread_cond_wait(&get_position_cond, &get_position_mutex);
-        pthread_mutex_unlock(&get_position_mutex);
-    }
-    D("%s() destroyed", __FUNCTION__);
+    // nothing is handled anymore: wake up whoever waits for a command
+    pthread_mutex_lock(&state->cmd_lock);
+    state->cmd_closed = 1;
+    state->cmd_tail   = state->cmd_head;
+    pthread_cond_broadcast(&state->cmd_done);
+    pthread_mutex_unlock(&state->cmd_lock);
+
+    close( epoll_fd );
     return NULL;
 }
 
@@ -1044,27 +2245,51 @@ static void gps_state_init( GpsState*  state ) {
 
     update_gps_status(GPS_STATUS_ENGINE_ON);
 
-    state->init       = STATE_INIT;;
-    state->control[0] = -1;
-    state->control[1] = -1;
+    state->init       = STATE_INIT;
+    state->started    = 0;
+    state->cmd_event  = -1;
+    state->cmd_closed = 0;
+    state->cmd_head   = 0;
+    state->cmd_tail   = 0;
+    pthread_mutex_init(&state->cmd_lock, NULL);
+    pthread_cond_init(&state->cmd_done, NULL);
     state->fix_freq   = -1;
+    state->session_timer = -1;
+    state->rpc_event     = -1;
+    state->predict_timer = -1;
 #if ENABLE_NMEA
-    state->fd         = open("/dev/smd27", O_RDONLY);
+    state->publish_timer = -1;
+    state->publish_armed = 0;
+    const char*  nmea_device = getenv("LEO_GPS_NMEA_DEVICE");
+    if (nmea_device == NULL)
+        nmea_device = NMEA_DEVICE;
+    state->fd         = open(nmea_device, O_RDONLY | O_NOCTTY);
+    if (state->fd < 0)
+        LOGE("could not open %s: %s", nmea_device, strerror(errno));
 #else
     state->fd         = -1;
 #endif
 
-    active = 1;
-
-#if ENABLE_NMEA
-    if ( sem_init(&state->fix_sem, 0, 1) != 0 ) {
-        LOGE("gps semaphore initialization failed: %s", strerror(errno));
+    state->session_timer = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (state->session_timer < 0) {
+        LOGE("could not create session timerfd: %s", strerror(errno));
         goto Fail;
     }
+    state->rpc_event = eventfd(0, 0);
+    if (state->rpc_event < 0) {
+        LOGE("could not create RPC eventfd: %s", strerror(errno));
+        goto Fail;
+    }
+    // without it there are no predicted fixes
+    state->predict_timer = timerfd_create(CLOCK_MONOTONIC, 0);
+#if ENABLE_NMEA
+    // without it fixes are published as soon as they're parsed
+    state->publish_timer = timerfd_create(CLOCK_MONOTONIC, 0);
 #endif
 
-    if ( socketpair( AF_LOCAL, SOCK_STREAM, 0, state->control ) < 0 ) {
-        LOGE("could not create thread control socket pair: %s", strerror(errno));
+    state->cmd_event = eventfd(0, 0);
+    if (state->cmd_event < 0) {
+        LOGE("could not create command eventfd: %s", strerror(errno));
         goto Fail;
     }
 
@@ -1073,11 +2298,6 @@ static void gps_state_init( GpsState*  state ) {
         goto Fail;
     }
 
-    if ( pthread_create( &state->pos_thread, NULL, gps_get_position_thread, NULL ) != 0 ) {
-        LOGE("could not create gps_get_position_thread: %s", strerror(errno));
-        goto Fail;
-    }
-
     if(init_gps_rpc())
         goto Fail;
 
@@ -1107,6 +2327,24 @@ static int gps_xtra_init(GpsXtraCallbacks* callbacks) {
     return 0;
 }
 
+/* XTRA files are tens of KB; anything this big or this small isn't one */
+#define  XTRA_MAX_FILE_SIZE  (1024*1024)
+#define  XTRA_MIN_FILE_SIZE  1024
+
+/* what a failed download leaves behind: an error or captive portal page,
+ * or a file of one repeated byte (zeroed or erased storage) */
+static int xtra_data_valid( const unsigned char*  data, int  length ) {
+    int  n;
+
+    if (length < XTRA_MIN_FILE_SIZE)
+        return 0;
+    if (data[0] == '<' || !memcmp(data, "HTTP/", 5))
+        return 0;
+    for (n = 1; n < length && data[n] == data[0]; n++)
+        ;
+    return n < length;
+}
+
 static int gps_xtra_inject_xtra_data(char* data, int length) {
     D("%s() is called", __FUNCTION__);
     D("gps_xtra_inject_xtra_data: xtra size = %d, data ptr = 0x%x\n", length, (int) data);
@@ -1114,62 +2352,12 @@ static int gps_xtra_inject_xtra_data(char* data, int length) {
     if (!s->init)
         return 0;
 
-    int rpc_ret_val = -1;
-    int ret_val = -1;
-    unsigned char *xtra_data_ptr;
-    uint32_t  part_len;
-    uint8_t   part;
-    uint8_t   total_parts;
-    uint16_t  len_injected;
-
-    total_parts = (length / XTRA_BLOCK_SIZE);
-    if ((total_parts % XTRA_BLOCK_SIZE) != 0)
-    {
-        total_parts += 1;
+    if (length <= 0 || length > XTRA_MAX_FILE_SIZE || !xtra_data_valid((unsigned char*) data, length)) {
+        LOGE("%s: not XTRA data (%d bytes)", __FUNCTION__, length);
+        return EINVAL;
     }
 
-    uint8_t part_no = total_parts % 10;
-    if (part_no > 0)
-        part_no = total_parts - part_no;
-    else
-        part_no = total_parts - 5;
-
-    len_injected = 0; // O bytes injected
-    // XTRA injection starts with part 1
-    D("gps_xtra_inject_xtra_data: inject part = %d/%d, len = %d\n", 1, total_parts, XTRA_BLOCK_SIZE);
-    D("gps_xtra_inject_xtra_data: ......");
-    for (part = 1; part <= total_parts; part++)
-    {
-        part_len = XTRA_BLOCK_SIZE;
-        if (XTRA_BLOCK_SIZE > (length - len_injected))
-        {
-            part_len = length - len_injected;
-        }
-        xtra_data_ptr = data + len_injected;
-
-        if (part > part_no) // reduce the number of the xtra debugging info
-            D("gps_xtra_inject_xtra_data: inject part = %d/%d, len = %d\n", part, total_parts, part_len);
-
-        if (part < total_parts)
-        {
-            rpc_ret_val = gps_xtra_set_data(xtra_data_ptr, part_len, part, total_parts);
-            if (rpc_ret_val == -1)
-            {
-                D("gps_xtra_set_data() for xtra returned %d \n", rpc_ret_val);
-                ret_val = EINVAL; // return error
-                break;
-            }
-        }
-        else // part == total_parts
-        {
-            ret_val = gps_xtra_set_data(xtra_data_ptr, part_len, part, total_parts);
-            break; // done with injection
-        }
-
-        len_injected += part_len;
-    }
-
-    return ret_val;
+    return gps_xtra_inject((unsigned char*) data, length);
 }
 
 void xtra_download_request() {
@@ -1185,6 +2373,238 @@ static const GpsXtraInterface  sGpsXtraInterface = {
     gps_xtra_inject_xtra_data,
 };
 
+/* an XTRA file open on fd, read a part at a time into one block-sized
+ * buffer. the checks of xtra_data_valid() are made on the parts as they
+ * are read: the first mustn't start like an error page, and by the last,
+ * some byte must have differed from the first one and the file must still
+ * be as long as it was at fstat(). a part failing them isn't sent, which
+ * fails the injection as a part lost in transport does. */
+typedef struct {
+    int             fd;
+    uint32_t        length;
+    unsigned char*  buf;
+    uint32_t        size;
+    unsigned char   first;
+    int             varied;
+} XtraFile;
+
+static const unsigned char* xtra_file_part( void*  ctx, uint32_t  offset, uint32_t  len ) {
+    XtraFile*  f = ctx;
+    uint32_t   done, n;
+    ssize_t    ret;
+    char       past;
+
+    if (len > f->size) {
+        unsigned char*  buf = realloc(f->buf, len);
+        if (buf == NULL)
+            return NULL;
+        f->buf  = buf;
+        f->size = len;
+    }
+    for (done = 0; done < len; done += ret) {
+        ret = pread(f->fd, f->buf + done, len - done, offset + done);
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0) {
+            LOGE("%s: read failed at %u: %s", __FUNCTION__, offset + done,
+                 ret < 0 ? strerror(errno) : "file shrank");
+            return NULL;
+        }
+    }
+
+    if (offset == 0) {
+        if (f->buf[0] == '<' || !memcmp(f->buf, "HTTP/", 5)) {
+            LOGE("%s: not an XTRA file", __FUNCTION__);
+            return NULL;
+        }
+        f->first = f->buf[0];
+    }
+    for (n = 0; !f->varied && n < len; n++)
+        f->varied = f->buf[n] != f->first;
+
+    if (offset + len == f->length) {
+        if (!f->varied) {
+            LOGE("%s: not an XTRA file (one repeated byte)", __FUNCTION__);
+            return NULL;
+        }
+        do {
+            ret = pread(f->fd, &past, 1, f->length);
+        } while (ret < 0 && errno == EINTR);
+        if (ret != 0) {
+            LOGE("%s: file grew past %u bytes", __FUNCTION__, f->length);
+            return NULL;
+        }
+    }
+    return f->buf;
+}
+
+static int gps_xtra_inject_xtra_fd(int fd) {
+    GpsState*  s = _gps_state;
+    struct stat  st;
+    XtraFile  file;
+    int  ret;
+
+    D("%s(%d) is called", __FUNCTION__, fd);
+    if (!s->init)
+        return 0;
+
+    if (fstat(fd, &st) < 0) {
+        LOGE("%s: fstat failed: %s", __FUNCTION__, strerror(errno));
+        return EINVAL;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size < XTRA_MIN_FILE_SIZE || st.st_size > XTRA_MAX_FILE_SIZE) {
+        LOGE("%s: not an XTRA file (mode 0%o, %lld bytes)", __FUNCTION__,
+             st.st_mode, (long long)st.st_size);
+        return EINVAL;
+    }
+
+    /* the file is read rather than mapped: a mapping faults with SIGBUS
+     * if the downloader truncates the file under us */
+    memset(&file, 0, sizeof(file));
+    file.fd     = fd;
+    file.length = st.st_size;
+    ret = gps_xtra_inject_parts(xtra_file_part, &file, file.length);
+
+    free(file.buf);
+    return ret;
+}
+
+static int gps_xtra_inject_xtra_file(const char* path) {
+    int  fd, ret;
+
+    D("%s('%s') is called", __FUNCTION__, path);
+    do {
+        fd = open(path, O_RDONLY);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        LOGE("%s: could not open '%s': %s", __FUNCTION__, path, strerror(errno));
+        return EINVAL;
+    }
+
+    ret = gps_xtra_inject_xtra_fd(fd);
+    close(fd);
+    return ret;
+}
+
+static const GpsXtraFileInterface  sGpsXtraFileInterface = {
+    gps_xtra_inject_xtra_file,
+    gps_xtra_inject_xtra_fd,
+};
+
+/***** GpsDebugInterface *****/
+
+/* snprintf() into [p, end), never moving p past the last byte */
+static char* debug_printf(char* p, char* end, const char* fmt, ...) {
+    va_list  args;
+    int      len;
+
+    if (p >= end - 1)
+        return p;
+
+    va_start(args, fmt);
+    len = vsnprintf(p, end - p, fmt, args);
+    va_end(args);
+
+    if (len < 0)
+        return p;
+    if (len >= end - p)
+        return end - 1;
+    return p + len;
+}
+
+static size_t gps_debug_get_internal_state(char* buffer, size_t bufferSize) {
+    D("%s() is called", __FUNCTION__);
+    GpsState*  s = _gps_state;
+    NmeaStats  stats = s->reader.stats;
+    char*      p   = buffer;
+    char*      end = buffer + bufferSize;
+    unsigned   n;
+
+    if (bufferSize == 0)
+        return 0;
+    buffer[0] = 0;
+
+    p = debug_printf(p, end, "nmea: reads=%u sentences=%u bad_checksum=%u no_checksum=%u overflows=%u unknown=%u\n",
+                     stats.reads, stats.sentences, stats.bad_checksum, stats.no_checksum, stats.overflows, stats.unknown);
+    for (n = 0; n < sizeof(nmea_sentences)/sizeof(nmea_sentences[0]); n++) {
+        uint32_t  id = nmea_sentences[n].id;
+        p = debug_printf(p, end, "nmea: %c%c%c=%u parse_ns_avg=%u\n",
+                         (id >> 16) & 0xff, (id >> 8) & 0xff, id & 0xff, stats.parsed[n],
+                         stats.parse_samples[n] ? stats.parse_ns[n] / stats.parse_samples[n] : 0);
+    }
+    for (n = 0; n < LATENCY_STAGES; n++) {
+        LatencyHistogram  h = latency[n];
+        int               b;
+
+        p = debug_printf(p, end, "latency: %s samples=%u avg_us=%.1f", latency_names[n],
+                         h.samples, h.samples ? (double)h.total_us / h.samples : 0.0);
+        for (b = 0; b < LATENCY_BUCKETS; b++) {
+            if (h.buckets[b] == 0)
+                continue;
+            if (b < LATENCY_BUCKETS - 1)
+                p = debug_printf(p, end, " <%dus:%u", 1 << b, h.buckets[b]);
+            else
+                p = debug_printf(p, end, " >=%dus:%u", 1 << (b - 1), h.buckets[b]);
+        }
+        p = debug_printf(p, end, "\n");
+    }
+    p = debug_printf(p, end, "callbacks: location=%u sv_status=%u sv_status_coalesced=%u nmea=%u\n",
+                     s->location_cbs, s->sv_status_cbs, s->sv_status_coalesced, s->nmea_cbs);
+    p = debug_printf(p, end, "commands: handled=%u wakeups=%u dropped=%u latency_us_avg=%lld latency_us_max=%lld\n",
+                     s->cmd_handled, s->cmd_wakeups, s->cmd_dropped,
+                     s->cmd_handled ? s->cmd_latency_us_total / s->cmd_handled : 0LL,
+                     s->cmd_latency_us_max);
+    p = debug_printf(p, end, "sched: sessions=%u timeouts=%u ttf_mean_ms=%lld ttf_dev_ms=%lld\n",
+                     sched.sessions, sched.timeouts, sched.ttf_mean_ms, sched.ttf_dev_ms);
+    p = debug_printf(p, end, "sched: lateness_ms");
+    for (n = 0; n < SCHED_BUCKETS; n++) {
+        if (n < SCHED_BUCKETS - 1)
+            p = debug_printf(p, end, " <%d:%u", sched_bucket_ms[n], sched.lateness[n]);
+        else
+            p = debug_printf(p, end, " >=%d:%u", sched_bucket_ms[n - 1], sched.lateness[n]);
+    }
+    p = debug_printf(p, end, "\n");
+    pthread_mutex_lock(&predict.lock);
+    p = debug_printf(p, end, "predict: rate=%d period_ms=%d predicted=%u checked=%u error_m_avg=%.1f error_m_max=%.1f\n",
+                     get_prediction_rate(), predict_period_ms(_gps_state, get_prediction_rate()),
+                     predict.predicted, predict.checked,
+                     predict.checked ? predict.error_m_total / predict.checked : 0.0,
+                     predict.error_m_max);
+    p = debug_printf(p, end, "predict: error_m");
+    for (n = 0; n < PREDICT_BUCKETS; n++) {
+        if (n < PREDICT_BUCKETS - 1)
+            p = debug_printf(p, end, " <%d:%u", predict_bucket_m[n], predict.error[n]);
+        else
+            p = debug_printf(p, end, " >=%d:%u", predict_bucket_m[n - 1], predict.error[n]);
+    }
+    pthread_mutex_unlock(&predict.lock);
+    p = debug_printf(p, end, "\n");
+    p += gps_filter_get_internal_state(p, end - p);
+    p += gps_rpc_get_internal_state(p, end - p);
+    return p - buffer;
+}
+
+static const GpsDebugInterface  sGpsDebugInterface = {
+    gps_debug_get_internal_state,
+};
+
+/***** GpsExtSvInterface *****/
+
+static int gps_ext_sv_init(GpsExtSvCallbacks* callbacks) {
+    D("%s() is called", __FUNCTION__);
+    GpsState*  s = _gps_state;
+
+    s->ext_sv_callbacks = *callbacks;
+
+    return 0;
+}
+
+static const GpsExtSvInterface  sGpsExtSvInterface = {
+    gps_ext_sv_init,
+};
+
 /***** AGpsInterface *****/
 
 static void agps_init(AGpsCallbacks* callbacks) {
@@ -1236,6 +2656,8 @@ static int gps_init(GpsCallbacks* callbacks) {
 
     if (!s->init)
         gps_state_init(s);
+    if (!s->init)
+        return -1;
 
     s->callbacks = *callbacks;
 
@@ -1278,7 +2700,7 @@ static int gps_stop() {
         return -1;
     }
 
-    gps_state_stop(s);
+    gps_state_stop(s, 1);
     return 0;
 }
 
@@ -1314,15 +2736,15 @@ static int gps_set_position_mode(GpsPositionMode mode, int fix_frequency) {
     if (!s->init)
         return 0;
 
+    __atomic_store_n(&s->single_shot, fix_frequency == 0, __ATOMIC_RELAXED);
     if (fix_frequency == 0) {
-        //We don't handle single shot requests atm...
-        //So one every 1 seconds will it be.
+        // single shot: sessions run at 1 Hz until the first good fix
         fix_frequency = 1;
     } else if (fix_frequency > 1800) { //30mins
         fix_frequency = 1800;
     }
     // fix_frequency is only used by NMEA version
-    s->fix_freq = fix_frequency;
+    __atomic_store_n(&s->fix_freq, fix_frequency, __ATOMIC_RELAXED);
     return 0;
 }
 
@@ -1330,8 +2752,14 @@ static const void* gps_get_extension(const char* name) {
     D("%s('%s') is called", __FUNCTION__, name);
     if (!strcmp(name, GPS_XTRA_INTERFACE)) {
         return &sGpsXtraInterface;
+    } else if (!strcmp(name, GPS_XTRA_FILE_INTERFACE)) {
+        return &sGpsXtraFileInterface;
     } else if (!strcmp(name, AGPS_INTERFACE)) {
         return &sAGpsInterface;
+    } else if (!strcmp(name, GPS_DEBUG_INTERFACE)) {
+        return &sGpsDebugInterface;
+    } else if (!strcmp(name, GPS_EXT_SV_INTERFACE)) {
+        return &sGpsExtSvInterface;
     }
     return NULL;
 }
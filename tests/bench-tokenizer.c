@@ -0,0 +1,238 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/bench-tokenizer.c
+ *
+ * Compares the lazy NMEA tokenizer with the eager one it replaced, over
+ * the sentences of a NMEA log. Each sentence is first run through its
+ * real handler, to find how many fields the parser actually reads; then
+ * both tokenizers are timed doing just that: the eager one splitting the
+ * whole sentence, the lazy one scanning up to the last field read.
+ *
+ * usage: bench-tokenizer [-n rounds] log.nmea
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "host-stubs.h"
+#include "leo-gps.c"
+
+/* the tokenizer before it was made lazy */
+static int
+eager_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end )
+{
+    int    count = 0;
+
+    // the initial '$' is optional
+    if (p < end && p[0] == '$')
+        p += 1;
+
+    // remove trailing newline
+    if (end > p && end[-1] == '\n') {
+        end -= 1;
+        if (end > p && end[-1] == '\r')
+            end -= 1;
+    }
+
+    // get rid of checksum at the end of the sentecne
+    if (end >= p+3 && end[-3] == '*') {
+        end -= 3;
+    }
+
+    while (p < end) {
+        const char*  q = p;
+
+        q = memchr(p, ',', end-p);
+        if (q == NULL)
+            q = end;
+
+         if (count < MAX_NMEA_TOKENS) {
+             t->tokens[count].p   = p;
+             t->tokens[count].end = q;
+             count += 1;
+         }
+        if (q < end)
+            q += 1;
+
+        p = q;
+    }
+
+    t->count = count;
+    return count;
+}
+
+static Token
+eager_tokenizer_get( NmeaTokenizer*  t, int  index )
+{
+    Token  tok;
+    static const char*  dummy = "";
+
+    if (index < 0 || index >= t->count) {
+        tok.p = tok.end = dummy;
+    } else
+        tok = t->tokens[index];
+
+    return tok;
+}
+
+typedef struct {
+    const char*  p;
+    int          len;
+    int          fields;   // fields the parser reads
+    int          type;     // index in nmea_sentences[], or -1
+} Sentence;
+
+#define  TYPES  (int)(sizeof(nmea_sentences) / sizeof(nmea_sentences[0]))
+
+static Sentence*  sentences;
+static int        count;
+
+static void load( const char*  path ) {
+    static char  buf[ 64 << 20 ];
+    FILE*        f = fopen(path, "rb");
+    const char*  p;
+    const char*  end;
+    int          len, max;
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    for (p = buf, max = 0; p < buf + len; p++)
+        max += (*p == '\n');
+    sentences = calloc(max + 1, sizeof(*sentences));
+
+    nmea_dispatch_init();
+    nmea_reader_init( &_gps_state->reader );
+    _gps_state->publish_timer = -1;
+    _gps_state->predict_timer = -1;
+
+    for (p = buf, end = buf + len; p < end; ) {
+        const char*  eol = memchr(p, '\n', end - p);
+        Sentence*    s   = &sentences[count];
+        NmeaTokenizer  tzer[1];
+        Token          tok;
+
+        eol = eol ? eol + 1 : end;
+        s->p    = p;
+        s->len  = eol - p;
+        s->type = -1;
+        p = eol;
+
+        nmea_tokenizer_init(tzer, s->p, s->p + s->len);
+        tok = nmea_tokenizer_get(tzer, 0);
+        if (tok.p + 5 <= tok.end) {
+            const NmeaDispatch*  entry = nmea_dispatch_find( NMEA_ID(tok.p[2], tok.p[3], tok.p[4]) );
+            if (entry) {
+                entry->handler( &_gps_state->reader, tzer, NMEA_TALKER(tok.p[0], tok.p[1]) );
+                s->type = entry->index;
+            }
+        }
+        s->fields = tzer->count;
+        count += 1;
+    }
+}
+
+static int64_t run_eager( int  type, int*  n ) {
+    NmeaTokenizer    tzer[1];
+    volatile size_t  sink = 0;
+    int64_t          t0 = now_ns();
+    int              k;
+
+    *n = 0;
+    for (k = 0; k < count; k++) {
+        const Sentence*  s = &sentences[k];
+        if (s->type != type)
+            continue;
+        eager_tokenizer_init(tzer, s->p, s->p + s->len);
+        sink += eager_tokenizer_get(tzer, s->fields - 1).end - s->p;
+        *n += 1;
+    }
+    return now_ns() - t0;
+}
+
+static int64_t run_lazy( int  type, int*  n ) {
+    NmeaTokenizer    tzer[1];
+    volatile size_t  sink = 0;
+    int64_t          t0 = now_ns();
+    int              k;
+
+    *n = 0;
+    for (k = 0; k < count; k++) {
+        const Sentence*  s = &sentences[k];
+        if (s->type != type)
+            continue;
+        nmea_tokenizer_init(tzer, s->p, s->p + s->len);
+        sink += nmea_tokenizer_get(tzer, s->fields - 1).end - s->p;
+        *n += 1;
+    }
+    return now_ns() - t0;
+}
+
+int main( int  argc, char**  argv ) {
+    int      rounds = 20;
+    int64_t  eager_total = 0, lazy_total = 0;
+    int      total = 0;
+    int      c, type;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        if (c == 'n')
+            rounds = atoi(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-n rounds] log.nmea\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || rounds < 1) {
+        fprintf(stderr, "%s: no NMEA log given\n", argv[0]);
+        return 1;
+    }
+    load( argv[optind] );
+
+    for (type = -1; type < TYPES; type++) {
+        int64_t  eager = INT64_MAX, lazy = INT64_MAX;
+        int      n = 0, fields = 0, tokens = 0, k, r;
+
+        for (k = 0; k < count; k++) {
+            if (sentences[k].type == type) {
+                NmeaTokenizer  tzer[1];
+                fields += sentences[k].fields;
+                tokens += eager_tokenizer_init(tzer, sentences[k].p, sentences[k].p + sentences[k].len);
+            }
+        }
+        for (r = 0; r < rounds; r++) {
+            int64_t  t = run_eager(type, &n);
+            if (t < eager)
+                eager = t;
+            t = run_lazy(type, &n);
+            if (t < lazy)
+                lazy = t;
+        }
+        if (n == 0)
+            continue;
+        if (type < 0)
+            printf("type: other");
+        else
+            printf("type: %c%c%c", (nmea_sentences[type].id >> 16) & 0xff,
+                   (nmea_sentences[type].id >> 8) & 0xff, nmea_sentences[type].id & 0xff);
+        printf(" sentences=%d fields=%.1f/%.1f eager_ns=%.1f lazy_ns=%.1f\n", n,
+               (double)fields / n, (double)tokens / n, (double)eager / n, (double)lazy / n);
+        eager_total += eager;
+        lazy_total  += lazy;
+        total       += n;
+    }
+    printf("tokenizer: sentences=%d eager_ns=%.1f lazy_ns=%.1f saved=%.0f%%\n", total,
+           (double)eager_total / total, (double)lazy_total / total,
+           100.0 * (eager_total - lazy_total) / eager_total);
+    return 0;
+}
@@ -0,0 +1,160 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/bench-xtra.c
+ *
+ * Injects the same XTRA data through the XTRA interface, from memory, and
+ * through the XTRA file interface, from a file, into the loopback router
+ * of fake-router.c, and reports for each how many bytes were copied on
+ * the way: read from the file, and encoded into the RPC messages, and the
+ * largest buffer the HAL allocated for it. Each
+ * part is a round-trip of -l us; -b makes the modem refuse parts longer
+ * than that many bytes, for the block size probing to settle on.
+ *
+ * usage: bench-xtra [-n rounds] [-s bytes] [-l latency_us] [-b max_block]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+/* what the file path reads */
+static uint64_t  file_read;
+
+static ssize_t bench_pread( int  fd, void*  buf, size_t  count, off_t  offset ) {
+    ssize_t  n = pread(fd, buf, count, offset);
+    if (n > 0)
+        file_read += n;
+    return n;
+}
+
+/* the largest buffer the XTRA file path allocated */
+static size_t  alloc_max;
+
+static void* bench_realloc( void*  ptr, size_t  size ) {
+    if (size > alloc_max)
+        alloc_max = size;
+    return realloc(ptr, size);
+}
+
+#define  pread    bench_pread
+#define  realloc  bench_realloc
+#include "fake-router.h"
+#include "leo-gps.c"
+#undef   pread
+#undef   realloc
+
+static uint32_t  max_block = 0xffffffff;
+
+/* refuses parts longer than max_block, as a modem with a smaller buffer */
+static enum clnt_stat bench_modem( const FakeCall*  call, uint32_t*  result ) {
+    if (call->proc == FAKE_PROC_XTRA_SET_DATA && ntohl(call->args[3]) > max_block) {
+        *result = 0;
+        return RPC_SYSTEMERROR;
+    }
+    return fake_router_modem(call, result);
+}
+
+static int64_t bench_now_ns( void ) {
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report( const char*  path, int  rounds, int  size, int  failed, int64_t  ns ) {
+    FakeRouterStats  stats;
+    double           copied;
+
+    fake_router_stats_get(&stats);
+    copied = (double)(stats.payload_copied + file_read) / rounds;
+    printf("xtra %s: bytes=%d parts=%.1f file_read=%.0f encoded=%.0f copies_per_byte=%.2f "
+           "alloc_max=%u message_bytes=%.0f us=%.0f failed=%d\n", path, size,
+           (double)stats.calls[FAKE_PROC_XTRA_SET_DATA] / rounds,
+           (double)file_read / rounds, (double)stats.payload_copied / rounds, copied / size,
+           (unsigned)alloc_max, (double)stats.message_bytes / rounds, ns / 1e3 / rounds, failed);
+}
+
+int main( int  argc, char**  argv ) {
+    const GpsInterface*          gps;
+    const GpsXtraInterface*      xtra;
+    const GpsXtraFileInterface*  xtra_file;
+    GpsCallbacks                 callbacks = { NULL, NULL, NULL, NULL };
+    GpsXtraCallbacks             xtra_callbacks = { NULL };
+    FakeRouterConf               conf = { 100000, 0, bench_modem };
+    char                         path[] = "/tmp/bench-xtra.XXXXXX";
+    char*                        data;
+    int                          rounds = 20, size = 50000, c, n, fd, failed;
+    int64_t                      start;
+
+    while ((c = getopt(argc, argv, "n:s:l:b:")) != -1) {
+        switch (c) {
+        case 'n': rounds = atoi(optarg); break;
+        case 's': size = atoi(optarg); break;
+        case 'l': conf.latency_ns = atoll(optarg) * 1000; break;
+        case 'b': max_block = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n rounds] [-s bytes] [-l latency_us] [-b max_block]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (rounds <= 0 || size < XTRA_MIN_FILE_SIZE || size > XTRA_MAX_FILE_SIZE) {
+        fprintf(stderr, "%s: bad rounds or size\n", argv[0]);
+        return 1;
+    }
+
+    // something that passes for XTRA data
+    data = malloc(size);
+    for (n = 0; n < size; n++)
+        data[n] = (char)(n * 7 + n / 251 + 1);
+    fd = mkstemp(path);
+    if (fd < 0 || write(fd, data, size) != size) {
+        fprintf(stderr, "%s: could not write %s\n", argv[0], path);
+        return 1;
+    }
+
+    setenv("LEO_GPS_NMEA_DEVICE", "/nonexistent", 1);
+    fake_router_configure(&conf);
+    gps = gps_get_hardware_interface();
+    if (gps->init(&callbacks)) {
+        fprintf(stderr, "%s: gps_init() failed\n", argv[0]);
+        return 1;
+    }
+    xtra      = gps->get_extension(GPS_XTRA_INTERFACE);
+    xtra_file = gps->get_extension(GPS_XTRA_FILE_INTERFACE);
+    xtra->init(&xtra_callbacks);
+
+    // once, for the block size to settle
+    xtra->inject_xtra_data(data, size);
+
+    fake_router_stats_reset();
+    file_read = 0;
+    alloc_max = 0;
+    failed = 0;
+    start = bench_now_ns();
+    for (n = 0; n < rounds; n++)
+        failed += xtra->inject_xtra_data(data, size) != 0;
+    report("memory", rounds, size, failed, bench_now_ns() - start);
+
+    fake_router_stats_reset();
+    file_read = 0;
+    alloc_max = 0;
+    failed = 0;
+    start = bench_now_ns();
+    for (n = 0; n < rounds; n++)
+        failed += xtra_file->inject_xtra_fd(fd) != 0;
+    report("fd", rounds, size, failed, bench_now_ns() - start);
+
+    gps->cleanup();
+    close(fd);
+    unlink(path);
+    free(data);
+    return 0;
+}
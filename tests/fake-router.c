@@ -0,0 +1,666 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/fake-router.c
+ *
+ * See fake-router.h. Messages are laid out as librpc's: a call is the
+ * xid, 0 (CALL), the RPC version, program, version and procedure, empty
+ * credentials and verifier, then the XDR encoded arguments, ten words in.
+ * A reply is the xid, the call status and the XDR encoded result.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "fake-router.h"
+
+#define  FAKE_MAX_CLIENTS   256     // slots aren't reused
+#define  FAKE_MAX_PENDING   256
+#define  FAKE_MAX_SERVERS   8
+#define  FAKE_MAX_MESSAGE   65536
+#define  FAKE_EVENT_WORDS   128
+#define  FAKE_CALL_WORDS    10      // before the arguments
+
+/* the PD event that ends a session, as dispatch_pdsm_pd() reads it */
+#define  FAKE_PROG_PDSM_CB      0x3100005b
+#define  FAKE_PROC_PD_EVENT     1
+#define  FAKE_PD_EVENT_DONE     0x8
+
+FakeRouterStats  fake_router_stats;
+
+struct CLIENT {
+    int              fd;
+    int              index;
+    uint32_t         prog;
+    uint32_t         vers;
+    uint32_t         xid;
+    pthread_mutex_t  lock;      // one call at a time, as on a librpc CLIENT
+    unsigned char    buf[ FAKE_MAX_MESSAGE ];
+};
+
+/* what the HAL's dispatch() takes for a registered server: the XDR of
+ * the message comes first */
+typedef struct {
+    XDR*      xdr;
+    uint32_t  prog;
+    uint32_t  vers;
+} FakeServer;
+
+typedef struct {
+    int64_t   due;
+    int       client;
+    uint32_t  xid;
+    uint32_t  stat;
+    uint32_t  result;
+} FakeReply;
+
+typedef struct {
+    int64_t   due;
+    uint32_t  prog;
+    uint32_t  proc;
+    int       words;
+    uint32_t  args[ FAKE_EVENT_WORDS ];
+} FakeEvent;
+
+static struct {
+    pthread_mutex_t  lock;
+    pthread_cond_t   idle;
+    pthread_once_t   once;
+    pthread_t        thread;
+    int              wake[2];
+    int              fds[ FAKE_MAX_CLIENTS ];   // router ends, -1 once closed
+    int              clients;
+    FakeRouterConf   conf;
+    FakeReply        replies[ FAKE_MAX_PENDING ];
+    int              num_replies;
+    FakeEvent        events[ FAKE_MAX_PENDING ];
+    int              num_events;
+
+    pthread_mutex_t  dispatch_lock;             // held across a dispatch
+    struct {
+        uint32_t         prog;
+        uint32_t         vers;
+        __dispatch_fn_t  dispatch;
+    } servers[ FAKE_MAX_SERVERS ];
+    int              num_servers;
+} router = {
+    .lock          = PTHREAD_MUTEX_INITIALIZER,
+    .idle          = PTHREAD_COND_INITIALIZER,
+    .once          = PTHREAD_ONCE_INIT,
+    .dispatch_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int64_t fake_now_ns( void ) {
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fake_wake( void ) {
+    char  c = 0;
+    while (write(router.wake[1], &c, 1) < 0 && errno == EINTR)
+        ;
+}
+
+/*****       X D R                                           *****/
+
+static bool_t xdr_put( XDR*  xdrs, const void*  p, u_int  len ) {
+    u_int  padded = (len + 3) & ~3u;
+
+    if (xdrs->out_len + (int)padded > xdrs->out_size)
+        return 0;
+    memcpy(xdrs->out_msg + xdrs->out_len, p, len);
+    memset(xdrs->out_msg + xdrs->out_len + len, 0, padded - len);
+    xdrs->out_len += padded;
+    return 1;
+}
+
+static bool_t xdr_get( XDR*  xdrs, void*  p, u_int  len ) {
+    u_int  padded = (len + 3) & ~3u;
+
+    if (xdrs->in_pos + (int)padded > xdrs->in_len)
+        return 0;
+    memcpy(p, (unsigned char*)xdrs->in_msg + xdrs->in_pos, len);
+    xdrs->in_pos += padded;
+    return 1;
+}
+
+static bool_t xdr_word( XDR*  xdrs, uint32_t*  v ) {
+    uint32_t  w;
+
+    if (xdrs->x_op == XDR_ENCODE) {
+        w = htonl(*v);
+        return xdr_put(xdrs, &w, 4);
+    }
+    if (xdrs->x_op == XDR_DECODE) {
+        if (!xdr_get(xdrs, &w, 4))
+            return 0;
+        *v = ntohl(w);
+    }
+    return 1;
+}
+
+bool_t xdr_u_long( XDR*  xdrs, void*  v ) {
+    return xdr_word(xdrs, (uint32_t*)v);
+}
+
+bool_t xdr_int( XDR*  xdrs, void*  v ) {
+    return xdr_word(xdrs, (uint32_t*)v);
+}
+
+bool_t xdr_u_char( XDR*  xdrs, void*  v ) {
+    uint32_t  w = *(unsigned char*)v;
+
+    if (!xdr_word(xdrs, &w))
+        return 0;
+    *(unsigned char*)v = (unsigned char)w;
+    return 1;
+}
+
+bool_t xdr_u_short( XDR*  xdrs, void*  v ) {
+    uint32_t  w = *(uint16_t*)v;
+
+    if (!xdr_word(xdrs, &w))
+        return 0;
+    *(uint16_t*)v = (uint16_t)w;
+    return 1;
+}
+
+bool_t xdr_u_quad_t( XDR*  xdrs, void*  v ) {
+    uint64_t  q  = *(uint64_t*)v;
+    uint32_t  hi = (uint32_t)(q >> 32), lo = (uint32_t)q;
+
+    if (!xdr_word(xdrs, &hi) || !xdr_word(xdrs, &lo))
+        return 0;
+    *(uint64_t*)v = ((uint64_t)hi << 32) | lo;
+    return 1;
+}
+
+bool_t xdr_opaque( XDR*  xdrs, caddr_t  p, u_int  len ) {
+    if (xdrs->x_op == XDR_ENCODE) {
+        if (!xdr_put(xdrs, p, len))
+            return 0;
+        pthread_mutex_lock(&router.lock);
+        fake_router_stats.payload_copied += len;
+        pthread_mutex_unlock(&router.lock);
+        return 1;
+    }
+    if (xdrs->x_op == XDR_DECODE)
+        return xdr_get(xdrs, p, len);
+    return 1;
+}
+
+bool_t xdr_bytes( XDR*  xdrs, char**  p, u_int*  len, u_int  max ) {
+    uint32_t  n = *len;
+
+    if (!xdr_word(xdrs, &n) || n > max)
+        return 0;
+    *len = n;
+    return xdr_opaque(xdrs, *p, n);
+}
+
+bool_t xdr_pointer( XDR*  xdrs, char**  p, u_int  size, xdrproc_t  proc ) {
+    uint32_t  present = *p != NULL;
+
+    (void)size;
+    if (!xdr_word(xdrs, &present))
+        return 0;
+    return !present || proc(xdrs, *p);
+}
+
+bool_t xdr_recv_uint32( XDR*  xdrs, uint32_t*  v ) {
+    return xdr_word(xdrs, v);
+}
+
+/*****       R O U T E R                                     *****/
+
+enum clnt_stat fake_router_modem( const FakeCall*  call, uint32_t*  result ) {
+    static const uint32_t  done[3] = { 0, 0, FAKE_PD_EVENT_DONE };
+    int64_t                delay;
+
+    *result = 0;
+    switch (call->proc) {
+    case FAKE_PROC_CLIENT_INIT:
+        // the client id handed out for a client type
+        *result = 0x100 + (call->words > 0 ? ntohl(call->args[0]) : 0);
+        break;
+    case FAKE_PROC_GET_POSITION:
+        pthread_mutex_lock(&router.lock);
+        delay = router.conf.latency_ns + router.conf.session_ns;
+        pthread_mutex_unlock(&router.lock);
+        fake_router_event(FAKE_PROG_PDSM_CB, FAKE_PROC_PD_EVENT, done, 3, delay);
+        break;
+    }
+    return RPC_SUCCESS;
+}
+
+/* a request came in on client i */
+static void router_call( int  i, const uint32_t*  msg, int  len ) {
+    FakeModem       modem;
+    FakeCall        call;
+    FakeReply*      reply;
+    uint32_t        result = 0;
+    enum clnt_stat  stat;
+
+    if (len < FAKE_CALL_WORDS * 4)
+        return;
+    call.prog   = ntohl(msg[3]);
+    call.vers   = ntohl(msg[4]);
+    call.proc   = ntohl(msg[5]);
+    call.args   = msg + FAKE_CALL_WORDS;
+    call.words  = len / 4 - FAKE_CALL_WORDS;
+    call.client = i;
+    pthread_mutex_lock(&router.lock);
+    modem = router.conf.modem ? router.conf.modem : fake_router_modem;
+    pthread_mutex_unlock(&router.lock);
+    stat = modem(&call, &result);
+
+    pthread_mutex_lock(&router.lock);
+    if (call.proc < FAKE_MAX_PROCS)
+        fake_router_stats.calls[call.proc] += 1;
+    if (stat != RPC_SUCCESS)
+        fake_router_stats.failed += 1;
+    if (router.num_replies < FAKE_MAX_PENDING) {
+        reply = &router.replies[router.num_replies++];
+        reply->due    = fake_now_ns() + router.conf.latency_ns;
+        reply->client = i;
+        reply->xid    = msg[0];
+        reply->stat   = stat;
+        reply->result = result;
+        fake_router_stats.in_flight += 1;
+        if (fake_router_stats.in_flight > fake_router_stats.max_in_flight)
+            fake_router_stats.max_in_flight = fake_router_stats.in_flight;
+    }
+    pthread_mutex_unlock(&router.lock);
+}
+
+static void router_dispatch( const FakeEvent*  ev ) {
+    uint32_t         msg[ FAKE_CALL_WORDS + FAKE_EVENT_WORDS ];
+    XDR              xdr;
+    FakeServer       server;
+    __dispatch_fn_t  dispatch = NULL;
+    int              n;
+
+    memset(msg, 0, sizeof(msg));
+    msg[2] = htonl(2);
+    msg[3] = htonl(ev->prog);
+    msg[5] = htonl(ev->proc);
+    for (n = 0; n < ev->words; n++)
+        msg[FAKE_CALL_WORDS + n] = htonl(ev->args[n]);
+
+    memset(&xdr, 0, sizeof(xdr));
+    xdr.x_op   = XDR_DECODE;
+    xdr.in_msg = msg;
+    xdr.in_len = (FAKE_CALL_WORDS + ev->words) * 4;
+
+    pthread_mutex_lock(&router.dispatch_lock);
+    for (n = 0; n < router.num_servers; n++) {
+        if (router.servers[n].prog == ev->prog) {
+            dispatch     = router.servers[n].dispatch;
+            server.xdr   = &xdr;
+            server.prog  = router.servers[n].prog;
+            server.vers  = router.servers[n].vers;
+            break;
+        }
+    }
+    if (dispatch)
+        dispatch(NULL, (SVCXPRT*)&server);
+    pthread_mutex_unlock(&router.dispatch_lock);
+
+    if (dispatch) {
+        pthread_mutex_lock(&router.lock);
+        fake_router_stats.events += 1;
+        pthread_mutex_unlock(&router.lock);
+    }
+}
+
+static void* router_thread( void*  arg ) {
+    static uint32_t  msg[ FAKE_MAX_MESSAGE / 4 ];
+    struct pollfd    pfds[ FAKE_MAX_CLIENTS + 1 ];
+    int              index[ FAKE_MAX_CLIENTS + 1 ];
+
+    (void)arg;
+    for (;;) {
+        struct timespec   ts, *tsp = NULL;
+        int64_t           next = INT64_MAX, now;
+        int               n, i, count = 1;
+
+        pthread_mutex_lock(&router.lock);
+        for (i = 0; i < router.num_replies; i++)
+            if (router.replies[i].due < next)
+                next = router.replies[i].due;
+        for (i = 0; i < router.num_events; i++)
+            if (router.events[i].due < next)
+                next = router.events[i].due;
+        pfds[0].fd     = router.wake[0];
+        pfds[0].events = POLLIN;
+        for (i = 0; i < router.clients; i++) {
+            if (router.fds[i] < 0)
+                continue;
+            pfds[count].fd     = router.fds[i];
+            pfds[count].events = POLLIN;
+            index[count++]     = i;
+        }
+        if (router.num_replies == 0 && router.num_events == 0)
+            pthread_cond_broadcast(&router.idle);
+        pthread_mutex_unlock(&router.lock);
+
+        if (next != INT64_MAX) {
+            int64_t  wait = next - fake_now_ns();
+            if (wait < 0)
+                wait = 0;
+            ts.tv_sec  = wait / 1000000000;
+            ts.tv_nsec = wait % 1000000000;
+            tsp = &ts;
+        }
+        n = ppoll(pfds, count, tsp, NULL);
+        if (n < 0 && errno != EINTR)
+            break;
+
+        if (n > 0 && (pfds[0].revents & POLLIN)) {
+            char  buf[64];
+            while (read(router.wake[0], buf, sizeof(buf)) < 0 && errno == EINTR)
+                ;
+        }
+        for (i = 1; n > 0 && i < count; i++) {
+            int  len;
+
+            if (!pfds[i].revents)
+                continue;
+            len = recv(pfds[i].fd, msg, sizeof(msg), 0);
+            if (len <= 0) {
+                // the CLIENT was destroyed
+                pthread_mutex_lock(&router.lock);
+                close(router.fds[index[i]]);
+                router.fds[index[i]] = -1;
+                pthread_mutex_unlock(&router.lock);
+                continue;
+            }
+            router_call(index[i], msg, len);
+        }
+
+        // replies and events that are due, in the order they fell due
+        now = fake_now_ns();
+        for (;;) {
+            FakeReply  reply;
+            FakeEvent  ev;
+            int        fd, r = -1, e = -1;
+
+            pthread_mutex_lock(&router.lock);
+            for (i = 0; i < router.num_replies; i++)
+                if (router.replies[i].due <= now && (r < 0 || router.replies[i].due < router.replies[r].due))
+                    r = i;
+            for (i = 0; i < router.num_events; i++)
+                if (router.events[i].due <= now && (e < 0 || router.events[i].due < router.events[e].due))
+                    e = i;
+            if (r >= 0 && (e < 0 || router.replies[r].due <= router.events[e].due)) {
+                reply = router.replies[r];
+                router.replies[r] = router.replies[--router.num_replies];
+                fake_router_stats.in_flight -= 1;
+                fd = router.fds[reply.client];
+                pthread_mutex_unlock(&router.lock);
+
+                uint32_t  out[3] = { reply.xid, htonl(reply.stat), htonl(reply.result) };
+                if (fd >= 0)
+                    send(fd, out, sizeof(out), MSG_NOSIGNAL);
+            } else if (e >= 0) {
+                ev = router.events[e];
+                router.events[e] = router.events[--router.num_events];
+                pthread_mutex_unlock(&router.lock);
+
+                router_dispatch(&ev);
+            } else {
+                pthread_mutex_unlock(&router.lock);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void router_start( void ) {
+    if (pipe(router.wake) < 0)
+        abort();
+    if (pthread_create(&router.thread, NULL, router_thread, NULL))
+        abort();
+    pthread_detach(router.thread);
+}
+
+void fake_router_event( uint32_t  prog, uint32_t  proc, const uint32_t*  args, int  words,
+                        int64_t  delay_ns ) {
+    FakeEvent*  ev;
+
+    pthread_once(&router.once, router_start);
+    if (words > FAKE_EVENT_WORDS)
+        words = FAKE_EVENT_WORDS;
+    pthread_mutex_lock(&router.lock);
+    if (router.num_events < FAKE_MAX_PENDING) {
+        ev = &router.events[router.num_events++];
+        ev->due   = fake_now_ns() + delay_ns;
+        ev->prog  = prog;
+        ev->proc  = proc;
+        ev->words = words;
+        memcpy(ev->args, args, words * sizeof(uint32_t));
+    }
+    pthread_mutex_unlock(&router.lock);
+    fake_wake();
+}
+
+void fake_router_wait_idle( void ) {
+    pthread_once(&router.once, router_start);
+    pthread_mutex_lock(&router.lock);
+    while (router.num_replies > 0 || router.num_events > 0) {
+        fake_wake();
+        pthread_cond_wait(&router.idle, &router.lock);
+    }
+    pthread_mutex_unlock(&router.lock);
+}
+
+void fake_router_configure( const FakeRouterConf*  conf ) {
+    pthread_mutex_lock(&router.lock);
+    router.conf = *conf;
+    pthread_mutex_unlock(&router.lock);
+}
+
+void fake_router_stats_get( FakeRouterStats*  stats ) {
+    pthread_mutex_lock(&router.lock);
+    *stats = fake_router_stats;
+    pthread_mutex_unlock(&router.lock);
+}
+
+void fake_router_stats_reset( void ) {
+    pthread_mutex_lock(&router.lock);
+    memset(&fake_router_stats, 0, sizeof(fake_router_stats));
+    pthread_mutex_unlock(&router.lock);
+}
+
+/*****       C L I E N T                                     *****/
+
+struct CLIENT* clnt_create( char*  host, uint32_t  prog, uint32_t  vers, char*  proto ) {
+    struct CLIENT*  clnt;
+    int             sv[2];
+
+    (void)host;
+    (void)proto;
+    pthread_once(&router.once, router_start);
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+        return NULL;
+    clnt = calloc(1, sizeof(*clnt));
+    if (clnt == NULL) {
+        close(sv[0]);
+        close(sv[1]);
+        return NULL;
+    }
+    clnt->fd   = sv[0];
+    clnt->prog = prog;
+    clnt->vers = vers;
+    pthread_mutex_init(&clnt->lock, NULL);
+
+    pthread_mutex_lock(&router.lock);
+    if (router.clients == FAKE_MAX_CLIENTS) {
+        pthread_mutex_unlock(&router.lock);
+        close(sv[0]);
+        close(sv[1]);
+        free(clnt);
+        return NULL;
+    }
+    clnt->index = router.clients;
+    router.fds[router.clients++] = sv[1];
+    fake_router_stats.clients += 1;
+    pthread_mutex_unlock(&router.lock);
+    fake_wake();
+    return clnt;
+}
+
+void clnt_destroy( struct CLIENT*  clnt ) {
+    if (clnt == NULL)
+        return;
+    // the router closes its end when it reads EOF
+    close(clnt->fd);
+    pthread_mutex_destroy(&clnt->lock);
+    free(clnt);
+}
+
+enum clnt_stat host_clnt_call( struct CLIENT*  clnt, uint32_t  proc, xdrproc_t  xargs, void*  argsp,
+                               xdrproc_t  xres, void*  resp, struct timeval  timeout ) {
+    uint32_t        header[ FAKE_CALL_WORDS ];
+    uint32_t        reply[ 64 ];
+    XDR             xdrs;
+    uint32_t        xid;
+    int             len;
+    enum clnt_stat  stat;
+
+    (void)timeout;
+    pthread_mutex_lock(&clnt->lock);
+    xid = ++clnt->xid;
+    memset(header, 0, sizeof(header));
+    header[0] = htonl(xid);
+    header[2] = htonl(2);
+    header[3] = htonl(clnt->prog);
+    header[4] = htonl(clnt->vers);
+    header[5] = htonl(proc);
+    memcpy(clnt->buf, header, sizeof(header));
+
+    memset(&xdrs, 0, sizeof(xdrs));
+    xdrs.x_op     = XDR_ENCODE;
+    xdrs.out_msg  = clnt->buf;
+    xdrs.out_len  = sizeof(header);
+    xdrs.out_size = sizeof(clnt->buf);
+    if (!xargs(&xdrs, argsp)) {
+        pthread_mutex_unlock(&clnt->lock);
+        return RPC_CANTENCODEARGS;
+    }
+    if (send(clnt->fd, clnt->buf, xdrs.out_len, MSG_NOSIGNAL) != xdrs.out_len) {
+        pthread_mutex_unlock(&clnt->lock);
+        return RPC_CANTSEND;
+    }
+    pthread_mutex_lock(&router.lock);
+    fake_router_stats.message_bytes += xdrs.out_len;
+    pthread_mutex_unlock(&router.lock);
+
+    do {
+        len = recv(clnt->fd, reply, sizeof(reply), 0);
+    } while ((len < 0 && errno == EINTR) || (len >= 12 && ntohl(reply[0]) != xid));
+    if (len < 12) {
+        pthread_mutex_unlock(&clnt->lock);
+        return RPC_CANTRECV;
+    }
+    stat = ntohl(reply[1]);
+    if (stat == RPC_SUCCESS) {
+        memset(&xdrs, 0, sizeof(xdrs));
+        xdrs.x_op   = XDR_DECODE;
+        xdrs.in_msg = &reply[2];
+        xdrs.in_len = len - 8;
+        if (!xres(&xdrs, resp))
+            stat = RPC_CANTDECODERES;
+    }
+    pthread_mutex_unlock(&clnt->lock);
+    return stat;
+}
+
+/*****       S E R V E R                                     *****/
+
+struct SVCXPRT {
+    int  registered;
+};
+
+SVCXPRT* svcrtr_create( void ) {
+    pthread_once(&router.once, router_start);
+    return calloc(1, sizeof(SVCXPRT));
+}
+
+void svc_destroy( SVCXPRT*  xprt ) {
+    free(xprt);
+}
+
+void xprt_register( SVCXPRT*  xprt ) {
+    xprt->registered = 1;
+}
+
+void xprt_unregister( SVCXPRT*  xprt ) {
+    xprt->registered = 0;
+}
+
+bool_t svc_register( SVCXPRT*  xprt, uint32_t  prog, uint32_t  vers,
+                     __dispatch_fn_t  dispatch, uint32_t  protocol ) {
+    (void)xprt;
+    (void)protocol;
+    pthread_mutex_lock(&router.dispatch_lock);
+    if (router.num_servers == FAKE_MAX_SERVERS) {
+        pthread_mutex_unlock(&router.dispatch_lock);
+        return 0;
+    }
+    router.servers[router.num_servers].prog     = prog;
+    router.servers[router.num_servers].vers     = vers;
+    router.servers[router.num_servers].dispatch = dispatch;
+    router.num_servers += 1;
+    pthread_mutex_unlock(&router.dispatch_lock);
+    return 1;
+}
+
+/* once it returns, the server's dispatch isn't running and won't be called */
+void svc_unregister( SVCXPRT*  xprt, uint32_t  prog, uint32_t  vers ) {
+    int  n;
+
+    (void)xprt;
+    pthread_mutex_lock(&router.dispatch_lock);
+    for (n = 0; n < router.num_servers; n++) {
+        if (router.servers[n].prog == prog && router.servers[n].vers == vers) {
+            router.servers[n] = router.servers[--router.num_servers];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&router.dispatch_lock);
+}
+
+bool_t svc_sendreply( void*  xprt, xdrproc_t  xres, void*  result ) {
+    (void)xprt;
+    (void)xres;
+    (void)result;
+    pthread_mutex_lock(&router.lock);
+    fake_router_stats.acks += 1;
+    pthread_mutex_unlock(&router.lock);
+    return 1;
+}
+
+/*****       D E V I C E                                     *****/
+
+/* libutils' elapsedRealtime(), in ms, which leo-gps-rpc.c takes from the
+ * device. the host doesn't suspend, so the monotonic clock will do */
+int64_t elapsed_realtime( void ) {
+    return fake_now_ns() / 1000000;
+}
@@ -0,0 +1,93 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/fake-router.h
+ *
+ * A loopback stand-in for the modem's RPC router, serving the librpc API
+ * of stubs/librpc/rpc/rpc.h on a host. Each CLIENT is a socketpair to a
+ * router thread, which decodes the call, asks the modem model for the
+ * result and replies after the configured latency, while it keeps
+ * serving other calls: requests on several CLIENTs overlap as they do on
+ * the device. Calls from the modem (PD events) are made by the router
+ * thread into the dispatch function the HAL registered, and wait for its
+ * svc_sendreply(), as the svc thread does.
+ *
+ * The default modem model answers every call with 0, hands out client
+ * ids, and ends a PD session (PDSM_PD_EVENT_DONE) session_ns after each
+ * get position request is answered.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#ifndef _FAKE_ROUTER_H
+#define _FAKE_ROUTER_H
+
+#include <stdint.h>
+#include <librpc/rpc/rpc.h>
+
+#define  FAKE_MAX_PROCS  64
+
+/* the PDSM procedures the HAL calls */
+#define  FAKE_PROC_CLIENT_INIT     0x02
+#define  FAKE_PROC_GET_POSITION    0x0b
+#define  FAKE_PROC_END_SESSION     0x0c
+#define  FAKE_PROC_XTRA_SET_DATA   0x1a
+
+/* a call as the router decoded it */
+typedef struct {
+    uint32_t         prog;
+    uint32_t         vers;
+    uint32_t         proc;
+    const uint32_t*  args;      // network byte order
+    int              words;     // of args
+    int              client;    // the CLIENT it came on, in clnt_create() order
+} FakeCall;
+
+/* returns the status of the call, and its result if RPC_SUCCESS; called on
+ * the router thread */
+typedef enum clnt_stat (*FakeModem)( const FakeCall*  call, uint32_t*  result );
+
+typedef struct {
+    int64_t    latency_ns;      // from a request to its reply
+    int64_t    session_ns;      // from a get position request to PD_DONE
+    FakeModem  modem;           // NULL for fake_router_modem()
+} FakeRouterConf;
+
+typedef struct {
+    uint32_t  calls[ FAKE_MAX_PROCS ];
+    uint32_t  failed;           // calls not answered with RPC_SUCCESS
+    uint32_t  clients;          // CLIENTs created
+    uint32_t  in_flight;        // requests not answered yet
+    uint32_t  max_in_flight;
+    uint32_t  events;           // calls made into the HAL's dispatch
+    uint32_t  acks;             // svc_sendreply()
+    uint64_t  payload_copied;   // bytes copied by xdr_bytes()/xdr_opaque()
+    uint64_t  message_bytes;    // bytes of the requests sent
+} FakeRouterStats;
+
+/* applies to the calls the router reads from then on; may be called on
+ * any thread */
+void fake_router_configure( const FakeRouterConf*  conf );
+
+/* read with fake_router_stats_get() while the router runs */
+extern FakeRouterStats  fake_router_stats;
+
+void fake_router_stats_get( FakeRouterStats*  stats );
+void fake_router_stats_reset( void );
+
+/* the default modem model */
+enum clnt_stat fake_router_modem( const FakeCall*  call, uint32_t*  result );
+
+/* a call from the modem into the server registered for prog, after
+ * delay_ns; args in host byte order. may be called on any thread. */
+void fake_router_event( uint32_t  prog, uint32_t  proc, const uint32_t*  args, int  words,
+                        int64_t  delay_ns );
+
+/* waits until no request is in flight and no event is pending */
+void fake_router_wait_idle( void );
+
+#endif
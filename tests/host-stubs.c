@@ -0,0 +1,91 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/host-stubs.c
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#include <time.h>
+#include <gps.h>
+#include "host-stubs.h"
+
+HostConf  host_conf = {
+    .cleanup                = 1,
+    .precision              = 10,
+    .sv_snr_tolerance       = 1,
+    .sv_elevation_tolerance = 1,
+    .session_timeout        = 2,
+    .kalman_filter          = 0,
+    .single_shot_accuracy   = 50,
+    .prediction_rate        = 0,
+};
+
+volatile uint32_t  host_sessions;
+
+int64_t host_now_ns( void ) {
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint8_t get_cleanup_value()           { return host_conf.cleanup; }
+uint8_t get_precision_value()         { return host_conf.precision; }
+uint8_t get_sv_snr_tolerance()        { return host_conf.sv_snr_tolerance; }
+uint8_t get_sv_elevation_tolerance()  { return host_conf.sv_elevation_tolerance; }
+uint8_t get_session_timeout()         { return host_conf.session_timeout; }
+uint8_t get_kalman_filter_mode()      { return host_conf.kalman_filter; }
+uint8_t get_single_shot_accuracy()    { return host_conf.single_shot_accuracy; }
+uint8_t get_prediction_rate()         { return host_conf.prediction_rate; }
+
+int init_gps_rpc() {
+    return 0;
+}
+
+void exit_gps_rpc() {
+}
+
+void wait_gps_rpc_exit() {
+}
+
+void cleanup_gps_rpc_clients() {
+}
+
+/* there is no modem: the session is over as soon as it's started */
+extern void pdsm_pd_callback();
+
+void gps_get_position() {
+    __sync_fetch_and_add(&host_sessions, 1);
+    pdsm_pd_callback();
+}
+
+int gps_xtra_inject(unsigned char *data, uint32_t length) {
+    (void)data;
+    (void)length;
+    return 0;
+}
+
+int gps_xtra_inject_parts(const unsigned char *(*source)(void *ctx, uint32_t offset, uint32_t len),
+                          void *ctx, uint32_t length) {
+    (void)source;
+    (void)ctx;
+    (void)length;
+    return 0;
+}
+
+int gps_xtra_inject_time_info(GpsUtcTime time, int64_t timeReference, int uncertainty) {
+    (void)time;
+    (void)timeReference;
+    (void)uncertainty;
+    return 0;
+}
+
+int gps_rpc_get_internal_state(char *buffer, int size) {
+    (void)buffer;
+    (void)size;
+    return 0;
+}
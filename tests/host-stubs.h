@@ -0,0 +1,42 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/host-stubs.h
+ *
+ * Stand-ins for the RPC side of the HAL (leo-gps-rpc.c) and its gps.conf
+ * settings, so leo-gps.c and leo-gps-filter.c can be built and run on a
+ * host. The settings start out as in the default gps.conf and can be
+ * changed by a test through host_conf.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#ifndef _HOST_STUBS_H
+#define _HOST_STUBS_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint8_t  cleanup;
+    uint8_t  precision;
+    uint8_t  sv_snr_tolerance;
+    uint8_t  sv_elevation_tolerance;
+    uint8_t  session_timeout;
+    uint8_t  kalman_filter;
+    uint8_t  single_shot_accuracy;
+    uint8_t  prediction_rate;
+} HostConf;
+
+extern HostConf  host_conf;
+
+/* PD sessions started through gps_get_position() */
+extern volatile uint32_t  host_sessions;
+
+/* monotonic clock, in ns */
+int64_t host_now_ns( void );
+
+#endif
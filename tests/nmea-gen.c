@@ -0,0 +1,156 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/nmea-gen.c
+ *
+ * Writes a synthetic NMEA log to stdout: a receiver driving a slow curve
+ * at 12 m/s, one GGA, GSA, GPGSV cycle, GLGSV cycle, RMC and VTG per
+ * epoch, starting shortly before midnight so the date changes. The
+ * sentences are those of the HD2's NMEA port, VTG included, which the
+ * HAL does not handle. Used as the default corpus of the host tests.
+ *
+ * With -e, the reported positions get gaussian noise of that many meters
+ * per axis, and one in OUTLIER_EVERY epochs an OUTLIER_SIGMAS jump; the
+ * true position is written first in each epoch, in a $PTRUE sentence
+ * (time, latitude, longitude in degrees), for nmea-replay to measure the
+ * position error against. The HAL ignores it as an unknown sentence.
+ *
+ * usage: nmea-gen [-n epochs] [-r epochs per second] [-e noise_m]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdint.h>
+
+#define  EARTH_RADIUS  6371000.0
+#define  DEG2RAD       (M_PI / 180.0)
+
+#define  START_TOD     (23*3600 + 50*60)   // s, 23:50:00
+#define  START_DAY     23
+#define  START_MON     3
+#define  START_YEAR    11
+
+#define  OUTLIER_EVERY   97
+#define  OUTLIER_SIGMAS  15
+
+static void emit( const char*  fmt, ... ) {
+    char     body[256];
+    va_list  args;
+    int      n, sum = 0;
+
+    va_start(args, fmt);
+    vsnprintf(body, sizeof(body), fmt, args);
+    va_end(args);
+
+    for (n = 0; body[n]; n++)
+        sum ^= (unsigned char)body[n];
+    printf("$%s*%02X\r\n", body, sum);
+}
+
+/* standard normal, from a fixed seed so that logs are reproducible */
+static double gauss( void ) {
+    static uint32_t  seed = 12345;
+    double           u, v;
+
+    seed = seed * 1664525 + 1013904223;
+    u = (seed >> 8) / 16777216.0 + 1.0 / 33554432;
+    seed = seed * 1664525 + 1013904223;
+    v = (seed >> 8) / 16777216.0;
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static void hhmm( double  deg, int  lat, char*  out, size_t  size ) {
+    double  a = fabs(deg);
+    int     d = (int)a;
+    double  m = (a - d) * 60.0;
+
+    snprintf(out, size, lat ? "%02d%07.4f" : "%03d%07.4f", d, m);
+}
+
+/* one GSV cycle of num SVs starting at prn */
+static void emit_gsv( const char*  talker, int  prn, int  num, double  t ) {
+    int  sentences = (num + 3) / 4;
+    int  s, n;
+
+    for (s = 0; s < sentences; s++) {
+        char  body[200];
+        int   len = snprintf(body, sizeof(body), "%sGSV,%d,%d,%02d", talker, sentences, s + 1, num);
+
+        for (n = s * 4; n < num && n < s * 4 + 4; n++) {
+            int  elev = 10 + (n * 17 + (int)(t / 60)) % 75;
+            int  azim = (n * 47 + (int)(t / 10)) % 360;
+            int  snr  = 25 + (int)(10 * sin(t / 7.0 + n)) + n % 10;
+            len += snprintf(body + len, sizeof(body) - len, ",%02d,%02d,%03d,%02d",
+                            prn + n, elev, azim, snr);
+        }
+        emit("%s", body);
+    }
+}
+
+int main( int  argc, char**  argv ) {
+    int     epochs = 3600;
+    int     rate   = 1;
+    double  lat = 48.1173, lon = 11.5167;
+    double  speed = 12.0;
+    double  noise = 0;
+    int     c, e;
+
+    while ((c = getopt(argc, argv, "n:r:e:")) != -1) {
+        if (c == 'n')
+            epochs = atoi(optarg);
+        else if (c == 'r')
+            rate = atoi(optarg);
+        else if (c == 'e')
+            noise = atof(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-n epochs] [-r epochs per second] [-e noise_m]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (rate < 1)
+        rate = 1;
+
+    for (e = 0; e < epochs; e++) {
+        double  t       = (double)e / rate;
+        int     tod_cs  = (int)(fmod(START_TOD + t, 86400) * 100 + 0.5);
+        int     day     = START_DAY + (int)((START_TOD + t) / 86400);
+        double  bearing = fmod(84.4 + t * 0.5, 360.0);
+        double  alt     = 545.4 + 3 * sin(t / 30.0);
+        double  fix_lat = lat, fix_lon = lon;
+        char    tod[32], la[32], lo[32];
+
+        snprintf(tod, sizeof(tod), "%02d%02d%02d.%02d", tod_cs / 360000,
+                 tod_cs / 6000 % 60, tod_cs / 100 % 60, tod_cs % 100);
+        if (noise > 0) {
+            double  scale = noise * (e % OUTLIER_EVERY == OUTLIER_EVERY - 1 ? OUTLIER_SIGMAS : 1);
+            fix_lat += gauss() * scale / EARTH_RADIUS / DEG2RAD;
+            fix_lon += gauss() * scale / (EARTH_RADIUS * cos(lat * DEG2RAD)) / DEG2RAD;
+            emit("PTRUE,%s,%.8f,%.8f", tod, lat, lon);
+        }
+        hhmm(fix_lat, 1, la, sizeof(la));
+        hhmm(fix_lon, 0, lo, sizeof(lo));
+
+        emit("GPGGA,%s,%s,N,%s,E,1,08,0.9,%.1f,M,46.9,M,,", tod, la, lo, alt);
+        emit("GPGSA,A,3,01,02,03,04,05,06,07,08,,,,,1.8,0.9,1.5");
+        emit_gsv("GP", 1, 10, t);
+        emit_gsv("GL", 65, 6, t);
+        emit("GPRMC,%s,A,%s,N,%s,E,%05.1f,%05.1f,%02d%02d%02d,003.1,W,A",
+             tod, la, lo, speed / 1852.0 * 3600.0, bearing, day, START_MON, START_YEAR);
+        emit("GPVTG,%05.1f,T,,M,%05.1f,N,%05.1f,K,A",
+             bearing, speed / 1852.0 * 3600.0, speed * 3.6);
+
+        lat += speed / rate * cos(bearing * DEG2RAD) / EARTH_RADIUS / DEG2RAD;
+        lon += speed / rate * sin(bearing * DEG2RAD) / (EARTH_RADIUS * cos(lat * DEG2RAD)) / DEG2RAD;
+    }
+    return 0;
+}
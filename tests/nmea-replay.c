@@ -0,0 +1,651 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/nmea-replay.c
+ *
+ * Replays a recorded NMEA log through the HAL's parser on a host.
+ *
+ * At max speed (the default) the log is loaded into memory and fed to
+ * nmea_reader_addbuf() in 512 byte reads, as gps_state_thread does, best
+ * of -n rounds; then the sentences of each handled type are fed on their
+ * own, to get the parse cost per type. The cost of the latency sampling is
+ * measured by alternating rounds where one read in LATENCY_SAMPLE is
+ * followed, as gps_state_thread does, with rounds where none is.
+ *
+ * With -t the log is written to a pty (or with -f a FIFO) standing in for
+ * /dev/smd27 at the pace of its GGA/RMC times, sped up by the -t factor,
+ * and the whole HAL runs on it through its GpsInterface, state thread and
+ * all, until the log ends. The latency from writing an epoch's last GGA
+ * or RMC to its fix reaching location_cb is reported as percentiles, and
+ * the debug interface is dumped at the end. With a 1 Hz log, -t 1 or 2
+ * keeps fix_freq from holding fixes back. The context switches made while
+ * the log plays are reported per real fix, for the process and for the
+ * HAL's threads alone, leaving out the replay's own writes and sleeps.
+ *
+ * Given a log with true positions, as nmea-gen -e writes, each real fix
+ * that reaches location_cb, in the first max speed round or while the log
+ * plays, is compared with the true position at its timestamp. The error
+ * is reported as percentiles, with how often the fix's accuracy covered
+ * it; run with -k 0, 1 and 2 to compare the Kalman filter modes.
+ *
+ * usage: nmea-replay [-n rounds] [-t speedup [-f] [-r fix_freq]
+ *                    [-p prediction_rate] [-k kalman_mode]] log.nmea
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "host-stubs.h"
+#include "leo-gps.c"
+
+#define  REPLAY_READ_SIZE  512
+
+static struct {
+    uint32_t  locations;
+    uint32_t  predicted;
+    uint32_t  sv_status;
+    uint32_t  ext_sv_status;
+    uint32_t  nmea;
+    uint32_t  status;
+} cbs;
+
+/* real time: when the last GGA or RMC was written, and how long after
+ * that each real fix reached location_cb */
+#define  REPLAY_MAX_LATENCIES  (1 << 16)
+
+static volatile int64_t  epoch_write_ns;
+static int64_t           latencies[ REPLAY_MAX_LATENCIES ];
+static uint32_t          latency_count;
+
+/* the true track, from $PTRUE sentences, in log time: ms of the first day */
+#define  REPLAY_MAX_TRUTH  (1 << 16)
+#define  REPLAY_DAY_MS     86400000LL
+
+typedef struct {
+    int64_t  t;
+    double   lat, lon;
+} TruePosition;
+
+static TruePosition  truth[ REPLAY_MAX_TRUTH ];
+static uint32_t      truth_count;
+static int           truth_days;
+
+/* the error of each real fix against it, while tracked */
+static int       track_accuracy;
+static double    errors[ REPLAY_MAX_LATENCIES ];
+static uint32_t  error_count;
+static uint32_t  error_covered;     // within the fix's accuracy
+static double    accuracy_total;
+
+static void record_error( const GpsLocation*  fix );
+
+static void replay_location_cb( GpsLocation*  location ) {
+    __sync_fetch_and_add(&cbs.locations, 1);
+    if (location->flags & GPS_LOCATION_IS_PREDICTED) {
+        __sync_fetch_and_add(&cbs.predicted, 1);
+        return;
+    }
+    if (epoch_write_ns) {
+        uint32_t  n = __sync_fetch_and_add(&latency_count, 1);
+        if (n < REPLAY_MAX_LATENCIES)
+            latencies[n] = now_ns() - epoch_write_ns;
+    }
+    if (track_accuracy)
+        record_error( location );
+}
+
+static void replay_status_cb( GpsStatus*  status ) {
+    (void)status;
+    __sync_fetch_and_add(&cbs.status, 1);
+}
+
+static void replay_sv_status_cb( GpsSvStatus*  sv_status ) {
+    (void)sv_status;
+    __sync_fetch_and_add(&cbs.sv_status, 1);
+}
+
+static void replay_ext_sv_status_cb( GpsExtSvStatus*  sv_status ) {
+    (void)sv_status;
+    __sync_fetch_and_add(&cbs.ext_sv_status, 1);
+}
+
+static void replay_nmea_cb( GpsUtcTime  timestamp, const char*  nmea, int  length ) {
+    (void)timestamp;
+    (void)nmea;
+    (void)length;
+    __sync_fetch_and_add(&cbs.nmea, 1);
+}
+
+static GpsCallbacks  replay_callbacks = {
+    replay_location_cb,
+    replay_status_cb,
+    replay_sv_status_cb,
+    replay_nmea_cb,
+};
+
+static GpsExtSvCallbacks  replay_ext_sv_callbacks = {
+    replay_ext_sv_status_cb,
+};
+
+static void print_callbacks( void ) {
+    printf("callbacks: location=%u predicted=%u sv_status=%u ext_sv_status=%u nmea=%u status=%u\n",
+           cbs.locations, cbs.predicted, cbs.sv_status, cbs.ext_sv_status, cbs.nmea, cbs.status);
+}
+
+static char* load_log( const char*  path, int*  len ) {
+    FILE*  f = fopen(path, "rb");
+    char*  buf;
+    long   size;
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(size + 1);
+    if (buf == NULL || fread(buf, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "%s: read failed\n", path);
+        exit(1);
+    }
+    fclose(f);
+    buf[size] = 0;
+    *len = (int)size;
+    return buf;
+}
+
+/* sentence id of the line at p, 0 if it has none */
+static uint32_t line_id( const char*  p, const char*  end ) {
+    if (end - p < 6 || p[0] != '$')
+        return 0;
+    return NMEA_ID(p[3], p[4], p[5]);
+}
+
+/* UTC time of day of the line at p, from its first field, in ms, or -1 */
+static int field_tod( const char*  p, const char*  end ) {
+    int  h, m, s, frac = 0, scale = 100;
+
+    p = memchr(p, ',', end - p);
+    if (p == NULL || end - ++p < 6)
+        return -1;
+    h = str2int(p, p + 2);
+    m = str2int(p + 2, p + 4);
+    s = str2int(p + 4, p + 6);
+    if ((h | m | s) < 0)
+        return -1;
+    for (p += 6; p < end && *p == '.'; p++)
+        ;
+    while (p < end && *p >= '0' && *p <= '9' && scale > 0) {
+        frac  += (*p++ - '0') * scale;
+        scale /= 10;
+    }
+    return ((h * 60 + m) * 60 + s) * 1000 + frac;
+}
+
+static void load_truth( const char*  buf, int  len ) {
+    const char*  p   = buf;
+    const char*  end = buf + len;
+    int          last_tod = -1;
+
+    while (p < end && truth_count < REPLAY_MAX_TRUTH) {
+        const char*  eol = memchr(p, '\n', end - p);
+        int          tod;
+
+        eol = eol ? eol + 1 : end;
+        if (eol - p > 7 && !memcmp(p, "$PTRUE,", 7) && (tod = field_tod(p, eol)) >= 0) {
+            TruePosition*  t = &truth[truth_count];
+            char*          q;
+
+            if (last_tod >= 0 && tod + 43200000 < last_tod)
+                truth_days += 1;
+            last_tod = tod;
+            q = memchr(p + 7, ',', eol - p - 7);
+            if (q) {
+                t->t   = tod + truth_days * REPLAY_DAY_MS;
+                t->lat = strtod(q + 1, &q);
+                t->lon = strtod(q + 1, NULL);
+                truth_count += 1;
+            }
+        }
+        p = eol;
+    }
+}
+
+/* meters from fix to the true position at its time; -1 if the track
+ * doesn't cover it */
+static double truth_error( const GpsLocation*  fix ) {
+    int64_t  tod = fix->timestamp % REPLAY_DAY_MS, t = -1;
+    double   lat, lon, dn, de;
+    uint32_t lo = 0, hi;
+    int      d;
+
+    for (d = 0; d <= truth_days && t < 0; d++) {
+        int64_t  c = tod + d * REPLAY_DAY_MS;
+        if (c >= truth[0].t - 2000 && c <= truth[truth_count - 1].t + 2000)
+            t = c;
+    }
+    if (t < 0)
+        return -1;
+
+    // the last true position at or before t, and the one after it
+    hi = truth_count;
+    while (hi - lo > 1) {
+        uint32_t  mid = (lo + hi) / 2;
+        if (truth[mid].t <= t)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    lat = truth[lo].lat;
+    lon = truth[lo].lon;
+    if (hi < truth_count && t > truth[lo].t) {
+        double  k = (double)(t - truth[lo].t) / (truth[hi].t - truth[lo].t);
+        lat += k * (truth[hi].lat - lat);
+        lon += k * (truth[hi].lon - lon);
+    } else if (t > truth[lo].t && lo > 0) {
+        // past the end: carry on along the last leg
+        double  k = (double)(t - truth[lo].t) / (truth[lo].t - truth[lo - 1].t);
+        lat += k * (lat - truth[lo - 1].lat);
+        lon += k * (lon - truth[lo - 1].lon);
+    }
+    dn = (fix->latitude - lat) * DEG2RAD * EARTH_RADIUS;
+    de = (fix->longitude - lon) * DEG2RAD * EARTH_RADIUS * cos(lat * DEG2RAD);
+    return sqrt(dn * dn + de * de);
+}
+
+static void record_error( const GpsLocation*  fix ) {
+    double    err;
+    uint32_t  n;
+
+    if (truth_count < 2 || (err = truth_error(fix)) < 0)
+        return;
+    n = __sync_fetch_and_add(&error_count, 1);
+    if (n >= REPLAY_MAX_LATENCIES)
+        return;
+    errors[n] = err;
+    if (fix->flags & GPS_LOCATION_HAS_ACCURACY) {
+        accuracy_total += fix->accuracy;
+        if (err <= fix->accuracy)
+            error_covered += 1;
+    }
+}
+
+static int compare_double( const void*  a, const void*  b ) {
+    double  x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_accuracy( void ) {
+    uint32_t  n = error_count < REPLAY_MAX_LATENCIES ? error_count : REPLAY_MAX_LATENCIES;
+    double    total = 0;
+    uint32_t  i;
+
+    if (n == 0)
+        return;
+    qsort(errors, n, sizeof(errors[0]), compare_double);
+    for (i = 0; i < n; i++)
+        total += errors[i];
+    printf("accuracy: kalman=%d fixes=%u error_m_mean=%.2f p50=%.2f p90=%.2f p99=%.2f max=%.2f "
+           "reported_m_mean=%.2f covered=%.0f%%\n", get_kalman_filter_mode(), n, total / n,
+           errors[n / 2], errors[n * 9 / 10], errors[n * 99 / 100], errors[n - 1],
+           accuracy_total / n, error_covered * 100.0 / n);
+}
+
+/*****       M A X   S P E E D                               *****/
+
+static void max_speed_setup( void ) {
+    GpsState*  s = _gps_state;
+
+    s->started       = 1;
+    s->fd            = -1;
+    s->session_timer = -1;
+    s->rpc_event     = -1;
+    s->predict_timer = -1;
+    s->publish_timer = -1;
+    s->cmd_event     = -1;
+    s->fix_freq      = 0;
+    s->callbacks        = replay_callbacks;
+    s->ext_sv_callbacks = replay_ext_sv_callbacks;
+    nmea_dispatch_init();
+    nmea_reader_init( &s->reader );
+}
+
+static int64_t max_speed_round( const char*  buf, int  len ) {
+    NmeaReader*  r  = &_gps_state->reader;
+    int64_t      t0 = now_ns();
+    int          off;
+
+    for (off = 0; off < len; off += REPLAY_READ_SIZE) {
+        int  n = len - off < REPLAY_READ_SIZE ? len - off : REPLAY_READ_SIZE;
+        r->stats.reads += 1;
+        nmea_reader_addbuf( r, buf + off, n );
+    }
+    return now_ns() - t0;
+}
+
+/* as max_speed_round(), with the reads sampled as gps_state_thread does */
+static int64_t max_speed_sampled_round( const char*  buf, int  len ) {
+    NmeaReader*  r  = &_gps_state->reader;
+    int64_t      t0 = now_ns();
+    int          off;
+
+    for (off = 0; off < len; off += REPLAY_READ_SIZE) {
+        int      n  = len - off < REPLAY_READ_SIZE ? len - off : REPLAY_READ_SIZE;
+        int64_t  t1 = 0;
+
+        if ((++r->stats.reads & (LATENCY_SAMPLE - 1)) == 0)
+            t1 = now_ns();
+        r->read_ns = 0;
+        if (t1) {
+            r->read_ns  = now_ns();
+            r->stamp_ns = r->read_ns;
+            latency_record( LATENCY_READ, r->read_ns - t1 );
+        }
+        nmea_reader_addbuf( r, buf + off, n );
+    }
+    r->read_ns = 0;
+    return now_ns() - t0;
+}
+
+/* unsampled and sampled rounds alternate, so that both see the same
+ * frequency scaling and cache state; the best of each is compared */
+static void max_speed_sampling( const char*  buf, int  len, int  rounds ) {
+    int64_t  plain = INT64_MAX, sampled = INT64_MAX;
+    int      n;
+
+    for (n = 0; n < rounds; n++) {
+        int64_t  t = max_speed_round( buf, len );
+        if (t < plain)
+            plain = t;
+        t = max_speed_sampled_round( buf, len );
+        if (t < sampled)
+            sampled = t;
+    }
+    printf("sampling: unsampled_us=%.1f sampled_us=%.1f overhead=%.2f%%\n",
+           plain / 1000.0, sampled / 1000.0, (sampled - plain) * 100.0 / plain);
+}
+
+static int64_t max_speed_best( const char*  buf, int  len, int  rounds ) {
+    int64_t  best = INT64_MAX;
+    int      n;
+
+    for (n = 0; n < rounds; n++) {
+        int64_t  t = max_speed_round( buf, len );
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+/* the lines of buf with sentence id 'id', or with no handler for id 0 */
+static char* select_lines( const char*  buf, int  len, uint32_t  id, int*  out_len, int*  lines ) {
+    char*        out = malloc(len + 1);
+    const char*  p   = buf;
+    const char*  end = buf + len;
+
+    *out_len = 0;
+    *lines   = 0;
+    while (p < end) {
+        const char*  eol = memchr(p, '\n', end - p);
+        uint32_t     lid;
+
+        eol = eol ? eol + 1 : end;
+        lid = line_id(p, eol);
+        if (id ? lid == id : nmea_dispatch_find(lid) == NULL) {
+            memcpy(out + *out_len, p, eol - p);
+            *out_len += eol - p;
+            *lines   += 1;
+        }
+        p = eol;
+    }
+    return out;
+}
+
+static void max_speed( const char*  buf, int  len, int  rounds ) {
+    NmeaStats  stats;
+    int64_t    best;
+    unsigned   n;
+
+    max_speed_setup();
+    track_accuracy = 1;
+    max_speed_round( buf, len );
+    track_accuracy = 0;
+    stats = _gps_state->reader.stats;
+    print_callbacks();
+    print_accuracy();
+    if (stats.sentences == 0) {
+        printf("no sentences\n");
+        return;
+    }
+
+    best = max_speed_best( buf, len, rounds );
+    printf("max speed: bytes=%d sentences=%u bad_checksum=%u unknown=%u rounds=%d\n",
+           len, stats.sentences, stats.bad_checksum, stats.unknown, rounds);
+    printf("max speed: best_us=%.1f sentences_per_s=%.0f ns_per_sentence=%.1f\n",
+           best / 1000.0, stats.sentences * 1e9 / best, (double)best / stats.sentences);
+    max_speed_sampling( buf, len, rounds );
+
+    for (n = 0; n <= sizeof(nmea_sentences)/sizeof(nmea_sentences[0]); n++) {
+        uint32_t  id = n < sizeof(nmea_sentences)/sizeof(nmea_sentences[0]) ? nmea_sentences[n].id : 0;
+        int       sub_len, lines;
+        char*     sub = select_lines( buf, len, id, &sub_len, &lines );
+
+        if (lines > 0) {
+            max_speed_round( sub, sub_len );
+            best = max_speed_best( sub, sub_len, rounds );
+            if (id)
+                printf("type: %c%c%c sentences=%d ns_per_sentence=%.1f\n",
+                       (id >> 16) & 0xff, (id >> 8) & 0xff, id & 0xff, lines, (double)best / lines);
+            else
+                printf("type: other sentences=%d ns_per_sentence=%.1f\n", lines, (double)best / lines);
+        }
+        free(sub);
+    }
+}
+
+/*****       R E A L   T I M E                               *****/
+
+/* UTC time of day of a GGA or RMC line, in ms, or -1 */
+static int line_tod( const char*  p, const char*  end ) {
+    uint32_t  id = line_id(p, end);
+
+    if (id != NMEA_ID('G','G','A') && id != NMEA_ID('R','M','C'))
+        return -1;
+    return field_tod(p, end);
+}
+
+static int compare_int64( const void*  a, const void*  b ) {
+    int64_t  x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* fixes held back by fix_freq are counted too, with the time held */
+static void print_latencies( void ) {
+    uint32_t  n = latency_count < REPLAY_MAX_LATENCIES ? latency_count : REPLAY_MAX_LATENCIES;
+
+    if (n == 0)
+        return;
+    qsort(latencies, n, sizeof(latencies[0]), compare_int64);
+    printf("latency: fixes=%u p50_us=%.1f p90_us=%.1f p99_us=%.1f max_us=%.1f\n", n,
+           latencies[n / 2] / 1000.0, latencies[n * 9 / 10] / 1000.0,
+           latencies[n * 99 / 100] / 1000.0, latencies[n - 1] / 1000.0);
+}
+
+/* voluntary and involuntary context switches of 'who' */
+static long context_switches( int  who ) {
+    struct rusage  ru;
+
+    if (getrusage(who, &ru) < 0)
+        return 0;
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static void print_context_switches( long  process, long  replay ) {
+    uint32_t  fixes = cbs.locations - cbs.predicted;
+
+    if (fixes == 0)
+        return;
+    printf("context switches: process=%ld hal=%ld per_fix=%.2f hal_per_fix=%.2f\n",
+           process, process - replay, (double)process / fixes, (double)(process - replay) / fixes);
+}
+
+static int open_source( int  use_fifo, char*  path, size_t  size ) {
+    int  fd;
+
+    if (use_fifo) {
+        snprintf(path, size, "/tmp/nmea-replay.%d", (int)getpid());
+        unlink(path);
+        if (mkfifo(path, 0600) < 0) {
+            perror("mkfifo");
+            exit(1);
+        }
+        // read-write, so neither this open nor the HAL's blocks
+        fd = open(path, O_RDWR);
+    } else {
+        struct termios  tio;
+        int             slave;
+
+        fd = posix_openpt(O_RDWR | O_NOCTTY);
+        if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+            perror("pty");
+            exit(1);
+        }
+        snprintf(path, size, "%s", ptsname(fd));
+        // a raw line discipline, as the SMD port has
+        slave = open(path, O_RDWR | O_NOCTTY);
+        tcgetattr(slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+        close(slave);
+    }
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+static void real_time( const char*  buf, int  len, double  speedup, int  use_fifo, int  fix_freq ) {
+    const GpsInterface*       gps = gps_get_hardware_interface();
+    const GpsDebugInterface*  debug;
+    const GpsExtSvInterface*  ext_sv;
+    const char*  p   = buf;
+    const char*  end = buf + len;
+    char         path[64];
+    static char  state[8192];
+    int64_t      start_ns, stop_ns;
+    long         process_cs, replay_cs;
+    int          fd, tod, first_tod = -1, last_tod = -1, days = 0;
+
+    fd = open_source( use_fifo, path, sizeof(path) );
+    setenv("LEO_GPS_NMEA_DEVICE", path, 1);
+
+    gps->init( &replay_callbacks );
+    ext_sv = gps->get_extension( GPS_EXT_SV_INTERFACE );
+    debug  = gps->get_extension( GPS_DEBUG_INTERFACE );
+    ext_sv->init( &replay_ext_sv_callbacks );
+    gps->set_position_mode( GPS_POSITION_MODE_STANDALONE, fix_freq );
+    gps->start();
+
+    track_accuracy = 1;
+    start_ns   = now_ns();
+    process_cs = context_switches(RUSAGE_SELF);
+    replay_cs  = context_switches(RUSAGE_THREAD);
+    while (p < end) {
+        const char*  eol = memchr(p, '\n', end - p);
+
+        eol = eol ? eol + 1 : end;
+        tod = line_tod(p, eol);
+        if (tod >= 0) {
+            if (first_tod < 0)
+                first_tod = tod;
+            if (last_tod >= 0 && tod + 43200000 < last_tod)
+                days += 1;
+            last_tod = tod;
+            // hold the sentence until its time comes
+            {
+                int64_t  due   = start_ns + (int64_t)((tod + days * 86400000LL - first_tod) * 1e6 / speedup);
+                int64_t  delay = due - now_ns();
+                if (delay > 0)
+                    usleep(delay / 1000);
+            }
+        }
+        if (tod >= 0)
+            epoch_write_ns = now_ns();
+        if (write(fd, p, eol - p) != eol - p) {
+            perror("write");
+            break;
+        }
+        p = eol;
+    }
+    // let the last epoch through
+    usleep(100000);
+    stop_ns    = now_ns();
+    process_cs = context_switches(RUSAGE_SELF) - process_cs;
+    replay_cs  = context_switches(RUSAGE_THREAD) - replay_cs;
+
+    gps->stop();
+    debug->get_internal_state( state, sizeof(state) );
+    gps->cleanup();
+    close(fd);
+    if (use_fifo)
+        unlink(path);
+
+    printf("real time: speedup=%g source=%s seconds=%.1f\n", speedup,
+           use_fifo ? "fifo" : "pty", (stop_ns - start_ns) / 1e9);
+    print_callbacks();
+    print_latencies();
+    print_accuracy();
+    print_context_switches( process_cs, replay_cs );
+    printf("sessions: %u\n", host_sessions);
+    fputs(state, stdout);
+}
+
+int main( int  argc, char**  argv ) {
+    int     rounds   = 20;
+    double  speedup  = 0;
+    int     use_fifo = 0;
+    int     fix_freq = 1;
+    int     c, len;
+    char*   buf;
+
+    while ((c = getopt(argc, argv, "n:t:fr:p:k:")) != -1) {
+        switch (c) {
+        case 'n': rounds   = atoi(optarg); break;
+        case 't': speedup  = atof(optarg); break;
+        case 'f': use_fifo = 1; break;
+        case 'r': fix_freq = atoi(optarg); break;
+        case 'p': host_conf.prediction_rate = atoi(optarg); break;
+        case 'k': host_conf.kalman_filter   = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n rounds] [-t speedup [-f] [-r fix_freq] "
+                            "[-p prediction_rate] [-k kalman_mode]] log.nmea\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || rounds < 1) {
+        fprintf(stderr, "%s: no NMEA log given\n", argv[0]);
+        return 1;
+    }
+    buf = load_log( argv[optind], &len );
+    load_truth( buf, len );
+
+    if (speedup > 0)
+        real_time( buf, len, speedup, use_fifo, fix_freq );
+    else
+        max_speed( buf, len, rounds );
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,203 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/stress-delivery.c
+ *
+ * Runs the RPC delivery ring of leo-gps-rpc.c on its own, to be built with
+ * -fsanitize=thread ("make tsan"): producer threads queue locations, SV
+ * statuses and XTRA requests as fast as they go, while the delivery
+ * thread hands them to the callbacks below, which now and then stall for
+ * the ring to fill up, and a dump thread reads the debug state. Every
+ * round ends with a cleanup of the ring, after the producers stopped, as
+ * release_leo() does after unregistering the server.
+ *
+ * Checks that:
+ * - no location is torn: its longitude is twice its latitude, and its
+ *   timestamp matches them;
+ * - each producer's locations arrive in the order they were queued;
+ * - nothing is lost: what was queued was either delivered, by the end of
+ *   the cleanup, or counted as dropped;
+ * - the deepest the ring got is within its size.
+ *
+ * usage: stress-delivery [-s seconds]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fake-router.h"
+#include "leo-gps-rpc.c"
+
+#define  PRODUCERS  4
+#define  ROUNDS     8
+
+static int       running;
+static int       failed;
+
+/* what the producers queued, and what the delivery thread got */
+static uint32_t  queued[ DELIVER_TYPES ];
+static uint32_t  received[ DELIVER_TYPES ];
+static uint32_t  torn, out_of_order;
+static int64_t   last_seq[ PRODUCERS ];
+
+static int is_running( void ) {
+    return __atomic_load_n(&running, __ATOMIC_ACQUIRE);
+}
+
+/* the callbacks of leo-gps.c, called on the delivery thread */
+
+static void stall( void ) {
+    if ((received[DELIVER_LOCATION] & 1023) == 1023)
+        usleep(2000);
+}
+
+void update_gps_location( GpsLocation*  location, int64_t  received_ms ) {
+    int      producer = (int)location->altitude;
+    int64_t  seq      = location->timestamp;
+
+    received[DELIVER_LOCATION] += 1;
+    if (received_ms <= 0 || location->longitude != 2 * location->latitude || location->latitude != (double)seq ||
+        producer < 0 || producer >= PRODUCERS) {
+        if (torn++ < 5)
+            printf("FAIL torn location: lat=%.1f lon=%.1f ts=%lld\n", location->latitude,
+                   location->longitude, (long long)seq);
+        return;
+    }
+    if (seq <= last_seq[producer]) {
+        if (out_of_order++ < 5)
+            printf("FAIL producer %d: location %lld after %lld\n", producer, (long long)seq,
+                   (long long)last_seq[producer]);
+    }
+    last_seq[producer] = seq;
+    stall();
+}
+
+void update_gps_svstatus( GpsSvStatus*  svstatus ) {
+    (void)svstatus;
+    received[DELIVER_SV_STATUS] += 1;
+}
+
+void xtra_download_request( void ) {
+    received[DELIVER_XTRA_REQUEST] += 1;
+}
+
+void update_gps_status( GpsStatusValue  value ) {
+    (void)value;
+}
+
+void pdsm_pd_callback( void ) {
+}
+
+static void* producer( void*  arg ) {
+    int          id = (int)(intptr_t)arg;
+    GpsSvStatus  sv;
+    int64_t      seq = 0;
+
+    memset(&sv, 0, sizeof(sv));
+    while (is_running()) {
+        GpsLocation  fix;
+
+        memset(&fix, 0, sizeof(fix));
+        seq += 1;
+        fix.timestamp = seq;
+        fix.latitude  = (double)seq;
+        fix.longitude = 2 * fix.latitude;
+        fix.altitude  = id;
+        deliver_location(&fix);
+        __sync_fetch_and_add(&queued[DELIVER_LOCATION], 1);
+
+        if ((seq & 3) == 0) {
+            sv.num_svs = 1 + seq % GPS_MAX_SVS;
+            deliver_svstatus(&sv);
+            __sync_fetch_and_add(&queued[DELIVER_SV_STATUS], 1);
+        }
+        if ((seq & 255) == 0) {
+            deliver_xtra_request();
+            __sync_fetch_and_add(&queued[DELIVER_XTRA_REQUEST], 1);
+        }
+        // in bursts, so the ring fills up and drains
+        if ((seq & 31) == 0)
+            usleep(100);
+    }
+    return NULL;
+}
+
+static void* dump( void*  arg ) {
+    static char  state[1024];
+
+    (void)arg;
+    while (is_running()) {
+        gps_rpc_get_internal_state(state, sizeof(state));
+        usleep(200);
+    }
+    return NULL;
+}
+
+static void round_run( int  round, int  ms ) {
+    pthread_t  producers[ PRODUCERS ], dumper;
+    int        n, type;
+
+    memset(queued, 0, sizeof(queued));
+    memset(received, 0, sizeof(received));
+    memset(delivery.dropped, 0, sizeof(delivery.dropped));
+    for (n = 0; n < PRODUCERS; n++)
+        last_seq[n] = 0;
+    delivery.max_depth = 0;
+
+    delivery_init();
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    for (n = 0; n < PRODUCERS; n++)
+        pthread_create(&producers[n], NULL, producer, (void*)(intptr_t)n);
+    pthread_create(&dumper, NULL, dump, NULL);
+    usleep(ms * 1000);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    for (n = 0; n < PRODUCERS; n++)
+        pthread_join(producers[n], NULL);
+    pthread_join(dumper, NULL);
+    delivery_cleanup();
+
+    for (type = 0; type < DELIVER_TYPES; type++) {
+        if (received[type] + delivery.dropped[type] != queued[type]) {
+            printf("FAIL round %d, type %d: queued=%u delivered=%u dropped=%u\n", round, type,
+                   queued[type], received[type], delivery.dropped[type]);
+            failed = 1;
+        }
+    }
+    if (delivery.max_depth > DELIVERY_SLOTS) {
+        printf("FAIL round %d: max_depth=%u\n", round, delivery.max_depth);
+        failed = 1;
+    }
+    printf("round %d: locations=%u/%u sv_status=%u/%u xtra=%u/%u dropped=%u,%u,%u max_depth=%u\n",
+           round, received[DELIVER_LOCATION], queued[DELIVER_LOCATION],
+           received[DELIVER_SV_STATUS], queued[DELIVER_SV_STATUS],
+           received[DELIVER_XTRA_REQUEST], queued[DELIVER_XTRA_REQUEST],
+           delivery.dropped[DELIVER_LOCATION], delivery.dropped[DELIVER_SV_STATUS],
+           delivery.dropped[DELIVER_XTRA_REQUEST], delivery.max_depth);
+}
+
+int main( int  argc, char**  argv ) {
+    int  seconds = 1, c, round;
+
+    while ((c = getopt(argc, argv, "s:")) != -1) {
+        switch (c) {
+        case 's': seconds = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (round = 0; round < ROUNDS; round++)
+        round_run(round, seconds * 1000 / ROUNDS);
+
+    if (torn || out_of_order)
+        failed = 1;
+    printf("delivery: rounds=%d torn=%u out_of_order=%u\n", ROUNDS, torn, out_of_order);
+    return failed;
+}
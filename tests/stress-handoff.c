@@ -0,0 +1,245 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/stress-handoff.c
+ *
+ * Runs every thread that hands fixes to the framework at once, as fast as
+ * they go, to be built with -fsanitize=thread ("make tsan"):
+ *
+ * - nmea: a writer floods a FIFO standing in for /dev/smd27 with the
+ *   corpus, parsed and published by gps_state_thread, while predicted
+ *   fixes are ticked out between real ones.
+ * - rpc:  a thread calls update_gps_location() and update_gps_svstatus()
+ *   as the RPC delivery thread does, with PD_DONE, prediction and the
+ *   Kalman filter on, pausing now and then for predictions to go out.
+ *
+ * In both, a control thread keeps stopping (and waiting for the stop),
+ * restarting and reconfiguring the HAL and dumping the debug interface.
+ * In rpc mode, with the filter off, every location is built so that a
+ * mix of two fixes shows: its longitude is twice its latitude, and its
+ * altitude is derived from its timestamp. In both, a prediction must not
+ * be older than the real fix delivered before it; the callback keeps the
+ * last one unlocked, so that TSan also sees the callbacks serialized.
+ *
+ * usage: stress-handoff [-s seconds] log.nmea
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "host-stubs.h"
+#include "leo-gps.c"
+
+static int           running;
+static const char*   log_buf;
+static int           log_len;
+static int           log_fd;
+
+static uint32_t  locations, predicted, torn, sv_statuses, dumps, restarts;
+static uint32_t  failures;
+static uint32_t  overtaken;
+static int64_t   last_real_ts;    // only touched by location_cb
+
+static int is_running( void ) {
+    return __atomic_load_n(&running, __ATOMIC_ACQUIRE);
+}
+
+static void stress_location_cb( GpsLocation*  location ) {
+    __sync_fetch_and_add(&locations, 1);
+    if (location->flags & GPS_LOCATION_IS_PREDICTED) {
+        __sync_fetch_and_add(&predicted, 1);
+        if (location->timestamp < last_real_ts && overtaken++ < 5)
+            printf("FAIL prediction at %lld after a real fix at %lld\n",
+                   (long long)location->timestamp, (long long)last_real_ts);
+        return;
+    }
+    last_real_ts = location->timestamp;
+    // only rpc mode with the filter off builds them this way
+    if (location->flags & GPS_LOCATION_HAS_ACCURACY && location->accuracy == 7.0f &&
+        (location->longitude != 2 * location->latitude ||
+         location->altitude != (double)(location->timestamp % 1000000))) {
+        if (__sync_fetch_and_add(&torn, 1) < 5)
+            printf("FAIL torn fix: lat=%.9f lon=%.9f alt=%.1f ts=%lld\n", location->latitude,
+                   location->longitude, location->altitude, (long long)location->timestamp);
+    }
+}
+
+static void stress_sv_status_cb( GpsSvStatus*  sv_status ) {
+    (void)sv_status;
+    __sync_fetch_and_add(&sv_statuses, 1);
+}
+
+static void stress_status_cb( GpsStatus*  status ) {
+    (void)status;
+}
+
+static void stress_nmea_cb( GpsUtcTime  timestamp, const char*  nmea, int  length ) {
+    (void)timestamp;
+    (void)nmea;
+    (void)length;
+}
+
+static GpsCallbacks  stress_callbacks = {
+    stress_location_cb,
+    stress_status_cb,
+    stress_sv_status_cb,
+    stress_nmea_cb,
+};
+
+static void* nmea_writer( void*  arg ) {
+    (void)arg;
+    while (is_running()) {
+        int  off = 0;
+        while (is_running() && off < log_len) {
+            int  n = write(log_fd, log_buf + off, log_len - off < 4096 ? log_len - off : 4096);
+            if (n <= 0)
+                break;
+            off += n;
+        }
+    }
+    return NULL;
+}
+
+/* what the RPC delivery thread hands to the HAL */
+static void* rpc_delivery( void*  arg ) {
+    GpsSvStatus  sv;
+    int64_t      k = 0;
+
+    (void)arg;
+    memset(&sv, 0, sizeof(sv));
+    while (is_running()) {
+        GpsLocation  fix;
+
+        memset(&fix, 0, sizeof(fix));
+        fix.flags     = GPS_LOCATION_HAS_LAT_LONG | GPS_LOCATION_HAS_ALTITUDE |
+                        GPS_LOCATION_HAS_SPEED | GPS_LOCATION_HAS_BEARING |
+                        GPS_LOCATION_HAS_ACCURACY;
+        fix.timestamp = 1300000000000LL + k * 100;
+        fix.latitude  = 48.0 + k * 1e-6;
+        fix.longitude = 2 * fix.latitude;
+        fix.altitude  = (double)(fix.timestamp % 1000000);
+        fix.speed     = 12.0f;
+        fix.bearing   = 84.0f;
+        fix.accuracy  = 7.0f;
+        update_gps_location(&fix, now_ms());
+
+        if ((k & 3) == 0) {
+            sv.num_svs = 1 + k % GPS_MAX_SVS;
+            sv.sv_list[0].snr = (float)(k % 50);
+            update_gps_svstatus(&sv);
+        }
+        if ((k & 15) == 0)
+            pdsm_pd_callback();
+        // a gap for predicted fixes to be ticked out against real ones
+        if ((k & 255) == 255)
+            usleep(150000);
+        k += 1;
+    }
+    return NULL;
+}
+
+static void* control( void*  arg ) {
+    const GpsInterface*       gps   = gps_get_hardware_interface();
+    const GpsDebugInterface*  debug = gps->get_extension( GPS_DEBUG_INTERFACE );
+    static char               state[8192];
+    int                       n = 0;
+
+    (void)arg;
+    while (is_running()) {
+        usleep(500 + (n % 7) * 300);
+        if (n % 100 == 0) {
+            gps->stop();
+            gps->set_position_mode( GPS_POSITION_MODE_STANDALONE, n / 100 % 2 );
+            gps->start();
+            __sync_fetch_and_add(&restarts, 1);
+        }
+        debug->get_internal_state( state, sizeof(state) );
+        __sync_fetch_and_add(&dumps, 1);
+        n += 1;
+    }
+    return NULL;
+}
+
+static void run( const char*  mode, int  seconds, int  kalman ) {
+    const GpsInterface*  gps = gps_get_hardware_interface();
+    pthread_t            source, ctl;
+    char                 path[64];
+
+    host_conf.prediction_rate = 10;
+    host_conf.kalman_filter   = kalman;
+    locations = predicted = torn = sv_statuses = dumps = restarts = overtaken = 0;
+    last_real_ts = 0;
+
+    if (!strcmp(mode, "nmea")) {
+        snprintf(path, sizeof(path), "/tmp/stress-handoff.%d", (int)getpid());
+        unlink(path);
+        mkfifo(path, 0600);
+        log_fd = open(path, O_RDWR);
+    } else {
+        // no NMEA source
+        snprintf(path, sizeof(path), "/nonexistent");
+        log_fd = -1;
+    }
+    setenv("LEO_GPS_NMEA_DEVICE", path, 1);
+
+    gps->init( &stress_callbacks );
+    gps->set_position_mode( GPS_POSITION_MODE_STANDALONE, 1 );
+    gps->start();
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    pthread_create( &source, NULL, log_fd >= 0 ? nmea_writer : rpc_delivery, NULL );
+    pthread_create( &ctl, NULL, control, NULL );
+    sleep( seconds );
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join( ctl, NULL );
+    // the state thread keeps draining the FIFO until cleanup
+    pthread_join( source, NULL );
+
+    gps->stop();
+    gps->cleanup();
+    if (log_fd >= 0) {
+        close( log_fd );
+        unlink( path );
+    }
+    printf("%s%s: locations=%u predicted=%u sv_status=%u restarts=%u dumps=%u torn=%u overtaken=%u\n",
+           mode, kalman ? "+kalman" : "", locations, predicted, sv_statuses, restarts, dumps, torn,
+           overtaken);
+    failures += torn + overtaken + (locations == 0);
+}
+
+int main( int  argc, char**  argv ) {
+    int    seconds = 2;
+    int    c, len;
+    FILE*  f;
+    char*  buf;
+
+    while ((c = getopt(argc, argv, "s:")) != -1) {
+        if (c == 's')
+            seconds = atoi(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-s seconds] log.nmea\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || (f = fopen(argv[optind], "rb")) == NULL) {
+        fprintf(stderr, "%s: no NMEA log given\n", argv[0]);
+        return 1;
+    }
+    buf = malloc(1 << 20);
+    len = fread(buf, 1, 1 << 20, f);
+    fclose(f);
+    log_buf = buf;
+    log_len = len;
+
+    run( "nmea", seconds, 0 );
+    run( "rpc", seconds, 0 );
+    run( "rpc", seconds, 2 );
+    free(buf);
+    return failures != 0;
+}
@@ -0,0 +1,23 @@
+/* host stand-in for <cutils/log.h>: errors and warnings go to stderr,
+ * debug output only with -DHOST_VERBOSE.
+ */
+#ifndef _HOST_CUTILS_LOG_H
+#define _HOST_CUTILS_LOG_H
+
+#include <stdio.h>
+
+#define  HOST_LOG(...)  (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+
+#define  LOGE(...)  HOST_LOG(__VA_ARGS__)
+#define  LOGW(...)  HOST_LOG(__VA_ARGS__)
+#ifdef HOST_VERBOSE
+#  define  LOGI(...)  HOST_LOG(__VA_ARGS__)
+#  define  LOGD(...)  HOST_LOG(__VA_ARGS__)
+#  define  LOGV(...)  HOST_LOG(__VA_ARGS__)
+#else
+#  define  LOGI(...)  ((void)0)
+#  define  LOGD(...)  ((void)0)
+#  define  LOGV(...)  ((void)0)
+#endif
+
+#endif
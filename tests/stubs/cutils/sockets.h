@@ -0,0 +1,7 @@
+/* host stand-in for <cutils/sockets.h> */
+#ifndef _HOST_CUTILS_SOCKETS_H
+#define _HOST_CUTILS_SOCKETS_H
+
+#include <sys/socket.h>
+
+#endif
@@ -0,0 +1,82 @@
+/* host stand-in for librpc's <rpc/rpc.h>: the part of the ONC RPC client,
+ * XDR and router server API that leo-gps-rpc.c uses. it is served by
+ * fake-router.c, over socketpairs instead of /dev/oncrpc.
+ *
+ * struct SVCXPRT is left opaque: leo-gps-rpc.c declares its own, and only
+ * relies on a registered server starting with its XDR pointer.
+ */
+#ifndef _HOST_LIBRPC_RPC_H
+#define _HOST_LIBRPC_RPC_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+typedef int       bool_t;
+typedef uint32_t  rpcprog_t;
+typedef uint32_t  rpcvers_t;
+typedef uint32_t  rpcproc_t;
+
+enum xdr_op { XDR_ENCODE = 0, XDR_DECODE = 1, XDR_FREE = 2 };
+
+typedef struct XDR {
+    enum xdr_op      x_op;
+    uint32_t*        in_msg;    // a received message, network byte order
+    int              in_len;    // its length in bytes
+    int              in_pos;    // next byte to decode
+    unsigned char*   out_msg;   // the message being encoded
+    int              out_len;
+    int              out_size;
+} XDR;
+
+/* unprototyped, as in librpc: the HAL passes its own argument structs */
+typedef bool_t (*xdrproc_t)();
+
+enum clnt_stat {
+    RPC_SUCCESS     = 0,
+    RPC_CANTENCODEARGS = 1,
+    RPC_CANTDECODERES  = 2,
+    RPC_CANTSEND    = 3,
+    RPC_CANTRECV    = 4,
+    RPC_TIMEDOUT    = 5,
+    RPC_SYSTEMERROR = 12,
+};
+
+struct CLIENT;
+struct svc_req;
+typedef struct SVCXPRT SVCXPRT;
+typedef void (*__dispatch_fn_t)(struct svc_req*, SVCXPRT*);
+
+bool_t xdr_u_long( XDR*  xdrs, void*  v );
+bool_t xdr_int( XDR*  xdrs, void*  v );
+bool_t xdr_u_char( XDR*  xdrs, void*  v );
+bool_t xdr_u_short( XDR*  xdrs, void*  v );
+bool_t xdr_u_quad_t( XDR*  xdrs, void*  v );
+bool_t xdr_opaque( XDR*  xdrs, caddr_t  p, u_int  len );
+bool_t xdr_bytes( XDR*  xdrs, char**  p, u_int*  len, u_int  max );
+bool_t xdr_pointer( XDR*  xdrs, char**  p, u_int  size, xdrproc_t  proc );
+
+/* reads the next word of a reply */
+bool_t xdr_recv_uint32( XDR*  xdrs, uint32_t*  v );
+#define  XDR_RECV_UINT32(xdrs, v)  xdr_recv_uint32((xdrs), (uint32_t*)(v))
+
+struct CLIENT* clnt_create( char*  host, uint32_t  prog, uint32_t  vers, char*  proto );
+void           clnt_destroy( struct CLIENT*  clnt );
+/* a macro in librpc, which takes any argument and result pointers */
+enum clnt_stat host_clnt_call( struct CLIENT*  clnt, uint32_t  proc, xdrproc_t  xargs, void*  argsp,
+                               xdrproc_t  xres, void*  resp, struct timeval  timeout );
+#define  clnt_call(clnt, proc, xargs, argsp, xres, resp, timeout) \
+    host_clnt_call((clnt), (proc), (xdrproc_t)(xargs), (void*)(argsp), \
+                   (xdrproc_t)(xres), (void*)(resp), (timeout))
+
+SVCXPRT* svcrtr_create( void );
+void     svc_destroy( SVCXPRT*  xprt );
+void     xprt_register( SVCXPRT*  xprt );
+void     xprt_unregister( SVCXPRT*  xprt );
+bool_t   svc_register( SVCXPRT*  xprt, uint32_t  prog, uint32_t  vers,
+                       __dispatch_fn_t  dispatch, uint32_t  protocol );
+void     svc_unregister( SVCXPRT*  xprt, uint32_t  prog, uint32_t  vers );
+/* the HAL passes the registered server the dispatch was called with */
+bool_t   svc_sendreply( void*  xprt, xdrproc_t  xres, void*  result );
+
+#endif
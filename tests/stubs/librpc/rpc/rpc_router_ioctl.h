@@ -0,0 +1,6 @@
+/* host stand-in for librpc's <rpc/rpc_router_ioctl.h>: the HAL doesn't
+ * use the router ioctls, only includes them.
+ */
+#ifndef _HOST_LIBRPC_RPC_ROUTER_IOCTL_H
+#define _HOST_LIBRPC_RPC_ROUTER_IOCTL_H
+#endif
@@ -0,0 +1,175 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/test-epoch.c
+ *
+ * Checks that fixes are published once per epoch for receivers sending
+ * GGA and RMC, GGA only or RMC only, and that a lost RMC costs at most
+ * its own epoch's fix. Also checks that the SVs of a talker which stops
+ * sending GSV, or sends one with no SVs, are dropped from the SV status,
+ * that GSAs are grouped by the constellation of their first PRN, and that
+ * only GPS and SBAS SVs reach the legacy SV status.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "host-stubs.h"
+#include "leo-gps.c"
+
+#define  EPOCHS  10
+
+static int          fixes;
+static GpsLocation  last;
+static int          failed;
+
+static void test_location_cb( GpsLocation*  location ) {
+    fixes += 1;
+    last   = *location;
+}
+
+static GpsCallbacks  test_callbacks = { test_location_cb, NULL, NULL, NULL };
+
+static void feed( const char*  fmt, ... ) {
+    char     body[128], line[140];
+    va_list  args;
+    int      n, sum = 0;
+
+    va_start(args, fmt);
+    vsnprintf(body, sizeof(body), fmt, args);
+    va_end(args);
+    for (n = 0; body[n]; n++)
+        sum ^= (unsigned char)body[n];
+    n = snprintf(line, sizeof(line), "$%s*%02X\r\n", body, sum);
+    nmea_reader_addbuf( &_gps_state->reader, line, n );
+}
+
+static void feed_gga( int  sec ) {
+    feed("GPGGA,1200%02d.00,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,", sec);
+}
+
+static void feed_rmc( int  sec ) {
+    feed("GPRMC,1200%02d.00,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W", sec);
+}
+
+static void reset( void ) {
+    GpsState*  s = _gps_state;
+
+    s->started       = 1;
+    s->publish_timer = -1;
+    s->predict_timer = -1;
+    s->callbacks     = test_callbacks;
+    nmea_reader_init( &s->reader );
+    fixes = 0;
+    memset( &last, 0, sizeof(last) );
+}
+
+static void expect_svs( const char*  test, int  want_svs, int  want_legacy_svs,
+                        uint32_t  want_ephemeris, uint32_t  want_almanac ) {
+    NmeaReader*  r = &_gps_state->reader;
+    int          n, glonass = 0;
+
+    // legacy clients would take a GLONASS PRN for a GPS one
+    for (n = 0; n < r->sv_status.num_svs; n++)
+        glonass += r->sv_status.sv_list[n].prn > 64;
+    if (r->ext_sv_status.num_svs != want_svs || r->sv_status.num_svs != want_legacy_svs ||
+        glonass || r->sv_status.ephemeris_mask != want_ephemeris ||
+        r->sv_status.almanac_mask != want_almanac) {
+        printf("FAIL %s: svs=%d (want %d) legacy=%d (want %d, %d GLONASS) ephemeris=0x%x "
+               "(want 0x%x) almanac=0x%x (want 0x%x)\n", test, r->ext_sv_status.num_svs,
+               want_svs, r->sv_status.num_svs, want_legacy_svs, glonass,
+               r->sv_status.ephemeris_mask, want_ephemeris, r->sv_status.almanac_mask,
+               want_almanac);
+        failed += 1;
+    } else
+        printf("ok %s: svs=%d legacy=%d\n", test, want_svs, want_legacy_svs);
+}
+
+static void expect( const char*  test, int  want_fixes, int  last_sec, int  last_flags ) {
+    GpsUtcTime  want_ts = last.timestamp - last.timestamp % 86400000 + (12 * 3600 + last_sec) * 1000;
+
+    if (fixes != want_fixes || last.timestamp != want_ts || (last.flags & last_flags) != last_flags) {
+        printf("FAIL %s: fixes=%d (want %d) last=%lld (want %lld) flags=0x%x (want 0x%x)\n", test,
+               fixes, want_fixes, (long long)last.timestamp, (long long)want_ts, last.flags, last_flags);
+        failed += 1;
+    } else
+        printf("ok %s: fixes=%d\n", test, fixes);
+}
+
+int main( void ) {
+    int  sec;
+
+    nmea_dispatch_init();
+
+    // the first epoch goes out on GGA, before RMC is known to come
+    reset();
+    for (sec = 0; sec < EPOCHS; sec++) {
+        feed_gga(sec);
+        feed_rmc(sec);
+    }
+    expect("gga+rmc", EPOCHS, EPOCHS - 1, GPS_LOCATION_HAS_SPEED | GPS_LOCATION_HAS_ALTITUDE);
+
+    reset();
+    for (sec = 0; sec < EPOCHS; sec++)
+        feed_gga(sec);
+    expect("gga only", EPOCHS, EPOCHS - 1, GPS_LOCATION_HAS_ALTITUDE);
+
+    reset();
+    for (sec = 0; sec < EPOCHS; sec++)
+        feed_rmc(sec);
+    expect("rmc only", EPOCHS, EPOCHS - 1, GPS_LOCATION_HAS_SPEED);
+
+    // epoch 5 has no fix; epoch 6 goes out on GGA, then RMC is waited for again
+    reset();
+    for (sec = 0; sec < EPOCHS; sec++) {
+        feed_gga(sec);
+        if (sec != 5)
+            feed_rmc(sec);
+    }
+    expect("lost rmc", EPOCHS - 1, EPOCHS - 1, GPS_LOCATION_HAS_SPEED | GPS_LOCATION_HAS_ALTITUDE);
+
+    // GSA and GSV in between don't end an epoch
+    reset();
+    for (sec = 0; sec < EPOCHS; sec++) {
+        feed_gga(sec);
+        feed("GPGSA,A,3,04,05,09,12,,,,,,,,,2.5,1.3,2.1");
+        feed("GPGSV,1,1,04,04,40,083,40,05,17,308,41,09,07,344,39,12,60,123,44");
+        feed_rmc(sec);
+    }
+    expect("gga+gsa+gsv+rmc", EPOCHS, EPOCHS - 1, GPS_LOCATION_HAS_SPEED | GPS_LOCATION_HAS_ALTITUDE);
+
+    // GLONASS goes quiet after the first epoch, GPS reports no SVs at the end
+    reset();
+    for (sec = 0; sec < 3 * EPOCHS; sec++) {
+        feed_gga(sec);
+        feed("GPGSA,A,3,04,05,,,,,,,,,,,2.5,1.3,2.1");
+        feed("GPGSV,1,1,03,04,40,083,40,05,17,308,41,09,,,39");
+        if (sec == 0)
+            feed("GLGSV,1,1,02,65,40,083,40,66,17,308,41");
+        feed_rmc(sec);
+        if (sec == 0)
+            expect_svs("gsv", 5, 3, 0x18, 0x18);
+    }
+    expect_svs("stale gsv", 3, 3, 0x18, 0x18);
+    feed("GPGSV,1,1,00");
+    expect_svs("empty gsv", 0, 0, 0x18, 0x18);
+
+    // the first PRN field of a GN GSA is empty: the set is still told apart
+    // by the constellation of its first PRN, a GLONASS GSA doesn't end it
+    reset();
+    feed("GNGSA,A,3,,04,05,,,,,,,,,,2.5,1.3,2.1");
+    feed("GNGSA,A,3,,70,,,,,,,,,,,2.5,1.3,2.1");
+    feed("GPGSV,1,1,03,04,40,083,40,05,17,308,41,09,,,39");
+    expect_svs("gsa, empty first prn", 3, 3, 0x18, 0x18);
+    feed("GNGSA,A,3,,09,,,,,,,,,,,2.5,1.3,2.1");
+    expect_svs("gsa, next set", 3, 3, 0x100, 0x118);
+    feed("GPGSA,A,1,,,,,,,,,,,,,,,");
+    expect_svs("gsa, no fix", 3, 3, 0, 0x18);
+
+    return failed != 0;
+}
@@ -0,0 +1,90 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/test-filter.c
+ *
+ * Checks the Kalman filter stage: a repeated fix is dropped, extrapolated
+ * output leaves the filter state at the fix's time and is ahead by how
+ * long the fix was held, whatever the GPS time, a speed without a bearing
+ * doesn't seed a velocity, and a requested reset is done on the next fix.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include "leo-gps-filter.c"
+
+static int  failed;
+
+static void check( const char*  test, int  ok ) {
+    if (!ok) {
+        printf("FAIL %s\n", test);
+        failed += 1;
+    } else
+        printf("ok %s\n", test);
+}
+
+static int64_t mono_ms( void ) {
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* a receiver heading north at 10 m/s, one fix a second */
+static GpsLocation make_fix( int64_t  timestamp, int  sec, uint16_t  flags ) {
+    GpsLocation  fix;
+
+    memset(&fix, 0, sizeof(fix));
+    fix.flags     = flags;
+    fix.timestamp = timestamp;
+    fix.latitude  = 48.0 + sec * 10.0 / EARTH_RADIUS / DEG2RAD;
+    fix.longitude = 11.0;
+    fix.speed     = 10.0f;
+    fix.bearing   = 0.0f;
+    fix.accuracy  = 5.0f;
+    return fix;
+}
+
+int main( void ) {
+    const uint16_t  all = GPS_LOCATION_HAS_LAT_LONG | GPS_LOCATION_HAS_SPEED |
+                          GPS_LOCATION_HAS_BEARING | GPS_LOCATION_HAS_ACCURACY;
+    // GPS time, years off the system clock
+    int64_t         t0 = 1300000000000LL;
+    int64_t         ts, held;
+    GpsLocation     fix;
+    uint32_t        resets;
+    int             sec;
+
+    for (sec = 0; sec < 5; sec++) {
+        fix = make_fix(t0 + sec * 1000, sec, all);
+        gps_filter_update(&fix, mono_ms(), 0);
+    }
+    fix = make_fix(t0 + 4000, 4, all);
+    check("repeated fix dropped", gps_filter_update(&fix, mono_ms(), 0) == 0 && filter.valid);
+
+    // received 500 ms ago: extrapolated by that, but the state stays at the fix
+    ts   = t0 + 5000;
+    fix  = make_fix(ts, 5, all);
+    gps_filter_update(&fix, mono_ms() - 500, 1);
+    held = fix.timestamp - ts;
+    check("extrapolated output", held >= 500 && held < 600 && filter.extrapolations == 1);
+    check("extrapolated position", fix.latitude > make_fix(ts, 5, all).latitude);
+    check("state at fix time", filter.time_ms == ts);
+    fix = make_fix(ts + 1000, 6, all);
+    resets = filter.resets;
+    check("next fix filtered", gps_filter_update(&fix, mono_ms(), 1) && filter.resets == resets);
+    check("fresh fix barely extrapolated", fix.timestamp - (ts + 1000) < 100);
+
+    gps_filter_reset();
+    check("reset deferred", filter.valid);
+    fix = make_fix(filter.time_ms + 1000, 7, all & ~GPS_LOCATION_HAS_BEARING);
+    gps_filter_update(&fix, mono_ms(), 0);
+    check("reset on next fix", filter.resets == resets + 1);
+    check("no velocity without bearing", filter.axis[0].v == 0 && filter.axis[1].v == 0);
+
+    return failed != 0;
+}
@@ -0,0 +1,370 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/test-rpc.c
+ *
+ * Runs the RPC side of the HAL against the loopback router of
+ * fake-router.c: checks that init sets up the PDSM clients, the worker
+ * and the delivery thread, that gps_get_position() returns without
+ * waiting for the round-trip and that its session ends with PD_DONE, that
+ * XTRA data goes out in order with the largest block size the modem
+ * takes, failing only on transport errors, that what isn't XTRA data is
+ * refused, from memory or from a file, and that a failed init is
+ * reported to gps_init() and undoes what it set up, so that a later init
+ * can succeed.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "fake-router.h"
+#include "leo-gps-rpc.c"
+
+#define  LATENCY_NS  (20 * 1000000LL)
+
+extern const GpsInterface* gps_get_hardware_interface();
+
+static int             failed;
+static FakeRouterConf  conf = { LATENCY_NS, LATENCY_NS, NULL };
+static uint32_t        statuses[8];
+
+static void test_status_cb( GpsStatus*  status ) {
+    if (status->status < 8)
+        __sync_fetch_and_add(&statuses[status->status], 1);
+}
+
+static GpsCallbacks  test_callbacks = { NULL, test_status_cb, NULL, NULL };
+
+static int64_t test_now_ns( void ) {
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void expect( const char*  test, int  ok, const char*  what ) {
+    if (!ok) {
+        printf("FAIL %s: %s\n", test, what);
+        failed = 1;
+    } else
+        printf("ok %s: %s\n", test, what);
+}
+
+/* the modem refuses to set up the XTRA client */
+static enum clnt_stat no_xtra_modem( const FakeCall*  call, uint32_t*  result ) {
+    if (call->proc == FAKE_PROC_CLIENT_INIT && call->words > 0 && ntohl(call->args[0]) == 0xb)
+        return RPC_SYSTEMERROR;
+    return fake_router_modem(call, result);
+}
+
+/* the XTRA parts the modem got, with the status to answer them with */
+#define  XTRA_LOG  512
+
+static struct {
+    pthread_mutex_t  lock;
+    int              parts;
+    uint32_t         part[ XTRA_LOG ];
+    uint32_t         total[ XTRA_LOG ];
+    uint32_t         len[ XTRA_LOG ];
+    uint32_t         max_len;       // longer parts fail in transport
+    uint32_t         fail_part;     // fails in transport
+    uint32_t         status_part;   // answered with status
+    uint32_t         status;
+    uint32_t         hash;          // of the bytes of the accepted parts
+} xtra = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t fnv( uint32_t  hash, const unsigned char*  p, uint32_t  len ) {
+    while (len--)
+        hash = (hash ^ *p++) * 16777619;
+    return hash;
+}
+
+static enum clnt_stat xtra_modem( const FakeCall*  call, uint32_t*  result ) {
+    uint32_t        len, part, total;
+    enum clnt_stat  stat = RPC_SUCCESS;
+
+    if (call->proc != FAKE_PROC_XTRA_SET_DATA)
+        return fake_router_modem(call, result);
+
+    // val0, client, val2, part_len, the bytes, part, total_parts, val3
+    len   = ntohl(call->args[3]);
+    part  = ntohl(call->args[5 + (len + 3) / 4]);
+    total = ntohl(call->args[6 + (len + 3) / 4]);
+    *result = 0;
+
+    pthread_mutex_lock(&xtra.lock);
+    if (xtra.parts < XTRA_LOG) {
+        xtra.part[xtra.parts]  = part;
+        xtra.total[xtra.parts] = total;
+        xtra.len[xtra.parts]   = len;
+        xtra.parts += 1;
+    }
+    if (len > xtra.max_len || part == xtra.fail_part)
+        stat = RPC_SYSTEMERROR;
+    else if (part == xtra.status_part)
+        *result = xtra.status;
+    if (stat == RPC_SUCCESS)
+        xtra.hash = fnv(xtra.hash, (const unsigned char*)&call->args[5], len);
+    pthread_mutex_unlock(&xtra.lock);
+    return stat;
+}
+
+static void xtra_reset( uint32_t  max_len, uint32_t  fail_part, uint32_t  status_part, uint32_t  status ) {
+    pthread_mutex_lock(&xtra.lock);
+    xtra.parts       = 0;
+    xtra.max_len     = max_len;
+    xtra.fail_part   = fail_part;
+    xtra.status_part = status_part;
+    xtra.status      = status;
+    xtra.hash        = 2166136261u;
+    pthread_mutex_unlock(&xtra.lock);
+}
+
+static uint32_t xtra_len( int  n ) {
+    uint32_t  len;
+
+    pthread_mutex_lock(&xtra.lock);
+    len = n < xtra.parts ? xtra.len[n] : 0;
+    pthread_mutex_unlock(&xtra.lock);
+    return len;
+}
+
+static uint32_t xtra_hash( void ) {
+    uint32_t  hash;
+
+    pthread_mutex_lock(&xtra.lock);
+    hash = xtra.hash;
+    pthread_mutex_unlock(&xtra.lock);
+    return hash;
+}
+
+static int xtra_parts( void ) {
+    int  parts;
+
+    pthread_mutex_lock(&xtra.lock);
+    parts = xtra.parts;
+    pthread_mutex_unlock(&xtra.lock);
+    return parts;
+}
+
+/* checks that parts first..total went out in order, after 'probes' part 1s
+ * that failed, and that together they carry length bytes */
+static int xtra_in_order( int  probes, uint32_t  length ) {
+    uint32_t  sent = 0;
+    int       n, ok = 1;
+
+    pthread_mutex_lock(&xtra.lock);
+    for (n = probes; n < xtra.parts; n++) {
+        ok = ok && xtra.part[n] == (uint32_t)(n - probes + 1) && xtra.total[n] == xtra.total[probes];
+        sent += xtra.len[n];
+    }
+    for (n = 0; n < probes; n++)
+        ok = ok && xtra.part[n] == 1;
+    ok = ok && sent == length && xtra.parts - probes == (int)xtra.total[probes];
+    pthread_mutex_unlock(&xtra.lock);
+    return ok;
+}
+
+static void test_xtra( void ) {
+    static unsigned char  data[ 50000 ];
+    uint32_t              n;
+    int                   result;
+
+    for (n = 0; n < sizeof(data); n++)
+        data[n] = (unsigned char)(n * 7 + n / 251);
+    conf.modem      = xtra_modem;
+    conf.latency_ns = 0;
+    fake_router_configure(&conf);
+
+    // the modem takes at most 1024 bytes a part: 2048 is tried on part 1 only
+    xtra_reset(1024, 0, 0, 0);
+    result = gps_xtra_inject(data, sizeof(data));
+    expect("xtra probe", result == 0, "injected");
+    expect("xtra probe", xtra_len(0) == 2048 && xtra_len(1) == 1024,
+           "part 1 sent again with 1024 bytes");
+    expect("xtra probe", xtra_in_order(1, sizeof(data)), "then every part, in order");
+
+    // the block size is known now
+    xtra_reset(1024, 0, 0, 0);
+    result = gps_xtra_inject(data, sizeof(data));
+    expect("xtra known", result == 0 && xtra_len(0) == 1024, "starts with 1024 byte parts");
+    expect("xtra known", xtra_in_order(0, sizeof(data)), "every part, in order");
+
+    // a status on a part before the last doesn't stop the injection
+    xtra_reset(1024, 0, 2, 5);
+    result = gps_xtra_inject(data, sizeof(data));
+    expect("xtra status", result == 0 && xtra_in_order(0, sizeof(data)),
+           "status of part 2 ignored, every part sent");
+    xtra_reset(1024, 0, 49, 7);
+    result = gps_xtra_inject(data, sizeof(data));
+    expect("xtra status", result == 7, "status of the last part returned");
+
+    // a transport error does
+    xtra_reset(1024, 3, 0, 0);
+    result = gps_xtra_inject(data, sizeof(data));
+    expect("xtra transport", result == EINVAL && xtra_parts() == 3, "stops at the failed part");
+
+    conf.modem      = NULL;
+    conf.latency_ns = LATENCY_NS;
+    fake_router_configure(&conf);
+}
+
+/* writes size bytes of data to a file, and returns it open */
+static int xtra_file( const char*  data, int  size ) {
+    char  path[] = "/tmp/test-rpc.XXXXXX";
+    int   fd = mkstemp(path);
+
+    if (fd < 0 || write(fd, data, size) != size) {
+        printf("FAIL could not write %s\n", path);
+        exit(1);
+    }
+    unlink(path);
+    return fd;
+}
+
+static void test_xtra_checks( const GpsInterface*  gps ) {
+    const GpsXtraInterface*      xtra_data = gps->get_extension(GPS_XTRA_INTERFACE);
+    const GpsXtraFileInterface*  xtra_file_iface = gps->get_extension(GPS_XTRA_FILE_INTERFACE);
+    static char                  data[ 50000 ], page[ 5000 ], zeros[ 5000 ];
+    int                          n, fd, result;
+
+    for (n = 0; n < (int)sizeof(data); n++)
+        data[n] = (char)(n * 7 + n / 251 + 1);
+    memset(page, ' ', sizeof(page));
+    memcpy(page, "<html><body>no network</body></html>", 37);
+
+    conf.modem      = xtra_modem;
+    conf.latency_ns = 0;
+    fake_router_configure(&conf);
+
+    // from memory: what a failed download leaves isn't injected
+    xtra_reset(2048, 0, 0, 0);
+    result = xtra_data->inject_xtra_data(page, sizeof(page));
+    expect("xtra checks", result == EINVAL && xtra_parts() == 0, "error page refused");
+    result = xtra_data->inject_xtra_data(zeros, sizeof(zeros));
+    expect("xtra checks", result == EINVAL && xtra_parts() == 0, "zeroed data refused");
+    result = xtra_data->inject_xtra_data(data, 500);
+    expect("xtra checks", result == EINVAL && xtra_parts() == 0, "short data refused");
+
+    // from a file, a part at a time
+    fd = xtra_file(data, sizeof(data));
+    result = xtra_file_iface->inject_xtra_fd(fd);
+    expect("xtra file", result == 0 && xtra_in_order(0, sizeof(data)), "every part, in order");
+    expect("xtra file", xtra_hash() == fnv(2166136261u, (unsigned char*)data, sizeof(data)),
+           "the bytes of the file");
+    close(fd);
+
+    xtra_reset(2048, 0, 0, 0);
+    fd = xtra_file(page, sizeof(page));
+    result = xtra_file_iface->inject_xtra_fd(fd);
+    expect("xtra file", result == EINVAL && xtra_parts() == 0, "error page refused before part 1");
+    close(fd);
+
+    // only known to be zeroed once the last part is read
+    xtra_reset(1024, 0, 0, 0);
+    fd = xtra_file(zeros, sizeof(zeros));
+    result = xtra_file_iface->inject_xtra_fd(fd);
+    expect("xtra file", result == EINVAL && xtra_parts() == 4, "zeroed file refused before the last part");
+    close(fd);
+
+    xtra_reset(2048, 0, 0, 0);
+    fd = xtra_file(data, 500);
+    result = xtra_file_iface->inject_xtra_fd(fd);
+    expect("xtra file", result == EINVAL && xtra_parts() == 0, "short file refused");
+    close(fd);
+
+    conf.modem      = NULL;
+    conf.latency_ns = LATENCY_NS;
+    fake_router_configure(&conf);
+}
+
+static int torn_down( void ) {
+    return !_clnt && !_clnt_atl && !_svc && !rpc_async.client && !delivery.running;
+}
+
+static void test_init( const GpsInterface*  gps ) {
+    FakeRouterStats  stats;
+
+    fake_router_stats_reset();
+    expect("init", gps->init(&test_callbacks) == 0, "gps_init() succeeds");
+    fake_router_stats_get(&stats);
+    expect("init", _clnt && _clnt_atl && _svc, "clients and server created");
+    expect("init", rpc_async.client && delivery.running, "worker and delivery thread running");
+    expect("init", stats.clients == 3, "one CLIENT each for the calls, ATL and the worker");
+    expect("init", stats.calls[FAKE_PROC_CLIENT_INIT] == 3, "PDA, XTRA and NI clients set up");
+    expect("init", client_IDs[2] == 0x102 && client_IDs[0xb] == 0x10b && client_IDs[4] == 0x104,
+           "client ids kept");
+}
+
+static void test_get_position( void ) {
+    FakeRouterStats  stats;
+    int64_t          start, took;
+    int              result;
+
+    fake_router_stats_reset();
+    start = test_now_ns();
+    gps_get_position();
+    took = test_now_ns() - start;
+    printf("gps_get_position() returned in %lld us, round-trip %lld us\n",
+           (long long)(took / 1000), (long long)(LATENCY_NS / 1000));
+    expect("get position", took < LATENCY_NS / 2, "doesn't wait for the round-trip");
+
+    result = rpc_async_wait(get_position_xid);
+    fake_router_wait_idle();
+    fake_router_stats_get(&stats);
+    expect("get position", result == 0, "request answered");
+    expect("get position", stats.calls[FAKE_PROC_GET_POSITION] == 1, "one request sent");
+    expect("get position", stats.events == 1 && stats.acks == 1, "PD_DONE dispatched and acked");
+    expect("get position", dispatch_stats.pd_events >= 1, "PD_DONE decoded");
+
+    start = test_now_ns();
+    exit_gps_rpc();
+    took = test_now_ns() - start;
+    expect("get position", took < LATENCY_NS / 2, "end session doesn't wait for the round-trip");
+    wait_gps_rpc_exit();
+    fake_router_stats_get(&stats);
+    expect("get position", stats.calls[FAKE_PROC_END_SESSION] == 1, "session ended");
+}
+
+static void test_cleanup( const GpsInterface*  gps ) {
+    gps->cleanup();
+    expect("cleanup", torn_down(), "everything released");
+}
+
+static void test_init_failure( const GpsInterface*  gps ) {
+    FakeRouterStats  stats;
+
+    conf.modem = no_xtra_modem;
+    fake_router_configure(&conf);
+    fake_router_stats_reset();
+    expect("init failure", gps->init(&test_callbacks) != 0, "gps_init() fails");
+    fake_router_stats_get(&stats);
+    expect("init failure", stats.failed == 1, "failed at the XTRA client");
+    expect("init failure", torn_down(), "clients, server, worker and delivery thread released");
+    conf.modem = NULL;
+    fake_router_configure(&conf);
+
+    test_init(gps);
+    test_cleanup(gps);
+}
+
+int main( void ) {
+    const GpsInterface*  gps = gps_get_hardware_interface();
+
+    // no NMEA source
+    setenv("LEO_GPS_NMEA_DEVICE", "/nonexistent", 1);
+    fake_router_configure(&conf);
+
+    test_init(gps);
+    test_get_position();
+    test_xtra();
+    test_xtra_checks(gps);
+    test_cleanup(gps);
+    test_init_failure(gps);
+
+    return failed != 0;
+}
@@ -0,0 +1,170 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/test-str2float.c
+ *
+ * Checks that str2float() returns bit for bit what strtod() returns for
+ * the same field: every fixed point value up to 999999.999, and millions
+ * of random fields made of digits, signs, points, exponents and junk,
+ * up to the 15 characters str2float() accepts. With -b, benchmarks it
+ * against the copy-and-strtod() it replaced.
+ *
+ * usage: test-str2float [-b] [-n random fields]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "host-stubs.h"
+#include "leo-gps.c"
+
+static uint32_t  rng = 2463534242u;
+
+static uint32_t xorshift( void ) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static uint32_t  checked, failed;
+
+static void check( const char*  field, int  len ) {
+    char    temp[32];
+    double  want, got;
+
+    memcpy(temp, field, len);
+    temp[len] = 0;
+    want = strtod(temp, NULL);
+    got  = str2float(field, field + len);
+    checked += 1;
+    if (memcmp(&want, &got, sizeof(want)) != 0) {
+        if (failed++ < 20)
+            printf("FAIL '%s': strtod=%.17g str2float=%.17g\n", temp, want, got);
+    }
+}
+
+static void check_fixed_point( void ) {
+    char  field[32];
+    int   n, len;
+
+    for (n = 0; n <= 999999999; n += (n < 1000000 ? 1 : 997)) {
+        len = snprintf(field, sizeof(field), "%d.%03d", n / 1000, n % 1000);
+        check(field, len);
+        len = snprintf(field, sizeof(field), "%07.3f", n / 1000 + (n % 1000) / 1000.0);
+        check(field, len);
+        len = snprintf(field, sizeof(field), "-%d", n);
+        check(field, len);
+    }
+}
+
+/* fields shaped like NMEA ones most of the time, anything else sometimes */
+static void check_random( uint32_t  count ) {
+    static const char  digits[] = "0123456789";
+    static const char  junk[]   = "0123456789.-+eExX ,*";
+    char      field[16];
+    uint32_t  n;
+
+    for (n = 0; n < count; n++) {
+        uint32_t  r    = xorshift();
+        int       len  = 1 + r % 15;
+        int       dot  = (r >> 4) % (len + 2);
+        int       odd  = (r >> 12) % 8 == 0;
+        int       k;
+
+        for (k = 0; k < len; k++) {
+            uint32_t  c = xorshift();
+            if (odd)
+                field[k] = junk[c % (sizeof(junk) - 1)];
+            else
+                field[k] = digits[c % 10];
+        }
+        if (!odd && dot < len)
+            field[dot] = '.';
+        if (!odd && (r >> 16) % 4 == 0)
+            field[0] = (r >> 18) & 1 ? '-' : '+';
+        check(field, len);
+    }
+}
+
+/* what str2float() did before: copy the field and call strtod() */
+static double str2float_strtod( const char*  p, const char*  end ) {
+    int   len = end - p;
+    char  temp[16];
+
+    if (len >= (int)sizeof(temp))
+        return 0.;
+    memcpy(temp, p, len);
+    temp[len] = 0;
+    return strtod(temp, NULL);
+}
+
+/* the numeric fields of the sentences of a corpus epoch */
+static const char* const  bench_fields[] = {
+    "235000.00", "4807.0380", "01131.0020", "0.9", "545.4", "46.9",
+    "1.8", "0.9", "1.5", "023.3", "084.4", "003.1",
+    "10", "000", "25", "27", "047", "34", "44", "094", "36",
+};
+
+#define  BENCH_FIELDS  (sizeof(bench_fields) / sizeof(bench_fields[0]))
+#define  BENCH_ROUNDS  200000
+
+static void bench( void ) {
+    const char*  end[BENCH_FIELDS];
+    volatile double  sink = 0;
+    int64_t      t_fast = INT64_MAX, t_strtod = INT64_MAX;
+    unsigned     n, k, pass;
+
+    for (n = 0; n < BENCH_FIELDS; n++)
+        end[n] = bench_fields[n] + strlen(bench_fields[n]);
+
+    for (pass = 0; pass < 5; pass++) {
+        int64_t  t0 = now_ns(), t;
+        for (k = 0; k < BENCH_ROUNDS; k++)
+            for (n = 0; n < BENCH_FIELDS; n++)
+                sink += str2float(bench_fields[n], end[n]);
+        t = now_ns() - t0;
+        if (t < t_fast)
+            t_fast = t;
+
+        t0 = now_ns();
+        for (k = 0; k < BENCH_ROUNDS; k++)
+            for (n = 0; n < BENCH_FIELDS; n++)
+                sink += str2float_strtod(bench_fields[n], end[n]);
+        t = now_ns() - t0;
+        if (t < t_strtod)
+            t_strtod = t;
+    }
+    printf("bench: str2float ns_per_field=%.1f strtod ns_per_field=%.1f speedup=%.1fx\n",
+           (double)t_fast / (BENCH_ROUNDS * BENCH_FIELDS),
+           (double)t_strtod / (BENCH_ROUNDS * BENCH_FIELDS),
+           (double)t_strtod / t_fast);
+}
+
+int main( int  argc, char**  argv ) {
+    uint32_t  count = 5000000;
+    int       c;
+
+    while ((c = getopt(argc, argv, "bn:")) != -1) {
+        if (c == 'b') {
+            bench();
+            return 0;
+        } else if (c == 'n')
+            count = strtoul(optarg, NULL, 10);
+        else {
+            fprintf(stderr, "usage: %s [-b] [-n random fields]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    check_fixed_point();
+    check_random( count );
+    printf("str2float: checked=%u failed=%u\n", checked, failed);
+    return failed != 0;
+}
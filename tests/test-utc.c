@@ -0,0 +1,105 @@
+/******************************************************************************
+ * GPS HAL (hardware abstraction layer) for HD2/Leo
+ *
+ * tests/test-utc.c
+ *
+ * Sweeps every second of several years through the NMEA time handling,
+ * in the order a receiver sends them: a GGA with the time only, then a
+ * RMC with the date and time. After each sentence the fix timestamp
+ * must be what timegm() gives for that date and time, including the GGA
+ * just after midnight that arrives before the RMC with the new date.
+ *
+ * usage: test-utc [year ...]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "host-stubs.h"
+#include "leo-gps.c"
+
+static uint32_t  checked, failed;
+
+static void expect( NmeaReader*  r, const char*  what, const struct tm*  day, int  sec, int  cs,
+                    GpsUtcTime  want ) {
+    checked += 1;
+    if (r->fix.timestamp != want && failed++ < 20)
+        printf("FAIL %s %04d-%02d-%02d %02d:%02d:%02d.%02d: got %lld want %lld\n", what,
+               day->tm_year + 1900, day->tm_mon + 1, day->tm_mday, sec / 3600, sec / 60 % 60,
+               sec % 60, cs, (long long)r->fix.timestamp, (long long)want);
+}
+
+static void put2( char*  p, int  v ) {
+    p[0] = '0' + v / 10;
+    p[1] = '0' + v % 10;
+}
+
+/* timegm() gives the reference for each midnight, the seconds of the day
+ * are added to it */
+static void sweep_year( NmeaReader*  r, int  year ) {
+    struct tm  day;
+    char       tod[9] = "hhmmss.cc";
+    char       date[6];
+    Token      ttok = { tod, tod + sizeof(tod) };
+    Token      dtok = { date, date + sizeof(date) };
+
+    memset(&day, 0, sizeof(day));
+    day.tm_year = year - 1900;
+    day.tm_mday = 1;
+
+    for (;;) {
+        time_t  midnight = timegm(&day);
+        int     sec;
+
+        gmtime_r(&midnight, &day);
+        if (day.tm_year != year - 1900)
+            break;
+        put2(date,     day.tm_mday);
+        put2(date + 2, day.tm_mon + 1);
+        put2(date + 4, day.tm_year % 100);
+
+        for (sec = 0; sec < 86400; sec++) {
+            // a few sentences off the whole second, as 5 Hz receivers send
+            int         cs   = (sec % 7 == 0) ? 20 * (sec % 5) : 0;
+            GpsUtcTime  want = ((GpsUtcTime)midnight + sec) * 1000 + cs * 10;
+
+            put2(tod,     sec / 3600);
+            put2(tod + 2, sec / 60 % 60);
+            put2(tod + 4, sec % 60);
+            put2(tod + 7, cs);
+
+            // before the first RMC of a sweep, the date isn't known yet
+            nmea_reader_update_time( r, ttok );
+            if (r->utc_year == year)
+                expect( r, "GGA", &day, sec, cs, want );
+            nmea_reader_update_date( r, dtok, ttok );
+            expect( r, "RMC", &day, sec, cs, want );
+        }
+        day.tm_mday += 1;
+    }
+}
+
+int main( int  argc, char**  argv ) {
+    static const int  years[] = { 2000, 2011, 2012, 2038, 2099 };
+    NmeaReader  r[1];
+    int         n;
+
+    if (argc > 1) {
+        for (n = 1; n < argc; n++) {
+            nmea_reader_init( r );
+            sweep_year( r, atoi(argv[n]) );
+        }
+    } else {
+        for (n = 0; n < (int)(sizeof(years) / sizeof(years[0])); n++) {
+            nmea_reader_init( r );
+            sweep_year( r, years[n] );
+        }
+    }
+    printf("utc: checked=%u failed=%u\n", checked, failed);
+    return failed != 0;
+}